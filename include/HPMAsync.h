@@ -0,0 +1,75 @@
+//
+//  HPMAsync.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMFraud.h"
+
+/// Queue of asynchronous operations on a single HPMClient.
+///
+/// Each queue owns a worker thread that performs its operations one at a
+/// time, in submission order; separate queues run in parallel. While a queue
+/// exists, its client must not be used directly.
+typedef struct HPMAsyncQueue HPMAsyncQueue;
+
+/// Asynchronous operation types.
+typedef enum {
+    kHPMAsyncOpRead,      ///< HPMAsyncRead.
+    kHPMAsyncOpDoCommand, ///< HPMAsyncDoCommand.
+    kHPMAsyncOpSendVDM,   ///< HPMAsyncSendVDM.
+} HPMAsyncOp;
+
+/// Outcome of an asynchronous operation.
+typedef struct {
+    HPMAsyncOp op;
+    IOReturn result;
+    void *refcon;        ///< As passed when the operation was submitted.
+
+    HPMReply reply;      ///< Reply of a read.
+    size_t replyLength;  ///< Length of \p reply, for reads.
+    uint8_t commandOut;  ///< First byte of the response, for commands.
+} HPMAsyncCompletion;
+
+/// Completion callback; runs on the queue's worker thread.
+typedef void (*HPMAsyncCallback)(HPMAsyncCompletion const *completion);
+
+/// Create a queue for a client.
+IOReturn HPMAsyncQueueCreate(HPMClient *hpm, HPMAsyncQueue **queue);
+
+/// Finish all submitted operations, then destroy the queue.
+///
+/// Completions that were never collected with HPMAsyncQueueDrain are dropped.
+void HPMAsyncQueueDestroy(HPMAsyncQueue *queue);
+
+/// Get a file descriptor that polls readable while completions are waiting
+/// to be collected with HPMAsyncQueueDrain.
+int HPMAsyncQueueGetFD(HPMAsyncQueue const *queue);
+
+/// Collect up to \p maxCompletions completions, oldest first.
+///
+/// Only operations submitted without a callback end up here. Returns the
+/// number of completions stored.
+size_t HPMAsyncQueueDrain(HPMAsyncQueue *queue, HPMAsyncCompletion *completions, size_t maxCompletions);
+
+/// Submit an HPMRead.
+///
+/// If \p callback is NULL, the completion is queued for HPMAsyncQueueDrain
+/// instead; the same goes for the other submission functions.
+IOReturn HPMAsyncRead(HPMAsyncQueue *queue, uint64_t chip, uint8_t address, uint32_t flags,
+    HPMAsyncCallback callback, void *refcon);
+
+/// Submit an HPMDoCommand. At most sizeof(HPMReply) bytes of \p args are
+/// accepted; they are copied.
+IOReturn HPMAsyncDoCommand(HPMAsyncQueue *queue, uint64_t chip, HPMCommand command,
+    uint8_t const *args, size_t argsLength, HPMAsyncCallback callback, void *refcon);
+
+/// Submit an HPMSendVDM. At most sizeof(HPMReply) bytes of \p body are
+/// accepted; they are copied.
+IOReturn HPMAsyncSendVDM(HPMAsyncQueue *queue, uint64_t chip, void const *body, size_t bodyLength,
+    HPMAsyncCallback callback, void *refcon);
@@ -0,0 +1,83 @@
+//
+//  HPMDiscovery.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMFraud.h"
+
+/// Identity of the device on the other end of a port, as reported in its
+/// Discover Identity response.
+typedef struct {
+    uint16_t vendorID;
+    uint16_t productID;
+    uint16_t bcdDevice;
+} HPMDeviceIdentity;
+
+/// Get the identity of the connected device.
+///
+/// Returns kIOReturnNoDevice if the device has not (yet) identified itself.
+IOReturn HPMGetDeviceIdentity(HPMClient const *hpm, HPMDeviceIdentity *identity);
+
+/// VDM actions recognized by HPMDiscoverCapabilities.
+typedef enum {
+    kHPMCapabilityReboot = 1 << 0,   ///< Reboot; see kHPMKnownVDMReboot.
+    kHPMCapabilityDFU = 1 << 1,      ///< DFU; see kHPMKnownVDMDFU.
+    kHPMCapabilityDebugUSB = 1 << 2, ///< Debug USB; see kHPMKnownVDMDebugUSB.
+} HPMCapability;
+
+/// Maximum number of actions kept from a List response.
+#define kHPMMaxActions 12
+
+/// VDM actions supported by a device.
+typedef struct {
+    uint32_t capabilities;                ///< HPMCapability bits of recognized actions.
+    uint32_t numActions;                  ///< Number of entries in \p actions.
+    uint16_t actions[kHPMMaxActions];     ///< Action IDs, in the order listed.
+    uint32_t actionInfo[kHPMMaxActions];  ///< First object of each Info response, or zero if refused.
+} HPMCapabilities;
+
+/// Ask the connected device which actions it supports.
+///
+/// Sends a List VDM, then an Info VDM for each action listed, reading each
+/// response back from the received VDM register. The client must already be
+/// in DBMa mode.
+IOReturn HPMDiscoverCapabilities(HPMClient const *hpm, HPMCapabilities *caps);
+
+/// On-disk cache of capabilities, keyed by device identity.
+///
+/// The cache is a fixed-size, memory-mapped hash table, so lookups cost a
+/// hash and a few probes no matter how many devices it holds. Any number of
+/// processes may share the same file.
+typedef struct HPMCapabilityCache HPMCapabilityCache;
+
+/// Open a cache file, creating it if needed.
+///
+/// A file that is not a valid cache is reset. Symlinks are not followed, and
+/// files not owned by the effective user, or writable by anyone else, are
+/// refused with kIOReturnNotPermitted.
+IOReturn HPMCapabilityCacheOpen(char const *path, HPMCapabilityCache **cache);
+
+/// Close a cache opened with HPMCapabilityCacheOpen.
+void HPMCapabilityCacheClose(HPMCapabilityCache *cache);
+
+/// Look up the capabilities of a device; returns kIOReturnNotFound on a miss.
+IOReturn HPMCapabilityCacheLookup(HPMCapabilityCache *cache, HPMDeviceIdentity const *identity,
+    HPMCapabilities *caps);
+
+/// Store the capabilities of a device, replacing any previous entry.
+IOReturn HPMCapabilityCacheStore(HPMCapabilityCache *cache, HPMDeviceIdentity const *identity,
+    HPMCapabilities const *caps);
+
+/// Get the capabilities of the connected device, preferring \p cache.
+///
+/// On a miss (or if \p cache is NULL), the port is switched to DBMa mode as
+/// needed to run discovery, and back afterwards (subject to the client's
+/// options); the result is then stored. \p cached, if given, is set to
+/// whether the result came from the cache.
+IOReturn HPMGetCapabilities(HPMClient *hpm, HPMCapabilityCache *cache, HPMCapabilities *caps, int *cached);
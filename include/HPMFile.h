@@ -0,0 +1,22 @@
+//
+//  HPMFile.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+// Helpers for state files (caches, statistics, traces, port locks). These are
+// usually written by root at well-known paths, so they must not be opened
+// through a symlink, or trusted if someone else could have planted or changed
+// them; otherwise root could be tricked into clobbering other files.
+
+/// Open a state file with \p flags (plus O_NOFOLLOW and O_CLOEXEC), creating
+/// it with mode 0644 if O_CREAT is given.
+///
+/// Returns -1 if the file can't be opened, or isn't a regular file owned by
+/// the effective user, with a single link and writable by nobody else.
+int HPMOpenStateFile(char const *path, int flags);
@@ -10,11 +10,114 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__APPLE__)
 #include <IOKit/IOTypes.h>
+#else
+// Minimal subset of <IOKit/IOReturn.h> so the library can be built with just
+// the simulator backend on hosts without IOKit. Values match the real ones.
+typedef int IOReturn;
+
+#define kIOReturnSuccess 0
+#define kIOReturnError ((IOReturn)0xe00002bc)
+#define kIOReturnNoMemory ((IOReturn)0xe00002bd)
+#define kIOReturnNoResources ((IOReturn)0xe00002be)
+#define kIOReturnNoDevice ((IOReturn)0xe00002c0)
+#define kIOReturnNotPrivileged ((IOReturn)0xe00002c1)
+#define kIOReturnBadArgument ((IOReturn)0xe00002c2)
+#define kIOReturnUnsupported ((IOReturn)0xe00002c7)
+#define kIOReturnIOError ((IOReturn)0xe00002ca)
+#define kIOReturnNotOpen ((IOReturn)0xe00002cd)
+#define kIOReturnBusy ((IOReturn)0xe00002d5)
+#define kIOReturnTimeout ((IOReturn)0xe00002d6)
+#define kIOReturnNotReady ((IOReturn)0xe00002d8)
+#define kIOReturnNotPermitted ((IOReturn)0xe00002e2)
+#define kIOReturnUnderrun ((IOReturn)0xe00002e7)
+#define kIOReturnOverrun ((IOReturn)0xe00002e8)
+#define kIOReturnAborted ((IOReturn)0xe00002eb)
+#define kIOReturnNotResponding ((IOReturn)0xe00002ed)
+#define kIOReturnNotFound ((IOReturn)0xe00002f0)
+#endif
+
+/// HPM transport backend.
+///
+/// Backends implement the raw register, command and VDM operations everything
+/// else is built on. The IOKit backend talks to the real AppleHPMUserClient;
+/// the simulator backend (see HPMSim.h) models an ACE chip in-process.
+typedef struct HPMBackend HPMBackend;
+
+/// Get the IOKit backend, or NULL if the library was built without it.
+HPMBackend const *HPMGetIOKitBackend(void);
+
+/// Get the simulator backend.
+HPMBackend const *HPMGetSimBackend(void);
+
+/// Get the backend used by HPMClientOpen; this is IOKit when available.
+HPMBackend const *HPMGetDefaultBackend(void);
+
+/// Look up a backend by name ("iokit", "sim" or "replay"); returns NULL if
+/// unavailable.
+HPMBackend const *HPMGetBackendByName(char const *name);
+
+/// Get the name of a backend.
+char const *HPMBackendGetName(HPMBackend const *backend);
+
+/// Session state of a HPM instance, as last observed through a client.
+typedef enum {
+    kHPMStateUnknown,  ///< Not observed yet, or lost track after an error.
+    kHPMStateApp,      ///< App mode; ACE presumed locked.
+    kHPMStateUnlocked, ///< App mode with ACE unlocked.
+    kHPMStateDBMA,     ///< DBMa mode.
+} HPMState;
+
+/// HPM connection type.
+typedef enum {
+    kHPMConnectionTypeError = -1, ///< Failed to query connection.
+    kHPMConnectionTypeNone = 0,   ///< No physical connection.
+    kHPMConnectionTypeSource = 1, ///< Source connection; expected state for a physical connection.
+    kHPMConnectionTypeSink = 3,   ///< Sink connection; haven't seen this, but it exists.
+    kHPMConnectionTypeMask = 3,   ///< Mask to extract connection type.
+} HPMConnectionType;
+
+/// HPM operating mode.
+typedef enum {
+    kHPMModeError = -1, ///< Failed to get mode.
+    kHPMModeApp,        ///< Normal application mode.
+    kHPMModeDBMA,       ///< DMBa mode.
+    kHPMModeUnknown,    ///< Saw unrecognized other mode.
+} HPMMode;
+
+/// Get a short name for a connection type, e.g. "source".
+char const *HPMConnectionTypeGetName(HPMConnectionType connection);
 
-// Forward declaring these to avoid a bigger IOKit include above.
-struct IOCFPlugInInterfaceStruct;
-struct HPMInterface;
+/// Get a short name for a mode, e.g. "DBMa".
+char const *HPMModeGetName(HPMMode mode);
+
+/// Snapshot of a port's key status registers.
+typedef struct {
+    HPMConnectionType connection; ///< Connection type, from 0x3f.
+    uint8_t connectionRaw;        ///< Whole connection status byte.
+    HPMMode mode;                 ///< Operating mode, from 0x3.
+    uint64_t timestamp;           ///< Monotonic time taken, in nanoseconds; zero if none.
+} HPMStatus;
+
+/// How a wait for a mode transition went; see HPMWaitForMode.
+typedef struct {
+    uint32_t polls;     ///< Number of times the mode was read.
+    uint64_t elapsedNs; ///< Time until the mode was seen, or until giving up.
+} HPMModeWait;
+
+/// Default time HPMEnterDBMA and HPMExitDBMA wait for the mode to flip.
+#define kHPMDefaultModeTimeoutMs 1000
+
+/// HPM client options.
+typedef enum {
+    /// Leave the port in DBMa mode when HPMExitDBMA is called, so that
+    /// back-to-back operations don't bounce the controller between modes.
+    kHPMClientOptionStayInDBMA = 1 << 0,
+} HPMClientOption;
 
 /// HPM client.
 ///
@@ -22,8 +125,20 @@ struct HPMInterface;
 /// if not forbidden, from using the struct members directly. Originally they
 /// were void pointers to further-emphasize this.
 typedef struct {
-    struct IOCFPlugInInterfaceStruct **plugin;
-    struct HPMInterface const **interface;
+    HPMBackend const *backend;
+    void *context;
+    int32_t rid;
+
+    HPMState state;
+    uint32_t options;
+
+    HPMStatus status;
+    uint32_t statusMaxAgeMs;
+
+    uint32_t modeTimeoutMs;
+    HPMModeWait lastModeWait;
+
+    struct HPMRetryPolicy *retryPolicy; ///< See HPMClientSetRetryPolicy.
 } HPMClient;
 
 /// Open a HPM client with the specified RID.
@@ -40,32 +155,79 @@ typedef struct {
 /// \param rid RID of the target HPM instance to match
 IOReturn HPMClientOpen(HPMClient *hpm, int32_t rid);
 
+/// Open a HPM client with the specified RID using a specific backend.
+IOReturn HPMClientOpenWithBackend(HPMClient *hpm, HPMBackend const *backend, int32_t rid);
+
+/// Maximum number of HPM instances (ports) tracked per backend.
+#define kHPMMaxRIDs 16
+
+/// Description of a HPM instance (AppleHPM service).
+typedef struct {
+    int32_t rid;         ///< RID of the instance.
+    uint64_t registryID; ///< Registry entry ID of the service.
+    char name[64];       ///< Registry entry name.
+    char location[64];   ///< Location in the service plane, if any.
+} HPMServiceInfo;
+
+/// Get all HPM instances available through a backend.
+///
+/// The registry is walked once and the result cached; the cache is rebuilt
+/// only after the backend reports services appearing or disappearing, so
+/// repeated calls (and client opens) are cheap.
+///
+/// \param services Buffer to receive services, in registry order
+/// \param maxServices Capacity of \p services
+/// \param[out] numServices Number of services stored to \p services
+IOReturn HPMGetServices(HPMBackend const *backend, HPMServiceInfo *services,
+    size_t maxServices, size_t *numServices);
+
+/// Look up the HPM instance with the given RID.
+IOReturn HPMLookupService(HPMBackend const *backend, int32_t rid, HPMServiceInfo *info);
+
+/// Discard a backend's cached services, forcing a registry walk on next use.
+///
+/// This also counts as a change for HPMWaitForChange.
+void HPMInvalidateServices(HPMBackend const *backend);
+
+/// Get the number of change notifications a backend has delivered so far,
+/// i.e. services coming or going, or a port's state changing.
+uint64_t HPMGetChangeGeneration(HPMBackend const *backend);
+
+/// Wait up to \p timeoutMs for a change notification after \p generation.
+///
+/// On success, \p generation is updated to the latest one. Returns
+/// kIOReturnTimeout if none arrives, which is always the case for a backend
+/// that cannot deliver notifications.
+IOReturn HPMWaitForChange(HPMBackend const *backend, uint64_t *generation, uint32_t timeoutMs);
+
+/// List the RIDs of all HPM instances available through a backend.
+///
+/// \param rids Buffer to receive RIDs, in registry order
+/// \param maxRIDs Capacity of \p rids
+/// \param[out] numRIDs Number of RIDs stored to \p rids
+IOReturn HPMEnumerateRIDs(HPMBackend const *backend, int32_t *rids, size_t maxRIDs, size_t *numRIDs);
+
 /// Close a HPM client.
 void HPMClientClose(HPMClient *hpm);
 
-/// HPM connection type.
-typedef enum {
-    kHPMConnectionTypeError = -1, ///< Failed to query connection.
-    kHPMConnectionTypeNone = 0,   ///< No physical connection.
-    kHPMConnectionTypeSource = 1, ///< Source connection; expected state for a physical connection.
-    kHPMConnectionTypeSink = 3,   ///< Sink connection; haven't seen this, but it exists.
-    kHPMConnectionTypeMask = 3,   ///< Mask to extract connection type.
-} HPMConnectionType;
-
 /// Get the current HPM connection state.
 HPMConnectionType HPMGetConnectionType(HPMClient const *hpm);
 
-/// HPM operating mode.
-typedef enum {
-    kHPMModeError = -1, ///< Failed to get mode.
-    kHPMModeApp,        ///< Normal application mode.
-    kHPMModeDBMA,       ///< DMBa mode.
-    kHPMModeUnknown,    ///< Saw unrecognized other mode.
-} HPMMode;
-
 /// Get the current HPM mode.
 IOReturn HPMGetMode(HPMClient const *hpm, HPMMode *modeOut);
 
+/// Get the port's connection type and mode together.
+///
+/// The result is kept in the client, and returned as-is by later calls made
+/// within \p maxAgeMs of it; pass zero to always read the registers. Mode
+/// switches through HPMEnterDBMA and HPMExitDBMA keep the snapshot current,
+/// and HPMInvalidateState discards it.
+IOReturn HPMGetStatus(HPMClient *hpm, uint32_t maxAgeMs, HPMStatus *status);
+
+/// Let HPMEnterDBMA reuse a status snapshot up to \p maxAgeMs old instead of
+/// reading the mode again. Defaults to zero, i.e. never.
+void HPMClientSetStatusMaxAge(HPMClient *hpm, uint32_t maxAgeMs);
+
 /// Type alias for a buffer suitable for holding a HPM reply.
 typedef uint8_t HPMReply[64];
 
@@ -79,6 +241,33 @@ typedef uint8_t HPMReply[64];
 IOReturn HPMRead(HPMClient const *hpm, uint64_t chip, uint8_t address,
     uint32_t flags, uint8_t *reply, size_t *replyLength);
 
+/// A single read for HPMReadMany.
+typedef struct {
+    uint64_t chip;
+    uint8_t address;
+    uint32_t flags;
+} HPMReadRequest;
+
+/// Outcome of a single read from HPMReadMany.
+typedef struct {
+    IOReturn result;
+    size_t length;
+    HPMReply reply;
+} HPMReadResult;
+
+/// HPMReadMany options.
+typedef enum {
+    /// Read each chip's registers on its own thread.
+    kHPMReadManyOptionParallelChips = 1 << 0,
+} HPMReadManyOption;
+
+/// Read many registers at once.
+///
+/// Every request is attempted, and its outcome stored at the same index of
+/// \p results. Returns the first failure in request order, if any.
+IOReturn HPMReadMany(HPMClient const *hpm, HPMReadRequest const *requests, size_t count,
+    HPMReadResult *results, uint32_t options);
+
 /// Known HPM commands.
 typedef enum {
     kHPMCommandDBMA = 'DBMa', ///< Enter/exit DBMa mode.
@@ -118,4 +307,63 @@ typedef enum {
 IOReturn HPMSendKnownVDM(HPMClient const *hpm, uint64_t chip, HPMKnownVDM knownVDM);
 
 /// Attempt to unlock ACE.
+///
+/// `LOCK` is retried according to HPMGetUnlockRetryPolicy (see HPMRetry.h),
+/// on top of the client's own policy. This always talks to the hardware;
+/// prefer HPMEnterDBMA, which skips the unlock when it is already known to be
+/// done.
 IOReturn HPMUnlockACE(HPMClient const *hpm);
+
+/// Set client options; see HPMClientOption.
+void HPMClientSetOptions(HPMClient *hpm, uint32_t options);
+
+/// Get the session state last observed through the client.
+///
+/// State is only tracked by HPMEnterDBMA and HPMExitDBMA. Anything that
+/// changes the mode behind their back (including HPMDoCommand with DBMa or
+/// Gaid) should be followed by HPMInvalidateState.
+HPMState HPMGetState(HPMClient const *hpm);
+
+/// Forget the tracked session state and status snapshot, so they are re-read
+/// on next use.
+void HPMInvalidateState(HPMClient *hpm);
+
+/// Unlock ACE and switch to DBMa mode, skipping steps already done.
+///
+/// If this fails, the state is left at the last step that is known to have
+/// succeeded; e.g. kHPMStateApp means unlocking ACE failed.
+IOReturn HPMEnterDBMA(HPMClient *hpm);
+
+/// Switch back to app mode, unless already there.
+///
+/// This does nothing while kHPMClientOptionStayInDBMA is set; clear the option
+/// first to force the switch.
+IOReturn HPMExitDBMA(HPMClient *hpm);
+
+/// Wait for the port to report \p target mode.
+///
+/// The mode is read back-to-back a few times first, since a quick controller
+/// will have switched by then, and then at exponentially growing intervals.
+/// Returns kIOReturnTimeout if the mode has not flipped within \p timeoutMs;
+/// zero means a single read. \p wait, if given, receives the number of polls
+/// made and the time taken either way.
+IOReturn HPMWaitForMode(HPMClient const *hpm, HPMMode target, uint32_t timeoutMs, HPMModeWait *wait);
+
+/// Set how long HPMEnterDBMA and HPMExitDBMA wait for the mode to flip after
+/// requesting a switch. Defaults to kHPMDefaultModeTimeoutMs.
+void HPMClientSetModeTimeout(HPMClient *hpm, uint32_t timeoutMs);
+
+/// Get how the wait for the last mode switch through the client went.
+///
+/// Both fields are zero if no switch has been made yet.
+void HPMGetLastModeWait(HPMClient const *hpm, HPMModeWait *wait);
+
+/// Wait for the device on a port to disconnect and come back, as it does
+/// after a reboot or DFU VDM.
+///
+/// The connection type is re-checked whenever the backend reports a change,
+/// and otherwise polled at an interval that starts short and backs off. If
+/// the port's service is torn down along with the connection, the client is
+/// reopened once it reappears. Returns kIOReturnTimeout if the device has not
+/// re-attached within \p timeoutMs.
+IOReturn HPMWaitForReattach(HPMClient *hpm, uint32_t timeoutMs);
@@ -0,0 +1,56 @@
+//
+//  HPMMetrics.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMFraud.h"
+
+#include <stdio.h>
+
+/// Number of distinct error codes counted separately; any further codes are
+/// counted together.
+#define kHPMMaxErrorCodes 32
+
+/// Number of times an error code was returned.
+typedef struct {
+    IOReturn code;
+    uint64_t count;
+} HPMErrorCount;
+
+/// Snapshot of the counters the library keeps for this process.
+///
+/// The counters are updated with relaxed atomics as operations complete, so
+/// keeping them costs next to nothing; they start at zero and only go up.
+typedef struct {
+    uint64_t vdmsSent[kHPMMaxRIDs];       ///< VDMs sent successfully.
+    uint64_t unlockAttempts[kHPMMaxRIDs]; ///< `LOCK` attempts made by HPMUnlockACE, including retries.
+
+    /// Connection type and mode last read from each port, e.g. by
+    /// HPMGetStatus, and when (monotonic nanoseconds; zero if never).
+    HPMConnectionType connection[kHPMMaxRIDs];
+    HPMMode mode[kHPMMaxRIDs];
+    uint64_t statusAt[kHPMMaxRIDs];
+
+    /// Errors returned by the backend (each failed read, write, command, VDM
+    /// or open, including ones later retried), by code.
+    HPMErrorCount errors[kHPMMaxErrorCodes];
+    size_t numErrors;
+    uint64_t otherErrors; ///< Errors with codes beyond the first kHPMMaxErrorCodes seen.
+} HPMCounters;
+
+/// Get a snapshot of this process's counters.
+void HPMGetCounters(HPMCounters *counters);
+
+/// Write this process's counters, the unlock retry policy's counters and the
+/// latency histograms of HPMStats.h in the OpenMetrics text format.
+IOReturn HPMMetricsWrite(FILE *file);
+
+/// Write metrics as HPMMetricsWrite does to the file at \p path, replacing it
+/// atomically so that collectors never see a partial file.
+IOReturn HPMMetricsWriteFile(char const *path);
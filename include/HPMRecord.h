@@ -0,0 +1,49 @@
+//
+//  HPMRecord.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMFraud.h"
+
+/// Start recording every call made through \p backend to a log at \p path.
+///
+/// The returned backend forwards to \p backend and logs each call with its
+/// arguments, replies, result and timing, along with change notifications;
+/// use it in place of \p backend for everything that should be recorded.
+/// Only one recording can be in progress at a time.
+IOReturn HPMRecordStart(HPMBackend const *backend, char const *path, HPMBackend const **recorder);
+
+/// Finish the recording in progress, flushing the log.
+///
+/// No clients may still be open on the recording backend.
+IOReturn HPMRecordStop(void);
+
+/// Replay configuration.
+typedef struct {
+    /// Factor recorded call durations are scaled by: 1 for the original
+    /// timing, 0.5 for twice as fast, or 0 to reply immediately.
+    double timeScale;
+} HPMReplayConfig;
+
+/// Load a log written by HPMRecordStart for the replay backend to serve.
+///
+/// Each client opened on the replay backend is matched to the next recorded
+/// client for the same RID, and its calls are answered from that client's
+/// recorded calls: the next one with the same operation, chip and register
+/// or command, or the closest earlier one if there is none ahead (e.g. for
+/// extra polls). Writes and VDMs must also send the same data as recorded,
+/// so e.g. a DFU VDM is never answered by a recorded reboot. Calls with no
+/// recorded counterpart at all fail with kIOReturnUnsupported. Notifications are delivered once replay passes the
+/// point they were recorded at.
+///
+/// Must not be called while replay clients are open.
+IOReturn HPMReplayLoad(char const *path, HPMReplayConfig const *config);
+
+/// Get the replay backend; it has no ports until a log is loaded.
+HPMBackend const *HPMGetReplayBackend(void);
@@ -0,0 +1,96 @@
+//
+//  HPMRetry.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMFraud.h"
+
+/// Classes of errors, for deciding which ones are worth retrying.
+typedef enum {
+    kHPMRetryClassBusy = 1 << 0,    ///< kIOReturnBusy, kIOReturnNotReady.
+    kHPMRetryClassTimeout = 1 << 1, ///< kIOReturnTimeout, kIOReturnNotResponding.
+    kHPMRetryClassIOError = 1 << 2, ///< kIOReturnIOError, kIOReturnError, kIOReturnAborted.
+    kHPMRetryClassOther = 1 << 3,   ///< Anything else, e.g. bad arguments or no device.
+
+    /// The classes that tend to go away on their own.
+    kHPMRetryClassTransient = kHPMRetryClassBusy | kHPMRetryClassTimeout | kHPMRetryClassIOError,
+    kHPMRetryClassAll = kHPMRetryClassTransient | kHPMRetryClassOther,
+} HPMRetryClass;
+
+/// Get the class of an error; returns zero for kIOReturnSuccess.
+HPMRetryClass HPMRetryClassify(IOReturn ret);
+
+/// Actions taken between a failed attempt and the next one.
+typedef enum {
+    kHPMRetryRecoveryNone, ///< Just back off.
+    kHPMRetryRecoveryGAID, ///< Issue `Gaid` first, then restore the ACE unlock or DBMa mode the client had.
+} HPMRetryRecovery;
+
+/// Retry policy configuration.
+typedef struct {
+    uint32_t maxAttempts;      ///< Attempts per operation, including the first; zero counts as one.
+    uint32_t initialBackoffUs; ///< Delay before the first retry.
+    uint32_t maxBackoffUs;     ///< Cap on the delay between retries.
+    uint32_t multiplier;       ///< Factor the delay grows by after each retry; zero counts as one.
+    uint32_t retryOn;          ///< HPMRetryClass bits of errors to retry.
+    HPMRetryRecovery recovery; ///< Action taken before each retry.
+} HPMRetryConfig;
+
+/// Get a configuration suitable for most operations: three attempts, with
+/// 1 ms of backoff doubling up to 20 ms, retrying only transient errors.
+void HPMRetryConfigGetDefault(HPMRetryConfig *config);
+
+/// Counters kept by a retry policy across all operations run through it.
+typedef struct {
+    uint64_t operations; ///< Operations run.
+    uint64_t attempts;   ///< Attempts across all operations.
+    uint64_t recoveries; ///< Recovery actions taken.
+    uint64_t failures;   ///< Operations that failed in the end.
+    uint64_t backoffNs;  ///< Total time spent backing off.
+} HPMRetryStats;
+
+/// Retry policy; may be shared by any number of clients and threads.
+typedef struct HPMRetryPolicy HPMRetryPolicy;
+
+/// Create a retry policy.
+IOReturn HPMRetryPolicyCreate(HPMRetryConfig const *config, HPMRetryPolicy **policy);
+
+/// Destroy a policy created with HPMRetryPolicyCreate.
+///
+/// No client may still be using it.
+void HPMRetryPolicyDestroy(HPMRetryPolicy *policy);
+
+/// Get the configuration of a policy.
+void HPMRetryPolicyGetConfig(HPMRetryPolicy const *policy, HPMRetryConfig *config);
+
+/// Get a snapshot of a policy's counters.
+void HPMRetryPolicyGetStats(HPMRetryPolicy const *policy, HPMRetryStats *stats);
+
+/// Get the policy HPMUnlockACE runs `LOCK` under: two attempts with a `Gaid`
+/// in between, on any error. Each attempt is itself retried according to the
+/// client's policy, if any.
+HPMRetryPolicy *HPMGetUnlockRetryPolicy(void);
+
+/// An operation to run under a retry policy.
+typedef IOReturn (*HPMRetryOperation)(HPMClient const *hpm, void *refcon);
+
+/// Run \p operation until it succeeds, fails with an error the policy does
+/// not retry, or runs out of attempts; returns the last result.
+///
+/// Recovery actions are issued once, without retries, and then leave the port
+/// in the state the client tracks (see HPMGetState); if that can't be done, the
+/// client's state is invalidated, no further attempts are made and the
+/// operation's last result is returned.
+IOReturn HPMRetryRun(HPMRetryPolicy *policy, HPMClient const *hpm, HPMRetryOperation operation, void *refcon);
+
+/// Make HPMRead, HPMDoCommand and HPMSendVDM on \p hpm retry according to
+/// \p policy, or pass NULL (the default) to make them fail on the first error.
+///
+/// The policy is not copied and must outlive its use by the client.
+void HPMClientSetRetryPolicy(HPMClient *hpm, HPMRetryPolicy *policy);
@@ -0,0 +1,86 @@
+//
+//  HPMSession.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMFraud.h"
+#include "HPMRetry.h"
+
+/// Steps of the flow a session runs, for telling which one failed.
+typedef enum {
+    kHPMSessionStepNone,       ///< Nothing has failed.
+    kHPMSessionStepOpen,       ///< Opening (or reopening) the client.
+    kHPMSessionStepConnection, ///< Checking that something is connected.
+    kHPMSessionStepUnlock,     ///< Unlocking ACE.
+    kHPMSessionStepEnterDBMA,  ///< Switching to DBMa mode.
+    kHPMSessionStepSendVDM,    ///< Sending the VDM.
+    kHPMSessionStepExitDBMA,   ///< Switching back to app mode.
+    kHPMSessionStepReattach,   ///< Waiting for the device to come back.
+} HPMSessionStep;
+
+/// Get a short description of a failed step, e.g. "Failed to unlock ACE".
+char const *HPMSessionStepGetDescription(HPMSessionStep step);
+
+/// Session configuration.
+typedef struct {
+    HPMBackend const *backend;   ///< Backend to use, or NULL for the default.
+    int32_t rid;                 ///< RID of the port.
+    uint32_t options;            ///< HPMClientOption bits.
+    uint32_t modeTimeoutMs;      ///< See HPMClientSetModeTimeout; zero for the default.
+    HPMRetryPolicy *retryPolicy; ///< See HPMClientSetRetryPolicy; may be NULL.
+} HPMSessionConfig;
+
+/// High-level handle on a port, running the whole unlock, DBMa, VDM and exit
+/// flow with plain error returns.
+///
+/// A session keeps its client open across any number of operations, and
+/// skips steps it knows are already done. If the port's service goes away
+/// (e.g. across a reboot), the client is reopened on the next operation. A
+/// session may only be used by one thread at a time.
+typedef struct HPMSession HPMSession;
+
+/// Open a session; the port is not touched beyond opening a client for it.
+IOReturn HPMSessionCreate(HPMSessionConfig const *config, HPMSession **session);
+
+/// Close a session, without switching modes; call HPMSessionExitDBMA first to
+/// leave the port in app mode.
+void HPMSessionDestroy(HPMSession *session);
+
+/// Get the session's client, for operations the session doesn't wrap.
+HPMClient *HPMSessionGetClient(HPMSession *session);
+
+/// Set client options; see HPMClientOption.
+void HPMSessionSetOptions(HPMSession *session, uint32_t options);
+
+/// Get the step the last failed operation failed at, or kHPMSessionStepNone
+/// if the last operation succeeded.
+HPMSessionStep HPMSessionGetFailedStep(HPMSession const *session);
+
+/// Check that something is physically connected to the port.
+///
+/// Returns kIOReturnNoDevice if nothing is. The status snapshot taken is
+/// reused by HPMSessionEnterDBMA, so checking first costs no extra reads.
+IOReturn HPMSessionCheckConnection(HPMSession *session);
+
+/// Unlock ACE and switch the port to DBMa mode, unless already in it.
+IOReturn HPMSessionEnterDBMA(HPMSession *session);
+
+/// Switch the port back to app mode, subject to kHPMClientOptionStayInDBMA.
+IOReturn HPMSessionExitDBMA(HPMSession *session);
+
+/// Send a VDM with an arbitrary body, doing everything needed before and
+/// after: checking the connection, entering DBMa mode, and exiting it again
+/// (even if sending failed).
+IOReturn HPMSessionSendVDM(HPMSession *session, void const *body, size_t bodyLength);
+
+/// Send a known VDM, like HPMSessionSendVDM.
+IOReturn HPMSessionSendKnownVDM(HPMSession *session, HPMKnownVDM knownVDM);
+
+/// Wait for the device to disconnect and come back; see HPMWaitForReattach.
+IOReturn HPMSessionWaitForReattach(HPMSession *session, uint32_t timeoutMs);
@@ -0,0 +1,75 @@
+//
+//  HPMSim.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMFraud.h"
+
+/// Maximum number of ports the simulator can model.
+#define kHPMSimMaxPorts 16
+
+/// Simulated ACE configuration.
+///
+/// The simulator models the subset of ACE behavior HPMFraud relies on: the
+/// mode (0x3), connection (0x3f), data (0x9), partner identity (0x48) and
+/// received VDM (0x4f) registers, the `LOCK`, `Gaid` and `DBMa` commands, and
+/// VDMs being accepted only in DBMa mode. The partner answers List and Info
+/// VDMs for the reboot, DFU and Debug USB actions. State is kept per port, so
+/// multiple clients for the same RID observe each other.
+///
+/// If \p reattachDelayUs is set, reboot and DFU VDMs also make the port's
+/// connection drop after \p detachDelayUs and come back \p reattachDelayUs
+/// later, with a change notification at each transition.
+typedef struct {
+    uint32_t numPorts;               ///< Ports exist for RIDs 0 through numPorts - 1.
+    HPMConnectionType connection;    ///< Connection type reported by every port.
+    uint8_t unlockKey[4];            ///< Key expected by `LOCK`.
+    uint32_t lockFailures;           ///< `LOCK` attempts that fail transiently after each open.
+    uint32_t faultsPerMille;         ///< Chance in 1000 of any operation failing with kIOReturnBusy.
+    uint16_t productID;              ///< USB product ID reported in the partner's identity.
+    uint32_t detachDelayUs;          ///< Time from a reset VDM to the connection dropping.
+    uint32_t reattachDelayUs;        ///< Time the connection stays down after a reset; 0 to disable.
+    uint32_t modeSwitchDelayUs;      ///< Time from a `DBMa` command to the mode changing.
+
+    uint32_t openLatencyUs;          ///< Added latency for opening a client.
+    uint32_t readLatencyUs;          ///< Added latency per register read.
+    uint32_t writeLatencyUs;         ///< Added latency per register write.
+    uint32_t commandLatencyUs;       ///< Added latency per command.
+    uint32_t vdmLatencyUs;           ///< Added latency per VDM.
+} HPMSimConfig;
+
+/// Get the active simulator configuration.
+void HPMSimGetConfig(HPMSimConfig *config);
+
+/// Replace the simulator configuration and reset all port state.
+///
+/// Must not be called while simulated clients are open.
+void HPMSimSetConfig(HPMSimConfig const *config);
+
+/// Update \p config from a comma-separated list of `key=value` pairs.
+///
+/// Recognized keys are `ports`, `conn` (none/source/sink), `key` (four
+/// characters), `lock-failures`, `faults` (per thousand operations), `pid`,
+/// `detach`, `reattach`, `switch` (mode switch delay), `latency` (applies to
+/// all operations), and `open`, `read`, `write`, `command`, `vdm` for
+/// individual latencies. All delays and latencies are in microseconds.
+IOReturn HPMSimParseConfig(char const *spec, HPMSimConfig *config);
+
+/// Per-port operation counters.
+typedef struct {
+    uint64_t opens;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t commands;
+    uint64_t vdms;
+    uint64_t faults; ///< Operations failed on purpose; see faultsPerMille.
+} HPMSimStats;
+
+/// Get the operation counters for a simulated port.
+IOReturn HPMSimGetStats(int32_t rid, HPMSimStats *stats);
@@ -0,0 +1,94 @@
+//
+//  HPMStats.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMFraud.h"
+
+#include <stdio.h>
+
+/// Operations the library keeps latency statistics for.
+typedef enum {
+    kHPMStatsOpOpen,      ///< HPMClientOpen and HPMClientOpenWithBackend.
+    kHPMStatsOpUnlock,    ///< HPMUnlockACE, including any retries.
+    kHPMStatsOpEnterDBMA, ///< Switching into DBMa mode and confirming the switch.
+    kHPMStatsOpExitDBMA,  ///< Switching back to app mode and confirming the switch.
+    kHPMStatsOpSendVDM,   ///< HPMSendVDM, including any retries.
+    kHPMStatsOpCount,
+} HPMStatsOp;
+
+/// Histogram buckets per power of two; values land in a bucket no wider than
+/// 1/8 of themselves, so percentiles are accurate to within about 6%.
+#define kHPMHistogramSubBuckets 8
+
+/// Number of histogram buckets. Values below 8 get a bucket each; the rest
+/// cover up to 2^34 ns (about 17 seconds), beyond which values share the
+/// last bucket.
+#define kHPMHistogramBuckets 256
+
+/// Log-linear histogram of operation durations, in nanoseconds.
+///
+/// All histograms share the same bucket layout, so histograms from different
+/// ports, processes or hosts can be merged by adding them up.
+typedef struct {
+    uint64_t count;  ///< Number of operations.
+    uint64_t errors; ///< Number of operations that failed.
+    uint64_t sum;    ///< Total duration.
+    uint64_t min;    ///< Shortest duration, if any operations were counted.
+    uint64_t max;    ///< Longest duration.
+    uint64_t buckets[kHPMHistogramBuckets];
+} HPMHistogram;
+
+/// Count an operation in a histogram.
+void HPMHistogramRecord(HPMHistogram *histogram, uint64_t durationNs, IOReturn result);
+
+/// Add the counts of \p from to \p into.
+void HPMHistogramMerge(HPMHistogram *into, HPMHistogram const *from);
+
+/// Get the duration below which \p percentile percent of operations fell,
+/// e.g. 99 for the 99th percentile; returns zero for an empty histogram.
+uint64_t HPMHistogramGetPercentile(HPMHistogram const *histogram, double percentile);
+
+/// Latency histograms for each operation and RID.
+///
+/// This is fairly large (about 160 KiB), so avoid putting it on the stack.
+typedef struct {
+    HPMHistogram histograms[kHPMStatsOpCount][kHPMMaxRIDs];
+} HPMStats;
+
+/// Add the statistics this process has gathered so far to \p stats.
+///
+/// The library counts every operation listed in HPMStatsOp as it completes,
+/// into histograms in fixed memory; this takes a snapshot of them.
+void HPMStatsCollect(HPMStats *stats);
+
+/// Forget the statistics this process has gathered so far.
+void HPMStatsReset(void);
+
+/// Write statistics as text, skipping empty histograms.
+IOReturn HPMStatsWrite(HPMStats const *stats, FILE *file);
+
+/// Read statistics written by HPMStatsWrite, adding them to \p stats.
+///
+/// Returns kIOReturnBadArgument if \p file is malformed or was written with a
+/// different bucket layout.
+IOReturn HPMStatsRead(HPMStats *stats, FILE *file);
+
+/// Add the statistics this process has gathered so far to the file at
+/// \p path, creating it if needed.
+///
+/// The file is locked while being updated, so any number of processes may
+/// save to the same file, and is replaced atomically, so readers never see a
+/// partial one. Symlinks are not followed, and files not owned by the
+/// effective user, or writable by anyone else, are refused with
+/// kIOReturnNotPermitted. Does nothing if no operations have been counted.
+IOReturn HPMStatsSave(char const *path);
+
+/// Get a short name for an operation, e.g. "send-vdm".
+char const *HPMStatsOpGetName(HPMStatsOp op);
@@ -0,0 +1,77 @@
+//
+//  HPMStatusTable.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMFraud.h"
+
+/// Name of the shared memory object vdmpokd publishes port status under.
+#define kHPMStatusTableDefaultName "/vdmpoke.status"
+
+/// Published status of a port.
+///
+/// Timestamps are CLOCK_MONOTONIC nanoseconds, comparable between processes
+/// on the same host; zero means never.
+typedef struct {
+    int32_t rid;                  ///< RID of the port.
+    uint32_t present;             ///< Whether the port's service existed at the last refresh.
+    HPMConnectionType connection; ///< Connection type; see HPMStatus.
+    uint8_t connectionRaw;        ///< Whole connection status byte.
+    HPMMode mode;                 ///< Operating mode.
+    IOReturn readResult;          ///< Result of the last status read.
+    IOReturn lastVDMResult;       ///< Result of the last VDM sent by the publisher.
+    uint64_t updatedAt;           ///< When the status was last read.
+    uint64_t changedAt;           ///< When the connection or mode last changed.
+    uint64_t lastVDMAt;           ///< When the last VDM was sent.
+    uint64_t updates;             ///< Number of times this entry has been published.
+} HPMPortStatus;
+
+/// Per-RID status table in shared memory.
+///
+/// A single process (normally vdmpokd) publishes into the table, and any
+/// number of others read from it. Each entry is guarded by a sequence lock:
+/// readers never block the publisher, never make a system call, and simply
+/// retry if they catch an entry mid-update.
+typedef struct HPMStatusTable HPMStatusTable;
+
+/// Create (or take over) a table for publishing; pass NULL for the default
+/// name. Entries left by a previous publisher are kept until refreshed.
+IOReturn HPMStatusTableCreate(char const *name, HPMStatusTable **table);
+
+/// Open an existing table for reading; pass NULL for the default name.
+///
+/// Returns kIOReturnNotFound if nothing is publishing under \p name.
+IOReturn HPMStatusTableOpen(char const *name, HPMStatusTable **table);
+
+/// Close a table opened with HPMStatusTableOpen.
+void HPMStatusTableClose(HPMStatusTable *table);
+
+/// Close a table created with HPMStatusTableCreate and remove it, so readers
+/// no longer find it.
+void HPMStatusTableDestroy(HPMStatusTable *table);
+
+/// Get the PID of the process publishing into a table.
+int32_t HPMStatusTableGetPublisher(HPMStatusTable const *table);
+
+/// Read the entry for \p rid; lock-free and safe from any thread.
+///
+/// Returns kIOReturnNotFound if nothing has been published for \p rid yet, or
+/// kIOReturnBusy if the entry was being updated on every attempt, which only
+/// happens if the publisher died mid-update.
+IOReturn HPMStatusTableRead(HPMStatusTable const *table, int32_t rid, HPMPortStatus *status);
+
+/// Read every port's status through \p backend and publish it. Ports that no
+/// longer exist are published as not present.
+///
+/// Clients are opened just for the read, without taking any locks; reading
+/// the status registers is harmless alongside whatever else uses the port.
+IOReturn HPMStatusTableRefresh(HPMStatusTable *table, HPMBackend const *backend);
+
+/// Publish the result of a VDM sent to \p rid.
+IOReturn HPMStatusTableRecordVDM(HPMStatusTable *table, int32_t rid, IOReturn result);
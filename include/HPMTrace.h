@@ -0,0 +1,108 @@
+//
+//  HPMTrace.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMFraud.h"
+
+#include <stdio.h>
+
+/// Traced HPM operations.
+typedef enum {
+    kHPMTraceOpClientOpen, ///< HPMClientOpen and friends.
+    kHPMTraceOpRead,       ///< Register read, including HPMDoCommand's reply read.
+    kHPMTraceOpWrite,      ///< Argument write leg of HPMDoCommand.
+    kHPMTraceOpCommand,    ///< Command leg of HPMDoCommand.
+    kHPMTraceOpDoCommand,  ///< HPMDoCommand as a whole.
+    kHPMTraceOpSendVDM,    ///< HPMSendVDM.
+    kHPMTraceOpWaitForMode, ///< HPMWaitForMode; the argument is the number of polls.
+    kHPMTraceOpCount,
+} HPMTraceOp;
+
+/// A single traced operation.
+typedef struct {
+    uint64_t start;    ///< Monotonic start time, in nanoseconds.
+    uint64_t duration; ///< Duration, in nanoseconds.
+    uint64_t chip;     ///< Target chip.
+    uint32_t arg;      ///< Register address or command, depending on the op.
+    uint32_t flags;    ///< Flags passed to the backend, if any.
+    uint32_t length;   ///< Bytes read or sent, if any.
+    int32_t rid;       ///< RID of the client.
+    IOReturn result;   ///< Result of the operation.
+    HPMTraceOp op;
+} HPMTraceEvent;
+
+/// Trace export formats.
+typedef enum {
+    kHPMTraceFormatJSON,   ///< Plain JSON array of events.
+    kHPMTraceFormatChrome, ///< Chrome trace event format (chrome://tracing, Perfetto).
+} HPMTraceFormat;
+
+/// Start recording events into a ring buffer holding the last \p capacity.
+///
+/// The capacity is rounded up to a power of two. Tracing is off by default;
+/// while off, each traced operation costs a single predictable branch.
+///
+/// Like HPMTraceDisable, which this calls first, this is not thread-safe: call
+/// it before starting any threads that use HPM clients.
+IOReturn HPMTraceEnable(size_t capacity);
+
+/// Start recording events into a binary trace file holding the last
+/// \p capacity (rounded up to a power of two).
+///
+/// The file is sized up front and mapped into memory, so recording an event
+/// costs an atomic increment and a 56-byte copy, with no system calls. If the
+/// file already holds a trace with the same capacity, events are appended to
+/// it, and any number of processes may append to the same file at once. Use
+/// vdmpoke-trace to read it.
+///
+/// A file holding anything else is replaced with a new one rather than
+/// resized, so that processes still appending to (or reading) the old one
+/// are unaffected. Symlinks are not followed, and files not owned by the
+/// effective user, or writable by anyone else, are refused with
+/// kIOReturnNotPermitted. Not thread-safe; see HPMTraceEnable.
+IOReturn HPMTraceEnableFile(char const *path, size_t capacity);
+
+/// Stop recording events and free the ring buffer, or unmap the trace file.
+///
+/// Not thread-safe: an operation already recording an event on another thread
+/// would write to freed memory. Only call this once no other threads are
+/// using HPM clients.
+void HPMTraceDisable(void);
+
+/// Copy recorded events, oldest first; returns the number copied.
+size_t HPMTraceCopyEvents(HPMTraceEvent *events, size_t maxEvents);
+
+/// Write all recorded events to a file.
+IOReturn HPMTraceExport(FILE *file, HPMTraceFormat format);
+
+/// Get a short name for a traced operation, e.g. "read".
+char const *HPMTraceOpGetName(HPMTraceOp op);
+
+#define kHPMTraceFileMagic 0x52545048 // 'HPTR'
+#define kHPMTraceFileVersion 1
+
+/// Header of a binary trace file, in host byte order.
+typedef struct {
+    uint32_t magic;         ///< kHPMTraceFileMagic.
+    uint32_t version;       ///< kHPMTraceFileVersion.
+    uint32_t recordSize;    ///< sizeof(HPMTraceFileRecord).
+    uint32_t reserved;
+    uint64_t capacity;      ///< Number of records the file holds; a power of two.
+    uint64_t head;          ///< Number of events ever recorded; updated atomically.
+    int64_t realtimeOffset; ///< Wall clock time minus monotonic time, in nanoseconds.
+    uint8_t padding[24];
+} HPMTraceFileHeader;
+
+/// Record of a binary trace file. The header is followed by \p capacity of
+/// these; event \p i lives in record \p i modulo the capacity.
+typedef struct {
+    uint64_t seq; ///< Index of the event plus one, or zero while being written; updated atomically.
+    HPMTraceEvent event;
+} HPMTraceFileRecord;
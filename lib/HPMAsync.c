@@ -0,0 +1,283 @@
+//
+//  HPMAsync.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "HPMAsync.h"
+
+#include "HPMDebug.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct HPMAsyncRequest HPMAsyncRequest;
+struct HPMAsyncRequest {
+    HPMAsyncRequest *next;
+    HPMAsyncCallback callback;
+
+    uint64_t chip;
+    uint32_t command;
+    uint8_t address;
+    uint32_t flags;
+    uint8_t data[sizeof(HPMReply)];
+    size_t dataLength;
+
+    HPMAsyncCompletion completion;
+};
+
+/// Singly-linked FIFO of requests.
+typedef struct {
+    HPMAsyncRequest *head;
+    HPMAsyncRequest *tail;
+} HPMAsyncList;
+
+struct HPMAsyncQueue {
+    HPMClient *hpm;
+    pthread_t worker;
+
+    pthread_mutex_t lock;
+    pthread_cond_t pending;
+    HPMAsyncList submitted;
+    HPMAsyncList completed;
+    int stopping;
+
+    /// Read and write ends of the completion notification pipe.
+    int notifyFDs[2];
+};
+
+static void HPMAsyncListPush(HPMAsyncList *list, HPMAsyncRequest *request)
+{
+    request->next = NULL;
+    if (list->tail)
+        list->tail->next = request;
+    else
+        list->head = request;
+    list->tail = request;
+}
+
+static HPMAsyncRequest *HPMAsyncListPop(HPMAsyncList *list)
+{
+    HPMAsyncRequest *request = list->head;
+    if (request) {
+        list->head = request->next;
+        if (!list->head)
+            list->tail = NULL;
+    }
+
+    return request;
+}
+
+static void HPMAsyncPerform(HPMClient const *hpm, HPMAsyncRequest *request)
+{
+    HPMAsyncCompletion *completion = &request->completion;
+
+    switch (completion->op) {
+    case kHPMAsyncOpRead:
+        completion->result = HPMRead(hpm, request->chip, request->address, request->flags,
+            completion->reply, &completion->replyLength);
+        break;
+    case kHPMAsyncOpDoCommand:
+        completion->result = HPMDoCommand(hpm, request->chip, (HPMCommand)request->command,
+            request->dataLength ? request->data : NULL, request->dataLength, &completion->commandOut);
+        break;
+    case kHPMAsyncOpSendVDM:
+        completion->result = HPMSendVDM(hpm, request->chip, request->data, request->dataLength);
+        break;
+    }
+}
+
+static void *HPMAsyncWorker(void *arg)
+{
+    HPMAsyncQueue *queue = arg;
+
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        HPMAsyncRequest *request = HPMAsyncListPop(&queue->submitted);
+        if (!request) {
+            if (queue->stopping)
+                break;
+
+            pthread_cond_wait(&queue->pending, &queue->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        HPMAsyncPerform(queue->hpm, request);
+
+        if (request->callback) {
+            request->callback(&request->completion);
+            free(request);
+            pthread_mutex_lock(&queue->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        int wasEmpty = !queue->completed.head;
+        HPMAsyncListPush(&queue->completed, request);
+
+        // One byte in the pipe stands for any number of completions; drain
+        // takes it back out once the list is empty.
+        if (wasEmpty && write(queue->notifyFDs[1], "", 1) != 1)
+            HPMDebug("Failed to signal completion.");
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
+
+IOReturn HPMAsyncQueueCreate(HPMClient *hpm, HPMAsyncQueue **out)
+{
+    if (!hpm || !out)
+        return kIOReturnBadArgument;
+
+    HPMAsyncQueue *queue = calloc(1, sizeof(*queue));
+    if (!queue)
+        return kIOReturnNoMemory;
+
+    queue->hpm = hpm;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->pending, NULL);
+
+    if (pipe(queue->notifyFDs) != 0) {
+        free(queue);
+        return kIOReturnNoResources;
+    }
+    for (int i = 0; i < 2; ++i) {
+        fcntl(queue->notifyFDs[i], F_SETFL, fcntl(queue->notifyFDs[i], F_GETFL) | O_NONBLOCK);
+        fcntl(queue->notifyFDs[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    if (pthread_create(&queue->worker, NULL, HPMAsyncWorker, queue) != 0) {
+        close(queue->notifyFDs[0]);
+        close(queue->notifyFDs[1]);
+        free(queue);
+        return kIOReturnNoResources;
+    }
+
+    *out = queue;
+    return kIOReturnSuccess;
+}
+
+void HPMAsyncQueueDestroy(HPMAsyncQueue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->stopping = 1;
+    pthread_cond_signal(&queue->pending);
+    pthread_mutex_unlock(&queue->lock);
+
+    pthread_join(queue->worker, NULL);
+
+    HPMAsyncRequest *request;
+    while ((request = HPMAsyncListPop(&queue->completed)))
+        free(request);
+
+    close(queue->notifyFDs[0]);
+    close(queue->notifyFDs[1]);
+    pthread_cond_destroy(&queue->pending);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue);
+}
+
+int HPMAsyncQueueGetFD(HPMAsyncQueue const *queue)
+{
+    return queue->notifyFDs[0];
+}
+
+size_t HPMAsyncQueueDrain(HPMAsyncQueue *queue, HPMAsyncCompletion *completions, size_t maxCompletions)
+{
+    size_t count = 0;
+
+    pthread_mutex_lock(&queue->lock);
+    while (count < maxCompletions && queue->completed.head) {
+        HPMAsyncRequest *request = HPMAsyncListPop(&queue->completed);
+        completions[count++] = request->completion;
+        free(request);
+    }
+
+    if (!queue->completed.head) {
+        char byte;
+        while (read(queue->notifyFDs[0], &byte, 1) == 1)
+            ;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return count;
+}
+
+static IOReturn HPMAsyncSubmit(HPMAsyncQueue *queue, HPMAsyncRequest const *request)
+{
+    HPMAsyncRequest *copy = malloc(sizeof(*copy));
+    if (!copy)
+        return kIOReturnNoMemory;
+    *copy = *request;
+
+    pthread_mutex_lock(&queue->lock);
+    IOReturn ret = kIOReturnNotOpen;
+    if (!queue->stopping) {
+        HPMAsyncListPush(&queue->submitted, copy);
+        pthread_cond_signal(&queue->pending);
+        ret = kIOReturnSuccess;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    if (ret != kIOReturnSuccess)
+        free(copy);
+    return ret;
+}
+
+IOReturn HPMAsyncRead(HPMAsyncQueue *queue, uint64_t chip, uint8_t address, uint32_t flags,
+    HPMAsyncCallback callback, void *refcon)
+{
+    HPMAsyncRequest request = {
+        .callback = callback,
+        .chip = chip,
+        .address = address,
+        .flags = flags,
+        .completion = { .op = kHPMAsyncOpRead, .refcon = refcon },
+    };
+
+    return HPMAsyncSubmit(queue, &request);
+}
+
+IOReturn HPMAsyncDoCommand(HPMAsyncQueue *queue, uint64_t chip, HPMCommand command,
+    uint8_t const *args, size_t argsLength, HPMAsyncCallback callback, void *refcon)
+{
+    if (argsLength > sizeof(HPMReply) || (argsLength && !args))
+        return kIOReturnBadArgument;
+
+    HPMAsyncRequest request = {
+        .callback = callback,
+        .chip = chip,
+        .command = (uint32_t)command,
+        .dataLength = argsLength,
+        .completion = { .op = kHPMAsyncOpDoCommand, .refcon = refcon },
+    };
+    if (argsLength)
+        memcpy(request.data, args, argsLength);
+
+    return HPMAsyncSubmit(queue, &request);
+}
+
+IOReturn HPMAsyncSendVDM(HPMAsyncQueue *queue, uint64_t chip, void const *body, size_t bodyLength,
+    HPMAsyncCallback callback, void *refcon)
+{
+    if (!body || bodyLength > sizeof(HPMReply))
+        return kIOReturnBadArgument;
+
+    HPMAsyncRequest request = {
+        .callback = callback,
+        .chip = chip,
+        .dataLength = bodyLength,
+        .completion = { .op = kHPMAsyncOpSendVDM, .refcon = refcon },
+    };
+    memcpy(request.data, body, bodyLength);
+
+    return HPMAsyncSubmit(queue, &request);
+}
@@ -0,0 +1,93 @@
+//
+//  HPMBackend.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMFraud.h"
+
+#include <pthread.h>
+
+/// A service as reported by a backend, plus the backend's handle for it.
+typedef struct {
+    HPMServiceInfo info;
+    uint64_t handle;
+} HPMBackendService;
+
+/// RID to service table, rebuilt only after a backend reports a change.
+typedef struct {
+    pthread_mutex_t lock;
+    int valid;
+    int watching;
+
+    size_t numServices;
+    HPMBackendService services[kHPMMaxRIDs];
+
+    /// Index into \p services for each RID below kHPMMaxRIDs, or -1.
+    int8_t slotForRID[kHPMMaxRIDs];
+
+    /// Bumped, with \p changed broadcast, on every backend notification.
+    /// Only notifications that services came or went clear \p valid.
+    uint64_t generation;
+    pthread_cond_t changed;
+} HPMServiceCache;
+
+#define kHPMServiceCacheInitializer { .lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER }
+
+/// HPM transport backend.
+///
+/// Everything HPMFraud does to the hardware goes through one of these. The
+/// operations mirror the AppleHPMUserClient plugin interface one-to-one, with
+/// the plugin itself replaced by an opaque per-client context.
+struct HPMBackend {
+    char const *name;
+    HPMServiceCache *cache;
+
+    /// Walk all HPM services, retaining a handle to each.
+    IOReturn (*Enumerate)(HPMBackendService *services, size_t maxServices, size_t *numServices);
+    /// Take another reference to a handle returned by Enumerate.
+    void (*RetainService)(uint64_t handle);
+    /// Drop a handle previously returned by Enumerate or retained.
+    void (*ReleaseService)(uint64_t handle);
+    /// Arrange for \p changed to be called whenever services come or go
+    /// (with \p services set), or the state of a port (e.g. its connection)
+    /// changes.
+    IOReturn (*Watch)(void (*changed)(void *refcon, int services), void *refcon);
+
+    IOReturn (*Open)(HPMBackendService const *service, void **context);
+    void (*Close)(void *context);
+
+    IOReturn (*Read)(void *context, uint64_t chip, uint8_t address,
+        void *buffer, size_t length, uint32_t flags, uint64_t *readLength);
+    IOReturn (*Write)(void *context, uint64_t chip, uint8_t address,
+        void const *buffer, size_t length, uint32_t flags);
+    IOReturn (*Command)(void *context, uint64_t chip, uint32_t command, uint32_t flags);
+    IOReturn (*SendVDM)(void *context, uint64_t chip, int arg, void const *buffer, size_t length, uint32_t flags);
+
+    /// Get the 4-byte key expected by the `LOCK` command, or NULL.
+    uint8_t const *(*GetUnlockKey)(void);
+};
+
+/// Look up the service for a RID, rebuilding the backend's cache if needed.
+///
+/// The handle is retained, since a rebuild may release the cache's reference
+/// at any time; drop it with the backend's ReleaseService once done.
+IOReturn HPMServiceCacheLookup(HPMBackend const *backend, int32_t rid, HPMBackendService *service);
+
+/// Deliver a notification to a backend's cache, as its Watch callback would.
+void HPMServiceCacheNotify(HPMBackend const *backend, int services);
+
+/// Get the number of notifications a backend has delivered so far.
+uint64_t HPMServiceCacheGetGeneration(HPMBackend const *backend);
+
+/// Wait up to \p timeoutNs for a notification after \p generation.
+///
+/// Returns kIOReturnTimeout if none arrives, which is always the case for a
+/// backend that cannot deliver notifications. On success, \p generation is
+/// updated to the latest one.
+IOReturn HPMServiceCacheWait(HPMBackend const *backend, uint64_t *generation, uint64_t timeoutNs);
@@ -0,0 +1,288 @@
+//
+//  HPMBackendIOKit.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//  Copyright (c) 2019 Osy86
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "HPMBackend.h"
+#include "HPMDebug.h"
+
+#include <CoreFoundation/CFNumber.h>
+#include <IOKit/IOCFPlugIn.h>
+#include <IOKit/IOMessage.h>
+#include <dispatch/dispatch.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+static IOReturn HPMIOKitEnumerate(HPMBackendService *services, size_t maxServices, size_t *numServices)
+{
+    io_iterator_t devices = IO_OBJECT_NULL;
+    CFMutableDictionaryRef matching = IOServiceMatching("AppleHPM");
+    IO_TRY(IOServiceGetMatchingServices(kIOMainPortDefault, matching, &devices));
+
+    size_t count = 0;
+    io_service_t device = IO_OBJECT_NULL;
+    while ((device = IOIteratorNext(devices)) != IO_OBJECT_NULL) {
+        CFNumberRef ridNum = IORegistryEntryCreateCFProperty(device, CFSTR("RID"), kCFAllocatorDefault, 0);
+        if (!ridNum || count == maxServices) {
+            if (ridNum)
+                CFRelease(ridNum);
+
+            IOObjectRelease(device);
+            continue;
+        }
+
+        HPMBackendService *service = &services[count++];
+        memset(service, 0, sizeof(*service));
+
+        CFNumberGetValue(ridNum, kCFNumberSInt32Type, &service->info.rid);
+        CFRelease(ridNum);
+
+        io_name_t name;
+        if (IORegistryEntryGetName(device, name) == kIOReturnSuccess)
+            strlcpy(service->info.name, name, sizeof(service->info.name));
+
+        io_name_t location;
+        if (IORegistryEntryGetLocationInPlane(device, kIOServicePlane, location) == kIOReturnSuccess)
+            strlcpy(service->info.location, location, sizeof(service->info.location));
+
+        IORegistryEntryGetRegistryEntryID(device, &service->info.registryID);
+
+        // The reference from the iterator is kept for the handle.
+        service->handle = device;
+    }
+
+    IOObjectRelease(devices);
+    *numServices = count;
+    return kIOReturnSuccess;
+}
+
+static void HPMIOKitRetainService(uint64_t handle)
+{
+    IOObjectRetain((io_service_t)handle);
+}
+
+static void HPMIOKitReleaseService(uint64_t handle)
+{
+    IOObjectRelease((io_service_t)handle);
+}
+
+static void (*sWatchCallback)(void *refcon, int services) = NULL;
+static void *sWatchRefcon = NULL;
+static IONotificationPortRef sNotifyPort = NULL;
+
+static void HPMIOKitServiceMessage(void *refcon, io_service_t service, natural_t type, void *argument)
+{
+    io_object_t *notification = refcon;
+    (void)service;
+    (void)argument;
+
+    if (type == kIOMessageServiceIsTerminated) {
+        IOObjectRelease(*notification);
+        free(notification);
+    }
+
+    // The service going away is reported by the terminated notification;
+    // everything else here is about the port's state.
+    HPMDebug("AppleHPM service message %#x.", type);
+    sWatchCallback(sWatchRefcon, 0);
+}
+
+/// Drain a notification iterator, optionally subscribing to the messages of
+/// each service in it; AppleHPM posts these as the port's state changes.
+static void HPMIOKitDrainIterator(io_iterator_t iterator, int subscribe)
+{
+    io_service_t service = IO_OBJECT_NULL;
+    while ((service = IOIteratorNext(iterator)) != IO_OBJECT_NULL) {
+        io_object_t *notification = subscribe ? malloc(sizeof(*notification)) : NULL;
+        if (notification
+            && IOServiceAddInterestNotification(sNotifyPort, service, kIOGeneralInterest,
+                   HPMIOKitServiceMessage, notification, notification)
+                != kIOReturnSuccess)
+            free(notification);
+
+        IOObjectRelease(service);
+    }
+}
+
+static void HPMIOKitServicesChanged(void *refcon, io_iterator_t iterator)
+{
+    // Notifications are only re-armed once the iterator has been drained.
+    HPMIOKitDrainIterator(iterator, refcon != NULL);
+
+    HPMDebug("AppleHPM services changed.");
+    sWatchCallback(sWatchRefcon, 1);
+}
+
+static IOReturn HPMIOKitWatch(void (*changed)(void *refcon, int services), void *refcon)
+{
+    sWatchCallback = changed;
+    sWatchRefcon = refcon;
+
+    IONotificationPortRef port = IONotificationPortCreate(kIOMainPortDefault);
+    if (!port)
+        return kIOReturnNoResources;
+    sNotifyPort = port;
+
+    // Deliver notifications on a private queue so that no run loop is needed
+    // on the caller's side.
+    dispatch_queue_t queue = dispatch_queue_create("HPMFraud.notifications", DISPATCH_QUEUE_SERIAL);
+    IONotificationPortSetDispatchQueue(port, queue);
+
+    // The match notification's refcon marks services to subscribe to.
+    io_name_t const types[] = { kIOFirstMatchNotification, kIOTerminatedNotification };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+        io_iterator_t iterator = IO_OBJECT_NULL;
+        int subscribe = i == 0;
+        IOReturn ret = IOServiceAddMatchingNotification(port, types[i], IOServiceMatching("AppleHPM"),
+            HPMIOKitServicesChanged, subscribe ? port : NULL, &iterator);
+        if (ret != kIOReturnSuccess) {
+            IONotificationPortDestroy(port);
+            sNotifyPort = NULL;
+            return ret;
+        }
+
+        // Arm the notification; existing services are not a change.
+        HPMIOKitDrainIterator(iterator, subscribe);
+    }
+
+    return kIOReturnSuccess;
+}
+
+#define kHPMPluginID                                                                              \
+    CFUUIDGetConstantUUIDWithBytes(kCFAllocatorDefault, 0x12, 0xA1, 0xDC, 0xCF, 0xCF, 0x7A, 0x47, \
+        0x75, 0xBE, 0xE5, 0x9C, 0x43, 0x19, 0xF4, 0xCD, 0x2B)
+#define kHPMInterfaceID                                                                           \
+    CFUUIDGetConstantUUIDWithBytes(kCFAllocatorDefault, 0xC1, 0x3A, 0xCD, 0xD9, 0x20, 0x9E, 0x4B, \
+        0x01, 0xB7, 0xBE, 0xE0, 0x5C, 0xD8, 0x83, 0xC7, 0xB1)
+
+typedef struct HPMInterface HPMInterface;
+struct HPMInterface {
+    IUNKNOWN_C_GUTS;
+    uint64_t unused;
+
+    IOReturn (*Read)(HPMInterface const **, uint64_t chip, uint8_t address,
+        void const *buffer, size_t length, uint32_t flags, uint64_t *readLength);
+    IOReturn (*Write)(HPMInterface const **, uint64_t chip, uint8_t address,
+        void const *buffer, size_t length, uint32_t flags);
+    IOReturn (*Command)(HPMInterface const **, uint64_t chip, uint32_t command, uint32_t flags);
+
+    IOReturn (*SendVDM)(HPMInterface const **, uint64_t device, int arg, void const *buffer, size_t length, uint32_t flags);
+};
+
+typedef struct {
+    IOCFPlugInInterface **plugin;
+    HPMInterface const **interface;
+} HPMIOKitContext;
+
+static IOReturn HPMIOKitOpen(HPMBackendService const *backendService, void **context)
+{
+    io_service_t service = (io_service_t)backendService->handle;
+
+    SInt32 score = 0;
+    IOCFPlugInInterface **plugin = NULL;
+    IO_TRY(IOCreatePlugInInterfaceForService(service, kHPMPluginID, kIOCFPlugInInterfaceID, &plugin, &score));
+
+    HPMInterface const **interface;
+    HRESULT res = (*plugin)->QueryInterface(plugin, CFUUIDGetUUIDBytes(kHPMInterfaceID), (LPVOID *)&interface);
+    if (res != S_OK)
+        return kIOReturnError;
+
+    HPMIOKitContext *ctx = malloc(sizeof(*ctx));
+    if (!ctx) {
+        IODestroyPlugInInterface(plugin);
+        return kIOReturnNoMemory;
+    }
+
+    ctx->plugin = plugin;
+    ctx->interface = interface;
+    *context = ctx;
+    return kIOReturnSuccess;
+}
+
+static void HPMIOKitClose(void *context)
+{
+    HPMIOKitContext *ctx = context;
+    IODestroyPlugInInterface(ctx->plugin);
+    free(ctx);
+}
+
+static IOReturn HPMIOKitRead(void *context, uint64_t chip, uint8_t address,
+    void *buffer, size_t length, uint32_t flags, uint64_t *readLength)
+{
+    HPMInterface const **interface = ((HPMIOKitContext *)context)->interface;
+    return (*interface)->Read(interface, chip, address, buffer, length, flags, readLength);
+}
+
+static IOReturn HPMIOKitWrite(void *context, uint64_t chip, uint8_t address,
+    void const *buffer, size_t length, uint32_t flags)
+{
+    HPMInterface const **interface = ((HPMIOKitContext *)context)->interface;
+    return (*interface)->Write(interface, chip, address, buffer, length, flags);
+}
+
+static IOReturn HPMIOKitCommand(void *context, uint64_t chip, uint32_t command, uint32_t flags)
+{
+    HPMInterface const **interface = ((HPMIOKitContext *)context)->interface;
+    return (*interface)->Command(interface, chip, command, flags);
+}
+
+static IOReturn HPMIOKitSendVDM(void *context, uint64_t chip, int arg, void const *buffer, size_t length, uint32_t flags)
+{
+    HPMInterface const **interface = ((HPMIOKitContext *)context)->interface;
+    return (*interface)->SendVDM(interface, chip, arg, buffer, length, flags);
+}
+
+static uint8_t const *HPMIOKitGetUnlockKey(void)
+{
+    // Avoid calling into IOKit multiple times.
+    static uint32_t sKey = 0;
+    if (sKey)
+        return (uint8_t const *)&sKey;
+
+    CFMutableDictionaryRef matching = IOServiceMatching("IOPlatformExpertDevice");
+    io_service_t service = IOServiceGetMatchingService(kIOMainPortDefault, matching);
+    if (!service) {
+        HPMDebug("Failed to get platform expert service.");
+        return NULL;
+    }
+
+    io_name_t name;
+    if (IORegistryEntryGetName(service, name) != kIOReturnSuccess) {
+        HPMDebug("Failed to get registry entry name.");
+        return NULL;
+    }
+
+    IOObjectRelease(service);
+
+    sKey = (name[0] << 24) | (name[1] << 16) | (name[2] << 8) | name[3];
+    return (uint8_t const *)&sKey;
+}
+
+static HPMServiceCache sIOKitCache = kHPMServiceCacheInitializer;
+
+static HPMBackend const sIOKitBackend = {
+    .name = "iokit",
+    .cache = &sIOKitCache,
+    .Enumerate = HPMIOKitEnumerate,
+    .RetainService = HPMIOKitRetainService,
+    .ReleaseService = HPMIOKitReleaseService,
+    .Watch = HPMIOKitWatch,
+    .Open = HPMIOKitOpen,
+    .Close = HPMIOKitClose,
+    .Read = HPMIOKitRead,
+    .Write = HPMIOKitWrite,
+    .Command = HPMIOKitCommand,
+    .SendVDM = HPMIOKitSendVDM,
+    .GetUnlockKey = HPMIOKitGetUnlockKey,
+};
+
+HPMBackend const *HPMGetIOKitBackend(void)
+{
+    return &sIOKitBackend;
+}
@@ -0,0 +1,685 @@
+//
+//  HPMBackendSim.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "HPMSim.h"
+
+#include "HPMBackend.h"
+#include "HPMDebug.h"
+#include "HPMVDM.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/// Task return codes reported in the low nibble of the data register.
+enum {
+    kSimResultSuccess = 0,
+    kSimResultRejected = 3,
+};
+
+/// Actions the simulated device lists as supported.
+static uint16_t const sSimActions[] = { kVDMActionReboot, kVDMActionDFU, kVDMActionDebugUSB };
+
+typedef struct {
+    pthread_mutex_t lock;
+
+    HPMMode mode;
+    int unlocked;
+
+    /// Mode the port switches to at \p modeAt, when a switch is pending.
+    HPMMode pendingMode;
+    uint64_t modeAt;
+
+    uint32_t lockFailuresLeft;
+
+    /// State of the generator deciding which operations fail transiently.
+    uint32_t faultSeed;
+
+    /// Bounds of a simulated disconnect, or zero when none is pending.
+    uint64_t detachAt;
+    uint64_t reattachAt;
+
+    uint8_t data[sizeof(HPMReply)];
+    size_t dataLength;
+
+    /// Objects of the last VDM response, header first.
+    uint32_t rx[kVDMMaxObjects];
+    size_t rxCount;
+
+    HPMSimStats stats;
+} HPMSimPort;
+
+static HPMSimConfig sConfig = {
+    .numPorts = 3,
+    .connection = kHPMConnectionTypeSource,
+    .unlockKey = { 'S', 'i', 'm', '0' },
+    .productID = 0x1905,
+};
+
+static HPMSimPort sPorts[kHPMSimMaxPorts];
+static pthread_once_t sPortsOnce = PTHREAD_ONCE_INIT;
+
+static void HPMSimResetPort(HPMSimPort *port)
+{
+    port->mode = kHPMModeApp;
+    port->unlocked = 0;
+    port->modeAt = 0;
+    port->lockFailuresLeft = 0;
+    port->faultSeed = (uint32_t)(port - sPorts) + 1;
+    port->detachAt = 0;
+    port->reattachAt = 0;
+    port->dataLength = 0;
+    port->rxCount = 0;
+    memset(port->data, 0, sizeof(port->data));
+    memset(&port->stats, 0, sizeof(port->stats));
+}
+
+static void HPMSimInitPorts(void)
+{
+    for (size_t i = 0; i < kHPMSimMaxPorts; ++i) {
+        pthread_mutex_init(&sPorts[i].lock, NULL);
+        HPMSimResetPort(&sPorts[i]);
+    }
+}
+
+static HPMSimPort *HPMSimGetPort(int32_t rid)
+{
+    pthread_once(&sPortsOnce, HPMSimInitPorts);
+    if (rid < 0 || (uint32_t)rid >= sConfig.numPorts)
+        return NULL;
+
+    return &sPorts[rid];
+}
+
+static uint64_t HPMSimNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/// Stall for the configured latency of an operation.
+///
+/// Sleeping alone overshoots short delays by tens of microseconds, which would
+/// swamp what the benchmarks are trying to measure; spin for the tail instead.
+static void HPMSimDelay(uint32_t us)
+{
+    if (!us)
+        return;
+
+    struct timespec now, deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += us / 1000000;
+    deadline.tv_nsec += (long)(us % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    if (us > 200) {
+        struct timespec nap = { .tv_sec = 0, .tv_nsec = (long)(us - 100) * 1000 };
+        while (nap.tv_nsec >= 1000000000) {
+            nap.tv_sec += 1;
+            nap.tv_nsec -= 1000000000;
+        }
+        nanosleep(&nap, NULL);
+    }
+
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec < deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec < deadline.tv_nsec));
+}
+
+/// Decide whether an operation should fail transiently, as busy controllers
+/// occasionally do. Must hold the port lock.
+static int HPMSimInjectFault(HPMSimPort *port)
+{
+    if (!sConfig.faultsPerMille)
+        return 0;
+
+    // Xorshift, seeded per port, so runs are reproducible.
+    uint32_t x = port->faultSeed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    port->faultSeed = x;
+
+    if (x % 1000 >= sConfig.faultsPerMille)
+        return 0;
+
+    port->stats.faults++;
+    return 1;
+}
+
+/// Get the mode a port reports, completing any pending switch whose time has
+/// come. Must hold the port lock.
+static HPMMode HPMSimGetMode(HPMSimPort *port)
+{
+    if (port->modeAt && HPMSimNow() >= port->modeAt) {
+        port->mode = port->pendingMode;
+        port->modeAt = 0;
+    }
+
+    return port->mode;
+}
+
+/// Switch a port's mode, after the configured delay. Must hold the port lock.
+static void HPMSimSwitchMode(HPMSimPort *port, HPMMode mode)
+{
+    if (!sConfig.modeSwitchDelayUs) {
+        port->mode = mode;
+        port->modeAt = 0;
+        return;
+    }
+
+    port->pendingMode = mode;
+    port->modeAt = HPMSimNow() + (uint64_t)sConfig.modeSwitchDelayUs * 1000;
+}
+
+/// Get the connection a port reports, accounting for any simulated reset in
+/// progress. Must hold the port lock.
+static HPMConnectionType HPMSimGetConnection(HPMSimPort *port)
+{
+    if (port->reattachAt) {
+        uint64_t now = HPMSimNow();
+        if (now >= port->reattachAt)
+            port->detachAt = port->reattachAt = 0;
+        else if (now >= port->detachAt)
+            return kHPMConnectionTypeNone;
+    }
+
+    return sConfig.connection;
+}
+
+static void HPMSimSetResult(HPMSimPort *port, uint8_t result)
+{
+    port->data[0] = (port->data[0] & 0xf0) | result;
+    if (!port->dataLength)
+        port->dataLength = 1;
+}
+
+static IOReturn HPMSimEnumerate(HPMBackendService *services, size_t maxServices, size_t *numServices)
+{
+    size_t count = 0;
+    for (uint32_t rid = 0; rid < sConfig.numPorts && count < maxServices; ++rid) {
+        HPMBackendService *service = &services[count++];
+        memset(service, 0, sizeof(*service));
+
+        service->info.rid = (int32_t)rid;
+        service->info.registryID = 0x100000000ull + rid;
+        snprintf(service->info.name, sizeof(service->info.name), "AppleHPMDeviceSim");
+        snprintf(service->info.location, sizeof(service->info.location), "%x", rid);
+        service->handle = rid;
+    }
+
+    *numServices = count;
+    return kIOReturnSuccess;
+}
+
+static void HPMSimRetainService(uint64_t handle)
+{
+    (void)handle;
+}
+
+static void HPMSimReleaseService(uint64_t handle)
+{
+    (void)handle;
+}
+
+static void (*sWatchCallback)(void *refcon, int services) = NULL;
+static void *sWatchRefcon = NULL;
+
+static IOReturn HPMSimWatch(void (*changed)(void *refcon, int services), void *refcon)
+{
+    sWatchCallback = changed;
+    sWatchRefcon = refcon;
+    return kIOReturnSuccess;
+}
+
+/// Let the service cache know a port's state, or with \p services set, the
+/// set of simulated ports changed.
+static void HPMSimNotifyChanged(int services)
+{
+    if (sWatchCallback)
+        sWatchCallback(sWatchRefcon, services);
+}
+
+typedef struct {
+    uint32_t detachDelayUs;
+    uint32_t reattachDelayUs;
+} HPMSimResetTimes;
+
+/// Deliver the notifications for both edges of a simulated reset.
+static void *HPMSimResetNotifier(void *arg)
+{
+    HPMSimResetTimes times = *(HPMSimResetTimes *)arg;
+    free(arg);
+
+    HPMSimDelay(times.detachDelayUs);
+    HPMSimNotifyChanged(0);
+    HPMSimDelay(times.reattachDelayUs);
+    HPMSimNotifyChanged(0);
+    return NULL;
+}
+
+/// Check whether a VDM asks the device to reboot or go to DFU.
+static int HPMSimIsResetVDM(void const *buffer, size_t length)
+{
+    uint32_t words[2];
+    if (length < sizeof(words))
+        return 0;
+
+    memcpy(words, buffer, sizeof(words));
+    uint32_t action = words[1] & 0xffff;
+    return words[0] == kVDMCommandAction && (action == kVDMActionReboot || action == kVDMActionDFU);
+}
+
+/// Store a register in the layout of the PD message registers.
+static void HPMSimStoreObjects(void *buffer, uint32_t const *objects, size_t count, uint64_t *readLength)
+{
+    uint8_t *bytes = buffer;
+    bytes[0] = (uint8_t)count;
+    for (size_t i = 0; i < count; ++i)
+        for (size_t j = 0; j < 4; ++j)
+            bytes[1 + i * 4 + j] = (uint8_t)(objects[i] >> (j * 8));
+
+    *readLength = 1 + count * 4;
+}
+
+/// Prepare the partner's response to a VDM. Must hold the port lock.
+static void HPMSimRespond(HPMSimPort *port, uint32_t const *words, size_t count)
+{
+    size_t numActions = sizeof(sSimActions) / sizeof(sSimActions[0]);
+
+    port->rxCount = 1;
+    port->rx[0] = words[0] | kVDMResponseACK;
+
+    switch (words[0]) {
+    case kVDMCommandList:
+        // Two actions per object, high half first.
+        for (size_t i = 0; i < numActions; i += 2) {
+            uint32_t high = sSimActions[i];
+            uint32_t low = i + 1 < numActions ? sSimActions[i + 1] : 0;
+            port->rx[port->rxCount++] = high << 16 | low;
+        }
+        break;
+    case kVDMCommandInfo:
+        port->rx[0] = words[0] | kVDMResponseNAK;
+        for (size_t i = 0; count > 1 && i < numActions; ++i) {
+            if (sSimActions[i] == (words[1] & 0xffff)) {
+                port->rx[0] = words[0] | kVDMResponseACK;
+                port->rx[port->rxCount++] = 1u << 31 | sSimActions[i];
+            }
+        }
+        break;
+    case kVDMCommandAction:
+        break;
+    default:
+        port->rx[0] = words[0] | kVDMResponseNAK;
+        break;
+    }
+}
+
+/// Schedule the connection to drop and come back. Must hold the port lock.
+static void HPMSimStartReset(HPMSimPort *port)
+{
+    port->detachAt = HPMSimNow() + (uint64_t)sConfig.detachDelayUs * 1000;
+    port->reattachAt = port->detachAt + (uint64_t)sConfig.reattachDelayUs * 1000;
+
+    // Notifications are best-effort, as they are for real hardware; waiters
+    // poll as well.
+    HPMSimResetTimes *times = malloc(sizeof(*times));
+    if (!times)
+        return;
+    times->detachDelayUs = sConfig.detachDelayUs;
+    times->reattachDelayUs = sConfig.reattachDelayUs;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, HPMSimResetNotifier, times) != 0) {
+        free(times);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+static IOReturn HPMSimOpen(HPMBackendService const *service, void **context)
+{
+    HPMSimPort *port = HPMSimGetPort((int32_t)service->handle);
+    if (!port)
+        return kIOReturnNotFound;
+
+    HPMSimDelay(sConfig.openLatencyUs);
+
+    pthread_mutex_lock(&port->lock);
+    port->lockFailuresLeft = sConfig.lockFailures;
+    port->stats.opens++;
+    pthread_mutex_unlock(&port->lock);
+
+    *context = port;
+    return kIOReturnSuccess;
+}
+
+static void HPMSimClose(void *context)
+{
+    (void)context;
+}
+
+static IOReturn HPMSimRead(void *context, uint64_t chip, uint8_t address,
+    void *buffer, size_t length, uint32_t flags, uint64_t *readLength)
+{
+    HPMSimPort *port = context;
+    (void)chip;
+    (void)flags;
+
+    if (length < 1 + sizeof(port->rx))
+        return kIOReturnBadArgument;
+
+    HPMSimDelay(sConfig.readLatencyUs);
+
+    pthread_mutex_lock(&port->lock);
+    port->stats.reads++;
+    if (HPMSimInjectFault(port)) {
+        pthread_mutex_unlock(&port->lock);
+        return kIOReturnBusy;
+    }
+
+    memset(buffer, 0, length);
+    switch (address) {
+    case 0x3:
+        memcpy(buffer, HPMSimGetMode(port) == kHPMModeDBMA ? "DBMa" : "APP ", 4);
+        *readLength = 4;
+        break;
+    case 0x3f:
+        ((uint8_t *)buffer)[0] = (uint8_t)HPMSimGetConnection(port);
+        *readLength = 1;
+        break;
+    case 0x9:
+        memcpy(buffer, port->data, port->dataLength < length ? port->dataLength : length);
+        *readLength = port->dataLength ? port->dataLength : 1;
+        break;
+    case kVDMRegisterRxIdentity: {
+        // ID header (host/device capable, VID), cert stat, product VDO.
+        uint32_t identity[] = { 0x6c0005ac, 0, (uint32_t)sConfig.productID << 16 | 0x0100 };
+        int connected = HPMSimGetConnection(port) != kHPMConnectionTypeNone;
+        HPMSimStoreObjects(buffer, identity, connected ? 3 : 0, readLength);
+        break;
+    }
+    case kVDMRegisterRxVDM:
+        HPMSimStoreObjects(buffer, port->rx, port->rxCount, readLength);
+        break;
+    default:
+        *readLength = 4;
+        break;
+    }
+
+    pthread_mutex_unlock(&port->lock);
+    return kIOReturnSuccess;
+}
+
+static IOReturn HPMSimWrite(void *context, uint64_t chip, uint8_t address,
+    void const *buffer, size_t length, uint32_t flags)
+{
+    HPMSimPort *port = context;
+    (void)chip;
+    (void)flags;
+
+    if (address != 0x9)
+        return kIOReturnNotPermitted;
+    if (length > sizeof(port->data))
+        return kIOReturnOverrun;
+
+    HPMSimDelay(sConfig.writeLatencyUs);
+
+    pthread_mutex_lock(&port->lock);
+    port->stats.writes++;
+    if (HPMSimInjectFault(port)) {
+        pthread_mutex_unlock(&port->lock);
+        return kIOReturnBusy;
+    }
+    memset(port->data, 0, sizeof(port->data));
+    memcpy(port->data, buffer, length);
+    port->dataLength = length;
+    pthread_mutex_unlock(&port->lock);
+
+    return kIOReturnSuccess;
+}
+
+static IOReturn HPMSimCommand(void *context, uint64_t chip, uint32_t command, uint32_t flags)
+{
+    HPMSimPort *port = context;
+    (void)chip;
+    (void)flags;
+
+    HPMDebug("command=%#x", command);
+    HPMSimDelay(sConfig.commandLatencyUs);
+
+    IOReturn ret = kIOReturnSuccess;
+    pthread_mutex_lock(&port->lock);
+    port->stats.commands++;
+    if (HPMSimInjectFault(port)) {
+        pthread_mutex_unlock(&port->lock);
+        return kIOReturnBusy;
+    }
+
+    switch (command) {
+    case kHPMCommandLock:
+        if (port->lockFailuresLeft) {
+            port->lockFailuresLeft--;
+            ret = kIOReturnNotResponding;
+        } else if (port->dataLength >= 4 && memcmp(port->data, sConfig.unlockKey, 4) == 0) {
+            port->unlocked = 1;
+            HPMSimSetResult(port, kSimResultSuccess);
+        } else {
+            HPMSimSetResult(port, kSimResultRejected);
+        }
+        break;
+    case kHPMCommandGAID:
+        port->mode = kHPMModeApp;
+        port->modeAt = 0;
+        port->unlocked = 0;
+        HPMSimSetResult(port, kSimResultSuccess);
+        break;
+    case kHPMCommandDBMA:
+        if (port->dataLength && port->data[0] == 0) {
+            HPMSimSwitchMode(port, kHPMModeApp);
+            HPMSimSetResult(port, kSimResultSuccess);
+        } else if (port->dataLength && port->unlocked) {
+            HPMSimSwitchMode(port, kHPMModeDBMA);
+            HPMSimSetResult(port, kSimResultSuccess);
+        } else {
+            HPMSimSetResult(port, kSimResultRejected);
+        }
+        break;
+    default:
+        HPMSimSetResult(port, kSimResultRejected);
+        break;
+    }
+
+    pthread_mutex_unlock(&port->lock);
+    return ret;
+}
+
+static IOReturn HPMSimSendVDM(void *context, uint64_t chip, int arg, void const *buffer, size_t length, uint32_t flags)
+{
+    HPMSimPort *port = context;
+    (void)chip;
+    (void)arg;
+    (void)flags;
+
+    if (!length || length % sizeof(uint32_t) || length > sizeof(port->rx))
+        return kIOReturnBadArgument;
+
+    HPMSimDelay(sConfig.vdmLatencyUs);
+
+    IOReturn ret = kIOReturnSuccess;
+    pthread_mutex_lock(&port->lock);
+    port->stats.vdms++;
+    if (HPMSimInjectFault(port))
+        ret = kIOReturnBusy;
+    else if (HPMSimGetMode(port) != kHPMModeDBMA)
+        ret = kIOReturnNotPermitted;
+    else if (HPMSimGetConnection(port) == kHPMConnectionTypeNone)
+        ret = kIOReturnNoDevice;
+    else {
+        uint32_t words[kVDMMaxObjects];
+        memcpy(words, buffer, length);
+        HPMSimRespond(port, words, length / sizeof(uint32_t));
+
+        if (sConfig.reattachDelayUs && HPMSimIsResetVDM(buffer, length))
+            HPMSimStartReset(port);
+    }
+    pthread_mutex_unlock(&port->lock);
+
+    return ret;
+}
+
+static uint8_t const *HPMSimGetUnlockKey(void)
+{
+    return sConfig.unlockKey;
+}
+
+static HPMServiceCache sSimCache = kHPMServiceCacheInitializer;
+
+static HPMBackend const sSimBackend = {
+    .name = "sim",
+    .cache = &sSimCache,
+    .Enumerate = HPMSimEnumerate,
+    .RetainService = HPMSimRetainService,
+    .ReleaseService = HPMSimReleaseService,
+    .Watch = HPMSimWatch,
+    .Open = HPMSimOpen,
+    .Close = HPMSimClose,
+    .Read = HPMSimRead,
+    .Write = HPMSimWrite,
+    .Command = HPMSimCommand,
+    .SendVDM = HPMSimSendVDM,
+    .GetUnlockKey = HPMSimGetUnlockKey,
+};
+
+HPMBackend const *HPMGetSimBackend(void)
+{
+    return &sSimBackend;
+}
+
+void HPMSimGetConfig(HPMSimConfig *config)
+{
+    *config = sConfig;
+}
+
+void HPMSimSetConfig(HPMSimConfig const *config)
+{
+    pthread_once(&sPortsOnce, HPMSimInitPorts);
+
+    sConfig = *config;
+    if (sConfig.numPorts > kHPMSimMaxPorts)
+        sConfig.numPorts = kHPMSimMaxPorts;
+
+    for (size_t i = 0; i < kHPMSimMaxPorts; ++i) {
+        pthread_mutex_lock(&sPorts[i].lock);
+        HPMSimResetPort(&sPorts[i]);
+        pthread_mutex_unlock(&sPorts[i].lock);
+    }
+
+    HPMSimNotifyChanged(1);
+}
+
+static int HPMSimParseU32(char const *str, uint32_t *out)
+{
+    char *end = NULL;
+    unsigned long value = strtoul(str, &end, 0);
+    if (end == str || *end != 0 || value > UINT32_MAX)
+        return 0;
+
+    *out = (uint32_t)value;
+    return 1;
+}
+
+IOReturn HPMSimParseConfig(char const *spec, HPMSimConfig *config)
+{
+    char buf[256];
+    if (strlen(spec) >= sizeof(buf))
+        return kIOReturnBadArgument;
+    strcpy(buf, spec);
+
+    char *save = NULL;
+    for (char *pair = strtok_r(buf, ",", &save); pair; pair = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(pair, '=');
+        if (!value)
+            return kIOReturnBadArgument;
+        *value++ = 0;
+
+        uint32_t number = 0;
+        int isNumber = HPMSimParseU32(value, &number);
+
+        if (strcmp(pair, "conn") == 0) {
+            if (strcmp(value, "none") == 0)
+                config->connection = kHPMConnectionTypeNone;
+            else if (strcmp(value, "source") == 0)
+                config->connection = kHPMConnectionTypeSource;
+            else if (strcmp(value, "sink") == 0)
+                config->connection = kHPMConnectionTypeSink;
+            else
+                return kIOReturnBadArgument;
+        } else if (strcmp(pair, "key") == 0) {
+            if (strlen(value) != 4)
+                return kIOReturnBadArgument;
+            memcpy(config->unlockKey, value, 4);
+        } else if (!isNumber) {
+            return kIOReturnBadArgument;
+        } else if (strcmp(pair, "ports") == 0) {
+            config->numPorts = number;
+        } else if (strcmp(pair, "lock-failures") == 0) {
+            config->lockFailures = number;
+        } else if (strcmp(pair, "pid") == 0) {
+            config->productID = (uint16_t)number;
+        } else if (strcmp(pair, "detach") == 0) {
+            config->detachDelayUs = number;
+        } else if (strcmp(pair, "reattach") == 0) {
+            config->reattachDelayUs = number;
+        } else if (strcmp(pair, "faults") == 0) {
+            config->faultsPerMille = number;
+        } else if (strcmp(pair, "switch") == 0) {
+            config->modeSwitchDelayUs = number;
+        } else if (strcmp(pair, "latency") == 0) {
+            config->openLatencyUs = number;
+            config->readLatencyUs = number;
+            config->writeLatencyUs = number;
+            config->commandLatencyUs = number;
+            config->vdmLatencyUs = number;
+        } else if (strcmp(pair, "open") == 0) {
+            config->openLatencyUs = number;
+        } else if (strcmp(pair, "read") == 0) {
+            config->readLatencyUs = number;
+        } else if (strcmp(pair, "write") == 0) {
+            config->writeLatencyUs = number;
+        } else if (strcmp(pair, "command") == 0) {
+            config->commandLatencyUs = number;
+        } else if (strcmp(pair, "vdm") == 0) {
+            config->vdmLatencyUs = number;
+        } else {
+            return kIOReturnBadArgument;
+        }
+    }
+
+    return kIOReturnSuccess;
+}
+
+IOReturn HPMSimGetStats(int32_t rid, HPMSimStats *stats)
+{
+    HPMSimPort *port = HPMSimGetPort(rid);
+    if (!port)
+        return kIOReturnNotFound;
+
+    pthread_mutex_lock(&port->lock);
+    *stats = port->stats;
+    pthread_mutex_unlock(&port->lock);
+    return kIOReturnSuccess;
+}
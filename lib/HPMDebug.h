@@ -0,0 +1,55 @@
+//
+//  HPMDebug.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#ifndef __printflike
+#define __printflike(fmtarg, firstvararg) __attribute__((__format__(__printf__, fmtarg, firstvararg)))
+#endif
+
+// Set to 1 below (or override in compile flags) for additional debug output.
+#ifndef HPMFRAUD_CONFIG_DEBUG
+#define HPMFRAUD_CONFIG_DEBUG 0
+#endif
+
+#if HPMFRAUD_CONFIG_DEBUG
+#define HPMDebug(...)                                                            \
+    do {                                                                         \
+        HPMDebugWithContext(__FILE_NAME__, __LINE__, __FUNCTION__, __VA_ARGS__); \
+    } while (0)
+
+#else
+#define HPMDebug(...) \
+    do {              \
+    } while (0)
+#endif
+
+static inline void HPMDebugWithContext(char const *file, int line, char const *func, char const *fmt, ...) __printflike(4, 5);
+
+static inline void HPMDebugWithContext(char const *file, int line, char const *func, char const *fmt, ...)
+{
+    fprintf(stderr, "\x1b[34m%s(%s:%d): ", func, file, line);
+
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+
+    fprintf(stderr, "\x1b[0m\n");
+}
+
+#define IO_TRY(STMT)                      \
+    do {                                  \
+        IOReturn _try_ret = STMT;         \
+        if (_try_ret != kIOReturnSuccess) \
+            return _try_ret;              \
+    } while (0)
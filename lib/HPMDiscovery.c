@@ -0,0 +1,364 @@
+//
+//  HPMDiscovery.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "HPMDiscovery.h"
+
+#include "HPMDebug.h"
+#include "HPMFile.h"
+#include "HPMInstrument.h"
+#include "HPMVDM.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// How long to wait for the device to answer a VDM.
+#define kHPMResponseTimeoutNs 100000000ull
+
+/// Read the objects of a PD message register.
+static IOReturn HPMReadObjects(HPMClient const *hpm, uint8_t address, uint32_t *objects, size_t *count)
+{
+    size_t length = 0;
+    HPMReply reply;
+    IO_TRY(HPMRead(hpm, 0, address, 0, reply, &length));
+    if (!length)
+        return kIOReturnUnderrun;
+
+    size_t available = (length - 1) / 4;
+    size_t valid = reply[0] & 7;
+    if (valid > available)
+        valid = available;
+
+    for (size_t i = 0; i < valid; ++i) {
+        uint8_t const *bytes = &reply[1 + i * 4];
+        objects[i] = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+    }
+
+    *count = valid;
+    return kIOReturnSuccess;
+}
+
+IOReturn HPMGetDeviceIdentity(HPMClient const *hpm, HPMDeviceIdentity *identity)
+{
+    uint32_t objects[kVDMMaxObjects];
+    size_t count = 0;
+    IO_TRY(HPMReadObjects(hpm, kVDMRegisterRxIdentity, objects, &count));
+
+    // ID header, cert stat and product VDOs are always present.
+    if (count < 3)
+        return kIOReturnNoDevice;
+
+    identity->vendorID = objects[0] & 0xffff;
+    identity->productID = objects[2] >> 16;
+    identity->bcdDevice = objects[2] & 0xffff;
+    return kIOReturnSuccess;
+}
+
+/// Send a VDM and wait for the matching response.
+///
+/// Returns kIOReturnUnsupported if the device refused the request.
+static IOReturn HPMTransactVDM(HPMClient const *hpm, uint32_t const *body, size_t numWords,
+    uint32_t *response, size_t *responseCount)
+{
+    IO_TRY(HPMSendVDM(hpm, 0, body, numWords * sizeof(uint32_t)));
+
+    uint64_t deadline = HPMNow() + kHPMResponseTimeoutNs;
+    long backoffNs = 100000;
+    for (;;) {
+        size_t count = 0;
+        IO_TRY(HPMReadObjects(hpm, kVDMRegisterRxVDM, response, &count));
+
+        // Anything else in the register is left over from an earlier message.
+        uint32_t header = count ? response[0] : 0;
+        if ((header & ~kVDMResponseMask) == body[0]) {
+            switch (header & kVDMResponseMask) {
+            case kVDMResponseACK:
+                *responseCount = count;
+                return kIOReturnSuccess;
+            case kVDMResponseNAK:
+                return kIOReturnUnsupported;
+            default:
+                break;
+            }
+        }
+
+        if (HPMNow() >= deadline)
+            return kIOReturnTimeout;
+
+        struct timespec nap = { .tv_sec = 0, .tv_nsec = backoffNs };
+        nanosleep(&nap, NULL);
+        if (backoffNs < 5000000)
+            backoffNs *= 2;
+    }
+}
+
+static uint32_t HPMCapabilityForAction(uint16_t action)
+{
+    switch (action) {
+    case kVDMActionReboot:
+        return kHPMCapabilityReboot;
+    case kVDMActionDFU:
+        return kHPMCapabilityDFU;
+    case kVDMActionDebugUSB:
+        return kHPMCapabilityDebugUSB;
+    default:
+        return 0;
+    }
+}
+
+IOReturn HPMDiscoverCapabilities(HPMClient const *hpm, HPMCapabilities *caps)
+{
+    memset(caps, 0, sizeof(*caps));
+
+    uint32_t list[] = { kVDMCommandList };
+    uint32_t response[kVDMMaxObjects];
+    size_t count = 0;
+    IO_TRY(HPMTransactVDM(hpm, list, 1, response, &count));
+
+    // Each object holds two actions, high half first; zero pads the end.
+    for (size_t i = 1; i < count; ++i) {
+        uint16_t halves[] = { response[i] >> 16, response[i] & 0xffff };
+        for (size_t j = 0; j < 2; ++j)
+            if (halves[j] && caps->numActions < kHPMMaxActions)
+                caps->actions[caps->numActions++] = halves[j];
+    }
+
+    for (uint32_t i = 0; i < caps->numActions; ++i) {
+        uint32_t info[] = { kVDMCommandInfo, caps->actions[i] };
+        IOReturn ret = HPMTransactVDM(hpm, info, 2, response, &count);
+        if (ret == kIOReturnUnsupported)
+            continue;
+        if (ret != kIOReturnSuccess)
+            return ret;
+
+        caps->actionInfo[i] = count > 1 ? response[1] : 0;
+        caps->capabilities |= HPMCapabilityForAction(caps->actions[i]);
+    }
+
+    HPMDebug("actions=%u, capabilities=%#x", caps->numActions, caps->capabilities);
+    return kIOReturnSuccess;
+}
+
+#define kHPMCapabilityCacheMagic 0x43504d48 // 'HPMC'
+#define kHPMCapabilityCacheVersion 1
+#define kHPMCapabilityCacheSlots 4096
+#define kHPMCapabilityCacheMaxProbes 16
+
+/// Times a reader tries to get a consistent copy of a slot before giving up
+/// on it. A writer that died mid-update leaves the slot looking busy until
+/// the next store.
+#define kHPMCapabilityCacheMaxRetries 1000
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numSlots;
+    uint32_t slotSize;
+} HPMCapabilityCacheHeader;
+
+typedef struct {
+    /// Odd while the slot is being written.
+    atomic_uint seq;
+    uint32_t reserved;
+
+    /// Packed identity, or zero if the slot is free.
+    uint64_t key;
+    HPMCapabilities caps;
+} HPMCapabilityCacheSlot;
+
+struct HPMCapabilityCache {
+    int fd;
+    void *map;
+    size_t mapSize;
+    HPMCapabilityCacheSlot *slots;
+};
+
+static size_t HPMCapabilityCacheSize(void)
+{
+    return sizeof(HPMCapabilityCacheHeader) + kHPMCapabilityCacheSlots * sizeof(HPMCapabilityCacheSlot);
+}
+
+static uint64_t HPMCapabilityCacheKey(HPMDeviceIdentity const *identity)
+{
+    return 1ull << 48 | (uint64_t)identity->vendorID << 32 | (uint64_t)identity->productID << 16
+        | identity->bcdDevice;
+}
+
+static size_t HPMCapabilityCacheHome(uint64_t key)
+{
+    return (size_t)((key * 0x9e3779b97f4a7c15ull) >> 52) & (kHPMCapabilityCacheSlots - 1);
+}
+
+/// Make sure the file holds an empty or valid cache. Must hold the file lock.
+static IOReturn HPMCapabilityCacheFormat(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return kIOReturnIOError;
+
+    HPMCapabilityCacheHeader header = { 0 };
+    HPMCapabilityCacheHeader const expected = {
+        .magic = kHPMCapabilityCacheMagic,
+        .version = kHPMCapabilityCacheVersion,
+        .numSlots = kHPMCapabilityCacheSlots,
+        .slotSize = sizeof(HPMCapabilityCacheSlot),
+    };
+
+    if ((size_t)st.st_size == HPMCapabilityCacheSize()
+        && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && memcmp(&header, &expected, sizeof(header)) == 0)
+        return kIOReturnSuccess;
+
+    HPMDebug("Resetting capability cache.");
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)HPMCapabilityCacheSize()) != 0)
+        return kIOReturnIOError;
+    if (pwrite(fd, &expected, sizeof(expected), 0) != sizeof(expected))
+        return kIOReturnIOError;
+
+    return kIOReturnSuccess;
+}
+
+IOReturn HPMCapabilityCacheOpen(char const *path, HPMCapabilityCache **out)
+{
+    // Files that aren't caches get reset, so be sure this is really ours.
+    int fd = HPMOpenStateFile(path, O_RDWR | O_CREAT);
+    if (fd < 0)
+        return kIOReturnNotPermitted;
+
+    flock(fd, LOCK_EX);
+    IOReturn ret = HPMCapabilityCacheFormat(fd);
+    flock(fd, LOCK_UN);
+    if (ret != kIOReturnSuccess) {
+        close(fd);
+        return ret;
+    }
+
+    size_t size = HPMCapabilityCacheSize();
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return kIOReturnNoMemory;
+    }
+
+    HPMCapabilityCache *cache = malloc(sizeof(*cache));
+    if (!cache) {
+        munmap(map, size);
+        close(fd);
+        return kIOReturnNoMemory;
+    }
+
+    cache->fd = fd;
+    cache->map = map;
+    cache->mapSize = size;
+    cache->slots = (HPMCapabilityCacheSlot *)((HPMCapabilityCacheHeader *)map + 1);
+    *out = cache;
+    return kIOReturnSuccess;
+}
+
+void HPMCapabilityCacheClose(HPMCapabilityCache *cache)
+{
+    munmap(cache->map, cache->mapSize);
+    close(cache->fd);
+    free(cache);
+}
+
+IOReturn HPMCapabilityCacheLookup(HPMCapabilityCache *cache, HPMDeviceIdentity const *identity,
+    HPMCapabilities *caps)
+{
+    uint64_t key = HPMCapabilityCacheKey(identity);
+    size_t home = HPMCapabilityCacheHome(key);
+
+    for (size_t probe = 0; probe < kHPMCapabilityCacheMaxProbes; ++probe) {
+        HPMCapabilityCacheSlot *slot = &cache->slots[(home + probe) & (kHPMCapabilityCacheSlots - 1)];
+
+        // Readers never lock; they retry if a writer got in the way, and
+        // move on if one seems to be stuck.
+        uint64_t slotKey = 0;
+        int consistent = 0;
+        for (unsigned retry = 0; retry < kHPMCapabilityCacheMaxRetries && !consistent; ++retry) {
+            unsigned seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+            slotKey = slot->key;
+            *caps = slot->caps;
+            atomic_thread_fence(memory_order_acquire);
+            consistent = !(seq & 1) && atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq;
+        }
+
+        if (!consistent)
+            continue;
+        if (slotKey == key)
+            return kIOReturnSuccess;
+        if (!slotKey)
+            break;
+    }
+
+    return kIOReturnNotFound;
+}
+
+IOReturn HPMCapabilityCacheStore(HPMCapabilityCache *cache, HPMDeviceIdentity const *identity,
+    HPMCapabilities const *caps)
+{
+    uint64_t key = HPMCapabilityCacheKey(identity);
+    size_t home = HPMCapabilityCacheHome(key);
+
+    // Writers are serialized across processes by the file lock.
+    flock(cache->fd, LOCK_EX);
+
+    // Reuse this device's slot or the first free one; if the neighborhood is
+    // full, evict whatever lives in the home slot.
+    HPMCapabilityCacheSlot *target = &cache->slots[home];
+    for (size_t probe = 0; probe < kHPMCapabilityCacheMaxProbes; ++probe) {
+        HPMCapabilityCacheSlot *slot = &cache->slots[(home + probe) & (kHPMCapabilityCacheSlots - 1)];
+        if (slot->key == key || !slot->key) {
+            target = slot;
+            break;
+        }
+    }
+
+    // Round up in case a writer died mid-update and left the count odd.
+    unsigned seq = (atomic_load_explicit(&target->seq, memory_order_relaxed) + 1) & ~1u;
+    atomic_store_explicit(&target->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    target->key = key;
+    target->caps = *caps;
+    atomic_store_explicit(&target->seq, seq + 2, memory_order_release);
+
+    flock(cache->fd, LOCK_UN);
+    return kIOReturnSuccess;
+}
+
+IOReturn HPMGetCapabilities(HPMClient *hpm, HPMCapabilityCache *cache, HPMCapabilities *caps, int *cached)
+{
+    HPMDeviceIdentity identity;
+    IO_TRY(HPMGetDeviceIdentity(hpm, &identity));
+
+    if (cached)
+        *cached = 0;
+    if (cache && HPMCapabilityCacheLookup(cache, &identity, caps) == kIOReturnSuccess) {
+        if (cached)
+            *cached = 1;
+        return kIOReturnSuccess;
+    }
+
+    IO_TRY(HPMEnterDBMA(hpm));
+    IOReturn ret = HPMDiscoverCapabilities(hpm, caps);
+    IOReturn exitRet = HPMExitDBMA(hpm);
+    if (ret == kIOReturnSuccess)
+        ret = exitRet;
+
+    if (ret == kIOReturnSuccess && cache)
+        ret = HPMCapabilityCacheStore(cache, &identity, caps);
+
+    return ret;
+}
@@ -10,124 +10,207 @@
 
 #include "HPMFraud.h"
 
-#include <CoreFoundation/CFNumber.h>
-#include <IOKit/IOCFPlugIn.h>
+#include "HPMBackend.h"
+#include "HPMDebug.h"
+#include "HPMInstrument.h"
+#include "HPMMetrics.h"
+#include "HPMRecord.h"
+#include "HPMRetry.h"
+#include "HPMVDM.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if !HPMFRAUD_CONFIG_IOKIT
+HPMBackend const *HPMGetIOKitBackend(void)
+{
+    return NULL;
+}
+#endif
 
-#include <stdio.h>
+/// Counters behind HPMGetCounters.
+static struct {
+    atomic_uint_least64_t vdmsSent[kHPMMaxRIDs];
+    atomic_uint_least64_t unlockAttempts[kHPMMaxRIDs];
 
-// Set to 1 below (or override in compile flags) for additional debug output.
-#ifndef HPMFRAUD_CONFIG_DEBUG
-#define HPMFRAUD_CONFIG_DEBUG 0
-#endif
+    /// Last connection type and mode read, plus one; zero if never read.
+    atomic_int connection[kHPMMaxRIDs];
+    atomic_int mode[kHPMMaxRIDs];
+    atomic_uint_least64_t statusAt[kHPMMaxRIDs];
 
-#if HPMFRAUD_CONFIG_DEBUG
-#define HPMDebug(...)                                                            \
-    do {                                                                         \
-        HPMDebugWithContext(__FILE_NAME__, __LINE__, __FUNCTION__, __VA_ARGS__); \
-    } while (0)
-
-#else
-#define HPMDebug(...) \
-    do {              \
-    } while (0)
-#endif
+    /// Error codes seen so far, and their counts; zero codes are free slots.
+    atomic_int errorCodes[kHPMMaxErrorCodes];
+    atomic_uint_least64_t errorCounts[kHPMMaxErrorCodes];
+    atomic_uint_least64_t otherErrors;
+} sCounters;
 
-static void HPMDebugWithContext(char const *file, int line, char const *func, char const *fmt, ...) __printflike(4, 5)
+static void HPMCountError(IOReturn ret)
 {
-    fprintf(stderr, "\x1b[34m%s(%s:%d): ", func, file, line);
-
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
+    if (ret == kIOReturnSuccess)
+        return;
+
+    // Slots are claimed once and never given back, so this is lock-free.
+    for (size_t i = 0; i < kHPMMaxErrorCodes; ++i) {
+        int code = atomic_load_explicit(&sCounters.errorCodes[i], memory_order_relaxed);
+        if (!code && atomic_compare_exchange_strong_explicit(&sCounters.errorCodes[i], &code, ret,
+                         memory_order_relaxed, memory_order_relaxed))
+            code = ret;
+
+        if (code == ret) {
+            atomic_fetch_add_explicit(&sCounters.errorCounts[i], 1, memory_order_relaxed);
+            return;
+        }
+    }
 
-    fprintf(stderr, "\x1b[0m\n");
+    atomic_fetch_add_explicit(&sCounters.otherErrors, 1, memory_order_relaxed);
 }
 
-#define IO_TRY(STMT)                      \
-    do {                                  \
-        IOReturn _try_ret = STMT;         \
-        if (_try_ret != kIOReturnSuccess) \
-            return _try_ret;              \
-    } while (0)
-
-static IOReturn HPMFindService(int32_t targetRID, io_service_t *service)
+static void HPMCountStatus(int32_t rid, HPMConnectionType connection, HPMMode mode, uint64_t now)
 {
-    if (!service)
-        return kIOReturnBadArgument;
-
-    io_iterator_t devices = IO_OBJECT_NULL;
-    CFMutableDictionaryRef matching = IOServiceMatching("AppleHPM");
-    IO_TRY(IOServiceGetMatchingServices(kIOMainPortDefault, matching, &devices));
+    if (rid < 0 || rid >= kHPMMaxRIDs)
+        return;
 
-    io_service_t device = IO_OBJECT_NULL;
-    while ((device = IOIteratorNext(devices)) != IO_OBJECT_NULL) {
-        CFNumberRef ridNum = IORegistryEntryCreateCFProperty(device, CFSTR("RID"), kCFAllocatorDefault, 0);
-        if (!ridNum)
-            return kIOReturnError;
+    if (connection != kHPMConnectionTypeError)
+        atomic_store_explicit(&sCounters.connection[rid], (int)connection + 1, memory_order_relaxed);
+    atomic_store_explicit(&sCounters.mode[rid], (int)mode + 1, memory_order_relaxed);
+    atomic_store_explicit(&sCounters.statusAt[rid], now, memory_order_relaxed);
+}
 
-        int32_t rid = 0;
-        CFNumberGetValue(ridNum, kCFNumberSInt32Type, &rid);
-        CFRelease(ridNum);
+void HPMGetCounters(HPMCounters *counters)
+{
+    memset(counters, 0, sizeof(*counters));
 
-        if (rid != targetRID) {
-            IOObjectRelease(device);
-            continue;
-        }
+    for (int rid = 0; rid < kHPMMaxRIDs; ++rid) {
+        counters->vdmsSent[rid] = atomic_load_explicit(&sCounters.vdmsSent[rid], memory_order_relaxed);
+        counters->unlockAttempts[rid] = atomic_load_explicit(&sCounters.unlockAttempts[rid], memory_order_relaxed);
 
-        *service = device;
-        return kIOReturnSuccess;
+        int connection = atomic_load_explicit(&sCounters.connection[rid], memory_order_relaxed);
+        int mode = atomic_load_explicit(&sCounters.mode[rid], memory_order_relaxed);
+        counters->connection[rid] = connection ? (HPMConnectionType)(connection - 1) : kHPMConnectionTypeError;
+        counters->mode[rid] = mode ? (HPMMode)(mode - 1) : kHPMModeError;
+        counters->statusAt[rid] = atomic_load_explicit(&sCounters.statusAt[rid], memory_order_relaxed);
     }
 
-    IOObjectRelease(devices);
-    return kIOReturnNotFound;
+    for (size_t i = 0; i < kHPMMaxErrorCodes; ++i) {
+        int code = atomic_load_explicit(&sCounters.errorCodes[i], memory_order_relaxed);
+        if (!code)
+            break;
+
+        HPMErrorCount *error = &counters->errors[counters->numErrors++];
+        error->code = code;
+        error->count = atomic_load_explicit(&sCounters.errorCounts[i], memory_order_relaxed);
+    }
+    counters->otherErrors = atomic_load_explicit(&sCounters.otherErrors, memory_order_relaxed);
 }
 
-#define kHPMPluginID                                                                              \
-    CFUUIDGetConstantUUIDWithBytes(kCFAllocatorDefault, 0x12, 0xA1, 0xDC, 0xCF, 0xCF, 0x7A, 0x47, \
-        0x75, 0xBE, 0xE5, 0x9C, 0x43, 0x19, 0xF4, 0xCD, 0x2B)
-#define kHPMInterfaceID                                                                           \
-    CFUUIDGetConstantUUIDWithBytes(kCFAllocatorDefault, 0xC1, 0x3A, 0xCD, 0xD9, 0x20, 0x9E, 0x4B, \
-        0x01, 0xB7, 0xBE, 0xE0, 0x5C, 0xD8, 0x83, 0xC7, 0xB1)
+HPMBackend const *HPMGetDefaultBackend(void)
+{
+    HPMBackend const *backend = HPMGetIOKitBackend();
+    return backend ? backend : HPMGetSimBackend();
+}
 
-typedef struct HPMInterface HPMInterface;
-struct HPMInterface {
-    IUNKNOWN_C_GUTS;
-    uint64_t unused;
+HPMBackend const *HPMGetBackendByName(char const *name)
+{
+    HPMBackend const *backends[] = { HPMGetIOKitBackend(), HPMGetSimBackend(), HPMGetReplayBackend() };
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i)
+        if (backends[i] && strcmp(backends[i]->name, name) == 0)
+            return backends[i];
 
-    IOReturn (*Read)(HPMInterface const **, uint64_t chip, uint8_t address,
-        void const *buffer, size_t length, uint32_t flags, uint64_t *readLength);
-    IOReturn (*Write)(HPMInterface const **, uint64_t chip, uint8_t address,
-        void const *buffer, size_t length, uint32_t flags);
-    IOReturn (*Command)(HPMInterface const **, uint64_t chip, uint32_t command, uint32_t flags);
+    return NULL;
+}
 
-    IOReturn (*SendVDM)(HPMInterface const **, uint64_t device, int arg, void const *buffer, size_t length, uint32_t flags);
-};
+char const *HPMBackendGetName(HPMBackend const *backend)
+{
+    return backend->name;
+}
 
 IOReturn HPMClientOpen(HPMClient *hpm, int32_t rid)
 {
-    io_service_t service = IO_OBJECT_NULL;
-    IO_TRY(HPMFindService(rid, &service));
+    return HPMClientOpenWithBackend(hpm, HPMGetDefaultBackend(), rid);
+}
+
+IOReturn HPMClientOpenWithBackend(HPMClient *hpm, HPMBackend const *backend, int32_t rid)
+{
+    if (!backend)
+        return kIOReturnBadArgument;
 
-    SInt32 score = 0;
-    IOCFPlugInInterface **plugin = NULL;
-    IO_TRY(IOCreatePlugInInterfaceForService(service, kHPMPluginID, kIOCFPlugInInterfaceID, &plugin, &score));
+    uint64_t start = HPMInstrumentBegin();
+    uint64_t statsStart = HPMNow();
 
-    HPMInterface const **interface;
-    HRESULT res = (*plugin)->QueryInterface(plugin, CFUUIDGetUUIDBytes(kHPMInterfaceID), (LPVOID *)&interface);
-    if (res != S_OK)
-        return kIOReturnError;
+    void *context = NULL;
+    HPMBackendService service;
+    IOReturn ret = HPMServiceCacheLookup(backend, rid, &service);
+    if (ret == kIOReturnSuccess) {
+        ret = backend->Open(&service, &context);
+        backend->ReleaseService(service.handle);
+    }
+    if (ret != kIOReturnSuccess && ret != kIOReturnNotFound) {
+        // The service may have gone away before its notification arrived;
+        // give it one more try against a fresh view of the registry.
+        HPMInvalidateServices(backend);
+        ret = HPMServiceCacheLookup(backend, rid, &service);
+        if (ret == kIOReturnSuccess) {
+            ret = backend->Open(&service, &context);
+            backend->ReleaseService(service.handle);
+        }
+    }
 
-    hpm->plugin = plugin;
-    hpm->interface = interface;
+    HPMInstrumentEnd(start, kHPMTraceOpClientOpen, rid, 0, 0, 0, 0, ret);
+    HPMStatsRecord(kHPMStatsOpOpen, rid, statsStart, ret);
+    HPMCountError(ret);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    hpm->backend = backend;
+    hpm->context = context;
+    hpm->rid = rid;
+    hpm->state = kHPMStateUnknown;
+    hpm->options = 0;
+    memset(&hpm->status, 0, sizeof(hpm->status));
+    hpm->statusMaxAgeMs = 0;
+    hpm->modeTimeoutMs = kHPMDefaultModeTimeoutMs;
+    memset(&hpm->lastModeWait, 0, sizeof(hpm->lastModeWait));
+    hpm->retryPolicy = NULL;
     return kIOReturnSuccess;
 }
 
 void HPMClientClose(HPMClient *hpm)
 {
-    IODestroyPlugInInterface(hpm->plugin);
-    hpm->plugin = NULL;
-    hpm->interface = NULL;
+    hpm->backend->Close(hpm->context);
+    hpm->backend = NULL;
+    hpm->context = NULL;
+}
+
+char const *HPMConnectionTypeGetName(HPMConnectionType connection)
+{
+    switch (connection) {
+    case kHPMConnectionTypeNone:
+        return "none";
+    case kHPMConnectionTypeSource:
+        return "source";
+    case kHPMConnectionTypeSink:
+        return "sink";
+    case kHPMConnectionTypeError:
+        return "error";
+    default:
+        return "unknown";
+    }
+}
+
+char const *HPMModeGetName(HPMMode mode)
+{
+    switch (mode) {
+    case kHPMModeApp:
+        return "app";
+    case kHPMModeDBMA:
+        return "DBMa";
+    case kHPMModeError:
+        return "error";
+    default:
+        return "unknown";
+    }
 }
 
 HPMConnectionType HPMGetConnectionType(HPMClient const *hpm)
@@ -161,40 +244,247 @@ IOReturn HPMGetMode(HPMClient const *hpm, HPMMode *modeOut)
     return kIOReturnSuccess;
 }
 
-IOReturn HPMRead(HPMClient const *hpm, uint64_t chip, uint8_t address,
+/// Check whether the client's status snapshot is at most \p maxAgeMs old.
+static int HPMStatusIsFresh(HPMClient const *hpm, uint64_t now, uint32_t maxAgeMs)
+{
+    return hpm->status.timestamp && now - hpm->status.timestamp <= (uint64_t)maxAgeMs * 1000000;
+}
+
+IOReturn HPMGetStatus(HPMClient *hpm, uint32_t maxAgeMs, HPMStatus *status)
+{
+    uint64_t now = HPMNow();
+    if (HPMStatusIsFresh(hpm, now, maxAgeMs)) {
+        *status = hpm->status;
+        return kIOReturnSuccess;
+    }
+
+    size_t length = 0;
+    HPMReply reply;
+    IO_TRY(HPMRead(hpm, 0, 0x3f, 0, reply, &length));
+    if (!length)
+        return kIOReturnUnderrun;
+
+    HPMStatus fresh = {
+        .connection = reply[0] & kHPMConnectionTypeMask,
+        .connectionRaw = reply[0],
+        .timestamp = now,
+    };
+    IO_TRY(HPMGetMode(hpm, &fresh.mode));
+    HPMCountStatus(hpm->rid, fresh.connection, fresh.mode, now);
+
+    hpm->status = fresh;
+    *status = fresh;
+    return kIOReturnSuccess;
+}
+
+void HPMClientSetStatusMaxAge(HPMClient *hpm, uint32_t maxAgeMs)
+{
+    hpm->statusMaxAgeMs = maxAgeMs;
+}
+
+/// Arguments and results of an operation, for running it under a retry policy.
+typedef struct {
+    uint64_t chip;
+    uint32_t arg;
+    uint32_t flags;
+    void const *data;
+    size_t dataLength;
+    uint8_t *reply;
+    size_t *replyLength;
+} HPMRetryContext;
+
+static IOReturn HPMReadOnce(HPMClient const *hpm, uint64_t chip, uint8_t address,
     uint32_t flags, uint8_t *reply, size_t *replyLength)
 {
     HPMDebug("chip=%#llx, address=%#x, flags=%#x", chip, address, flags);
 
+    uint64_t start = HPMInstrumentBegin();
+
     uint64_t length = 0;
-    IO_TRY((*hpm->interface)->Read(hpm->interface, chip, address, reply, sizeof(HPMReply), flags, &length));
+    IOReturn ret = hpm->backend->Read(hpm->context, chip, address, reply, sizeof(HPMReply), flags, &length);
+
+    HPMInstrumentEnd(start, kHPMTraceOpRead, hpm->rid, chip, address, flags, (uint32_t)length, ret);
+    if (ret != kIOReturnSuccess) {
+        HPMCountError(ret);
+        return ret;
+    }
 
     *replyLength = length;
     return kIOReturnSuccess;
 }
 
-IOReturn HPMDoCommand(HPMClient const *hpm, uint64_t chip,
+static IOReturn HPMReadAttempt(HPMClient const *hpm, void *refcon)
+{
+    HPMRetryContext const *c = refcon;
+    return HPMReadOnce(hpm, c->chip, (uint8_t)c->arg, c->flags, c->reply, c->replyLength);
+}
+
+IOReturn HPMRead(HPMClient const *hpm, uint64_t chip, uint8_t address,
+    uint32_t flags, uint8_t *reply, size_t *replyLength)
+{
+    if (!hpm->retryPolicy)
+        return HPMReadOnce(hpm, chip, address, flags, reply, replyLength);
+
+    HPMRetryContext context = {
+        .chip = chip,
+        .arg = address,
+        .flags = flags,
+        .reply = reply,
+        .replyLength = replyLength,
+    };
+    return HPMRetryRun(hpm->retryPolicy, hpm, HPMReadAttempt, &context);
+}
+
+/// Most threads HPMReadMany will split a batch across.
+#define kHPMReadManyMaxLanes 8
+
+typedef struct {
+    HPMClient const *hpm;
+    HPMReadRequest const *requests;
+    HPMReadResult *results;
+    size_t count;
+
+    /// Lane of each request, or NULL to do all of them.
+    uint8_t const *lanes;
+    uint8_t lane;
+} HPMReadManyJob;
+
+static void *HPMReadManyWorker(void *arg)
+{
+    HPMReadManyJob const *job = arg;
+    HPMBackend const *backend = job->hpm->backend;
+
+    // Straight to the backend, skipping HPMRead's per-call debug logging.
+    for (size_t i = 0; i < job->count; ++i) {
+        if (job->lanes && job->lanes[i] != job->lane)
+            continue;
+
+        HPMReadRequest const *request = &job->requests[i];
+        HPMReadResult *result = &job->results[i];
+        uint64_t start = HPMInstrumentBegin();
+
+        uint64_t length = 0;
+        result->result = backend->Read(job->hpm->context, request->chip, request->address,
+            result->reply, sizeof(HPMReply), request->flags, &length);
+        result->length = result->result == kIOReturnSuccess ? length : 0;
+
+        HPMInstrumentEnd(start, kHPMTraceOpRead, job->hpm->rid, request->chip, request->address,
+            request->flags, (uint32_t)result->length, result->result);
+        HPMCountError(result->result);
+    }
+
+    return NULL;
+}
+
+/// Assign each request to a lane by chip; returns the number of lanes used.
+static size_t HPMReadManyAssignLanes(HPMReadRequest const *requests, size_t count, uint8_t *lanes)
+{
+    uint64_t chips[kHPMReadManyMaxLanes];
+    size_t numChips = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        size_t lane = 0;
+        while (lane < numChips && chips[lane] != requests[i].chip)
+            ++lane;
+
+        // Once every lane is taken, further chips have to share.
+        if (lane == numChips) {
+            if (numChips < kHPMReadManyMaxLanes)
+                chips[numChips++] = requests[i].chip;
+            else
+                lane = requests[i].chip % kHPMReadManyMaxLanes;
+        }
+
+        lanes[i] = (uint8_t)lane;
+    }
+
+    return numChips;
+}
+
+IOReturn HPMReadMany(HPMClient const *hpm, HPMReadRequest const *requests, size_t count,
+    HPMReadResult *results, uint32_t options)
+{
+    if (!hpm || (count && (!requests || !results)))
+        return kIOReturnBadArgument;
+
+    HPMDebug("count=%zu, options=%#x", count, options);
+
+    HPMReadManyJob jobs[kHPMReadManyMaxLanes];
+    pthread_t threads[kHPMReadManyMaxLanes];
+    int started[kHPMReadManyMaxLanes] = { 0 };
+
+    uint8_t *lanes = NULL;
+    size_t numLanes = 1;
+    if ((options & kHPMReadManyOptionParallelChips) && count > 1) {
+        lanes = malloc(count);
+        if (!lanes)
+            return kIOReturnNoMemory;
+
+        numLanes = HPMReadManyAssignLanes(requests, count, lanes);
+    }
+
+    for (size_t lane = 0; lane < numLanes; ++lane) {
+        jobs[lane] = (HPMReadManyJob) {
+            .hpm = hpm,
+            .requests = requests,
+            .results = results,
+            .count = count,
+            .lanes = lanes,
+            .lane = (uint8_t)lane,
+        };
+    }
+
+    // The calling thread takes the first lane itself; lanes whose thread
+    // can't be started are done inline afterwards.
+    for (size_t lane = 1; lane < numLanes; ++lane)
+        started[lane] = pthread_create(&threads[lane], NULL, HPMReadManyWorker, &jobs[lane]) == 0;
+
+    HPMReadManyWorker(&jobs[0]);
+
+    for (size_t lane = 1; lane < numLanes; ++lane) {
+        if (started[lane])
+            pthread_join(threads[lane], NULL);
+        else
+            HPMReadManyWorker(&jobs[lane]);
+    }
+
+    free(lanes);
+
+    for (size_t i = 0; i < count; ++i)
+        if (results[i].result != kIOReturnSuccess)
+            return results[i].result;
+
+    return kIOReturnSuccess;
+}
+
+static IOReturn HPMDoCommandLegs(HPMClient const *hpm, uint64_t chip,
     HPMCommand command, uint8_t const *args, size_t argsLength, uint8_t *out)
 {
-    HPMDebug("chip=%#llx, command=%#x", chip, command);
+    uint64_t start = 0;
 
     if (args && argsLength) {
-        IOReturn ret = (*hpm->interface)->Write(hpm->interface, chip, 9, args, argsLength, 0);
+        start = HPMInstrumentBegin();
+        IOReturn ret = hpm->backend->Write(hpm->context, chip, 9, args, argsLength, 0);
+        HPMInstrumentEnd(start, kHPMTraceOpWrite, hpm->rid, chip, 9, 0, (uint32_t)argsLength, ret);
         if (ret != kIOReturnSuccess) {
             HPMDebug("Failed to write arguments. (%#x)", ret);
+            HPMCountError(ret);
             return ret;
         }
     }
 
-    IOReturn ret = (*hpm->interface)->Command(hpm->interface, chip, command, 0);
+    start = HPMInstrumentBegin();
+    IOReturn ret = hpm->backend->Command(hpm->context, chip, command, 0);
+    HPMInstrumentEnd(start, kHPMTraceOpCommand, hpm->rid, chip, command, 0, 0, ret);
     if (ret != kIOReturnSuccess) {
         HPMDebug("Failed to issue command. (%#x)", ret);
+        HPMCountError(ret);
         return ret;
     }
 
     size_t length = 0;
     HPMReply reply;
-    ret = HPMRead(hpm, chip, 9, 0, reply, &length);
+    ret = HPMReadOnce(hpm, chip, 9, 0, reply, &length);
     if (ret != kIOReturnSuccess || !length) {
         HPMDebug("Failed to read command reply. (%#x, %#zx)", ret, length);
         return ret;
@@ -205,9 +495,43 @@ IOReturn HPMDoCommand(HPMClient const *hpm, uint64_t chip,
     return kIOReturnSuccess;
 }
 
+static IOReturn HPMDoCommandOnce(HPMClient const *hpm, uint64_t chip,
+    HPMCommand command, uint8_t const *args, size_t argsLength, uint8_t *out)
+{
+    HPMDebug("chip=%#llx, command=%#x", chip, command);
+
+    uint64_t start = HPMInstrumentBegin();
+    IOReturn ret = HPMDoCommandLegs(hpm, chip, command, args, argsLength, out);
+    HPMInstrumentEnd(start, kHPMTraceOpDoCommand, hpm->rid, chip, command, 0, (uint32_t)argsLength, ret);
+
+    return ret;
+}
+
+static IOReturn HPMDoCommandAttempt(HPMClient const *hpm, void *refcon)
+{
+    HPMRetryContext const *c = refcon;
+    return HPMDoCommandOnce(hpm, c->chip, (HPMCommand)c->arg, c->data, c->dataLength, c->reply);
+}
+
+IOReturn HPMDoCommand(HPMClient const *hpm, uint64_t chip,
+    HPMCommand command, uint8_t const *args, size_t argsLength, uint8_t *out)
+{
+    if (!hpm->retryPolicy)
+        return HPMDoCommandOnce(hpm, chip, command, args, argsLength, out);
+
+    HPMRetryContext context = {
+        .chip = chip,
+        .arg = (uint32_t)command,
+        .data = args,
+        .dataLength = argsLength,
+        .reply = out,
+    };
+    return HPMRetryRun(hpm->retryPolicy, hpm, HPMDoCommandAttempt, &context);
+}
+
 typedef uint8_t VDMBuffer[128];
 
-IOReturn HPMSendVDM(HPMClient const *hpm, uint64_t chip, void const *body, size_t bodyLength)
+static IOReturn HPMSendVDMOnce(HPMClient const *hpm, uint64_t chip, void const *body, size_t bodyLength)
 {
 #if HPMFRAUD_CONFIG_DEBUG
     char previewBuf[256] = { 0 };
@@ -224,30 +548,43 @@ IOReturn HPMSendVDM(HPMClient const *hpm, uint64_t chip, void const *body, size_
     HPMDebug("chip=%#llx, body=[%s]", chip, previewBuf);
 #endif
 
-    return (*hpm->interface)->SendVDM(hpm->interface, chip, 3, body, bodyLength, 0);
+    uint32_t firstWord = 0;
+    memcpy(&firstWord, body, bodyLength < sizeof(firstWord) ? bodyLength : sizeof(firstWord));
+
+    uint64_t start = HPMInstrumentBegin();
+    IOReturn ret = hpm->backend->SendVDM(hpm->context, chip, 3, body, bodyLength, 0);
+    HPMInstrumentEnd(start, kHPMTraceOpSendVDM, hpm->rid, chip, firstWord, 0, (uint32_t)bodyLength, ret);
+    HPMCountError(ret);
+    if (ret == kIOReturnSuccess && hpm->rid >= 0 && hpm->rid < kHPMMaxRIDs)
+        atomic_fetch_add_explicit(&sCounters.vdmsSent[hpm->rid], 1, memory_order_relaxed);
+
+    return ret;
 }
 
-/// VDM main commands.
-typedef enum {
-    kVDMCommandList = 0x5ac8010,   ///< Get supported actions.
-    kVDMCommandInfo = 0x5ac8011,   ///< Get info for an action.
-    kVDMCommandAction = 0x5ac8012, ///< Perform an action.
-} VDMCommand;
+static IOReturn HPMSendVDMAttempt(HPMClient const *hpm, void *refcon)
+{
+    HPMRetryContext const *c = refcon;
+    return HPMSendVDMOnce(hpm, c->chip, c->data, c->dataLength);
+}
 
-/// VDM actions used with the "perform" command.
-typedef enum {
-    kVDMActionReboot = 0x105,    ///< Reboot the device.
-    kVDMActionDFU = 0x106,       ///< Go to DFU mode.
-    kVDMActionDebugUSB = 0x4606, ///< Pull up Debug USB.
-} VDMAction;
+IOReturn HPMSendVDM(HPMClient const *hpm, uint64_t chip, void const *body, size_t bodyLength)
+{
+    uint64_t start = HPMNow();
+    IOReturn ret;
+    if (hpm->retryPolicy) {
+        HPMRetryContext context = {
+            .chip = chip,
+            .data = body,
+            .dataLength = bodyLength,
+        };
+        ret = HPMRetryRun(hpm->retryPolicy, hpm, HPMSendVDMAttempt, &context);
+    } else {
+        ret = HPMSendVDMOnce(hpm, chip, body, bodyLength);
+    }
 
-/// VDM action flags.
-typedef enum {
-    kVDMFlagsLine1 = (1 << 17),    ///< Map line 1.
-    kVDMFlagsGraceful = (1 << 23), ///< Exit conflicting modes if possible.
-    kVDMFlagsPersist = (1 << 24),  ///< Persist through soft reset.
-    kVDMFlagsExit = (1 << 25),     ///< Exit mode (instead of enter).
-} VDMFlags;
+    HPMStatsRecord(kHPMStatsOpSendVDM, hpm->rid, start, ret);
+    return ret;
+}
 
 IOReturn HPMSendKnownVDM(HPMClient const *hpm, uint64_t chip, HPMKnownVDM knownVDM)
 {
@@ -286,40 +623,243 @@ IOReturn HPMSendKnownVDM(HPMClient const *hpm, uint64_t chip, HPMKnownVDM knownV
     }
 }
 
-static uint8_t const *HPMGetACEUnlockKey(void)
+static IOReturn HPMUnlockAttempt(HPMClient const *hpm, void *refcon)
 {
-    // Avoid calling into IOKit multiple times.
-    static uint32_t sKey = 0;
-    if (sKey)
-        return (uint8_t const *)&sKey;
+    HPMRetryContext const *c = refcon;
+    if (hpm->rid >= 0 && hpm->rid < kHPMMaxRIDs)
+        atomic_fetch_add_explicit(&sCounters.unlockAttempts[hpm->rid], 1, memory_order_relaxed);
+
+    return HPMDoCommand(hpm, c->chip, (HPMCommand)c->arg, c->data, c->dataLength, NULL);
+}
+
+IOReturn HPMUnlockACE(HPMClient const *hpm)
+{
+    uint8_t const *key = hpm->backend->GetUnlockKey();
+    if (!key)
+        return kIOReturnNotFound;
+
+    // Sometimes this doesn't work right away, even with the client's retries;
+    // the unlock policy then figuratively takes the game cartridge out and
+    // blows air on it (`Gaid`) before trying again.
+    HPMRetryContext context = {
+        .arg = (uint32_t)kHPMCommandLock,
+        .data = key,
+        .dataLength = 4,
+    };
+    uint64_t start = HPMNow();
+    IOReturn ret = HPMRetryRun(HPMGetUnlockRetryPolicy(), hpm, HPMUnlockAttempt, &context);
+    HPMStatsRecord(kHPMStatsOpUnlock, hpm->rid, start, ret);
+    return ret;
+}
+
+void HPMClientSetOptions(HPMClient *hpm, uint32_t options)
+{
+    hpm->options = options;
+}
+
+HPMState HPMGetState(HPMClient const *hpm)
+{
+    return hpm->state;
+}
+
+void HPMInvalidateState(HPMClient *hpm)
+{
+    hpm->state = kHPMStateUnknown;
+    hpm->status.timestamp = 0;
+}
+
+/// Mode reads HPMWaitForMode makes back-to-back before it starts sleeping.
+#define kHPMModeSpinPolls 4
 
-    CFMutableDictionaryRef matching = IOServiceMatching("IOPlatformExpertDevice");
-    io_service_t service = IOServiceGetMatchingService(kIOMainPortDefault, matching);
-    if (!service) {
-        HPMDebug("Failed to get platform expert service.");
-        return NULL;
+/// Sleep bounds between mode reads after the initial spin.
+#define kHPMModeMinPollNs 50000ull
+#define kHPMModeMaxPollNs 10000000ull
+
+IOReturn HPMWaitForMode(HPMClient const *hpm, HPMMode target, uint32_t timeoutMs, HPMModeWait *wait)
+{
+    uint64_t traceStart = HPMInstrumentBegin();
+    uint64_t start = HPMNow();
+    uint64_t deadline = start + (uint64_t)timeoutMs * 1000000;
+    uint64_t interval = kHPMModeMinPollNs;
+    uint32_t polls = 0;
+    IOReturn ret;
+
+    for (;;) {
+        HPMMode mode = kHPMModeError;
+        ret = HPMGetMode(hpm, &mode);
+        ++polls;
+        if (ret == kIOReturnSuccess && mode == target)
+            break;
+
+        // Reads can fail while the controller is busy switching, so only
+        // give up on them once out of time.
+        uint64_t now = HPMNow();
+        if (now >= deadline) {
+            if (ret == kIOReturnSuccess)
+                ret = kIOReturnTimeout;
+            break;
+        }
+
+        if (polls < kHPMModeSpinPolls)
+            continue;
+
+        uint64_t nap = deadline - now < interval ? deadline - now : interval;
+        struct timespec ts = { .tv_sec = nap / 1000000000, .tv_nsec = nap % 1000000000 };
+        nanosleep(&ts, NULL);
+        if ((interval *= 2) > kHPMModeMaxPollNs)
+            interval = kHPMModeMaxPollNs;
     }
 
-    io_name_t name;
-    if (IORegistryEntryGetName(service, name) != kIOReturnSuccess) {
-        HPMDebug("Failed to get registry entry name.");
-        return NULL;
+    uint64_t end = HPMNow();
+    HPMDebug("target=%d, polls=%u, elapsed=%lluns, ret=%#x", target, polls,
+        (unsigned long long)(end - start), ret);
+
+    HPMInstrumentEnd(traceStart, kHPMTraceOpWaitForMode, hpm->rid, 0, polls, 0, 0, ret);
+
+    if (wait) {
+        wait->polls = polls;
+        wait->elapsedNs = end - start;
     }
 
-    IOObjectRelease(service);
+    return ret;
+}
 
-    sKey = (name[0] << 24) | (name[1] << 16) | (name[2] << 8) | name[3];
-    return (uint8_t const *)&sKey;
+void HPMClientSetModeTimeout(HPMClient *hpm, uint32_t timeoutMs)
+{
+    hpm->modeTimeoutMs = timeoutMs;
 }
 
-IOReturn HPMUnlockACE(HPMClient const *hpm)
+void HPMGetLastModeWait(HPMClient const *hpm, HPMModeWait *wait)
+{
+    *wait = hpm->lastModeWait;
+}
+
+/// Switch between app and DBMa mode and confirm the switch took.
+static IOReturn HPMSwitchMode(HPMClient *hpm, HPMMode target)
 {
-    IOReturn ret = HPMDoCommand(hpm, 0, kHPMCommandLock, HPMGetACEUnlockKey(), 4, NULL);
+    // Unless the switch is confirmed, the mode in the snapshot is no good.
+    HPMStatus previous = hpm->status;
+    hpm->status.timestamp = 0;
+
+    uint64_t start = HPMNow();
+    uint8_t const *arg = target == kHPMModeDBMA ? kHPMCommandArg1 : kHPMCommandArg0;
+    IOReturn ret = HPMDoCommand(hpm, 0, kHPMCommandDBMA, arg, 1, NULL);
     if (ret == kIOReturnSuccess)
+        ret = HPMWaitForMode(hpm, target, hpm->modeTimeoutMs, &hpm->lastModeWait);
+
+    HPMStatsRecord(target == kHPMModeDBMA ? kHPMStatsOpEnterDBMA : kHPMStatsOpExitDBMA, hpm->rid, start, ret);
+    if (ret != kIOReturnSuccess)
         return ret;
 
-    // Sometimes the attmpet above doesn't work right away; try figuratively
-    // taking the game cartridge out and blowing air on it...
-    IO_TRY(HPMDoCommand(hpm, 0, kHPMCommandGAID, NULL, 0, NULL));
-    return HPMDoCommand(hpm, 0, kHPMCommandLock, HPMGetACEUnlockKey(), 4, NULL);
+    HPMCountStatus(hpm->rid, kHPMConnectionTypeError, target, HPMNow());
+
+    if (previous.timestamp) {
+        hpm->status = previous;
+        hpm->status.mode = target;
+    }
+
+    return kIOReturnSuccess;
+}
+
+IOReturn HPMEnterDBMA(HPMClient *hpm)
+{
+    if (hpm->state == kHPMStateUnknown) {
+        HPMMode mode = hpm->status.mode;
+        if (!HPMStatusIsFresh(hpm, HPMNow(), hpm->statusMaxAgeMs))
+            IO_TRY(HPMGetMode(hpm, &mode));
+
+        hpm->state = mode == kHPMModeDBMA ? kHPMStateDBMA : kHPMStateApp;
+    }
+
+    if (hpm->state == kHPMStateApp) {
+        IO_TRY(HPMUnlockACE(hpm));
+        hpm->state = kHPMStateUnlocked;
+    }
+
+    if (hpm->state == kHPMStateUnlocked) {
+        IOReturn ret = HPMSwitchMode(hpm, kHPMModeDBMA);
+        if (ret != kIOReturnSuccess) {
+            hpm->state = kHPMStateUnknown;
+            return ret;
+        }
+
+        hpm->state = kHPMStateDBMA;
+    }
+
+    HPMDebug("state=%d", hpm->state);
+    return kIOReturnSuccess;
+}
+
+IOReturn HPMExitDBMA(HPMClient *hpm)
+{
+    if (hpm->options & kHPMClientOptionStayInDBMA)
+        return kIOReturnSuccess;
+    if (hpm->state == kHPMStateApp || hpm->state == kHPMStateUnlocked)
+        return kIOReturnSuccess;
+
+    IOReturn ret = HPMSwitchMode(hpm, kHPMModeApp);
+
+    // Whether ACE stays unlocked across the switch is anyone's guess.
+    hpm->state = ret == kIOReturnSuccess ? kHPMStateApp : kHPMStateUnknown;
+    return ret;
+}
+
+/// Poll interval bounds for HPMWaitForReattach.
+#define kHPMReattachMinPollNs 1000000ull
+#define kHPMReattachMaxPollNs 50000000ull
+
+/// Swap the client's context for a fresh one, keeping its options.
+static IOReturn HPMClientReopen(HPMClient *hpm)
+{
+    HPMClient fresh;
+    IO_TRY(HPMClientOpenWithBackend(&fresh, hpm->backend, hpm->rid));
+    fresh.options = hpm->options;
+    fresh.statusMaxAgeMs = hpm->statusMaxAgeMs;
+    fresh.modeTimeoutMs = hpm->modeTimeoutMs;
+    fresh.retryPolicy = hpm->retryPolicy;
+
+    hpm->backend->Close(hpm->context);
+    *hpm = fresh;
+    return kIOReturnSuccess;
+}
+
+IOReturn HPMWaitForReattach(HPMClient *hpm, uint32_t timeoutMs)
+{
+    HPMBackend const *backend = hpm->backend;
+    uint64_t generation = HPMServiceCacheGetGeneration(backend);
+    uint64_t deadline = HPMNow() + (uint64_t)timeoutMs * 1000000;
+    uint64_t interval = kHPMReattachMinPollNs;
+    int detached = 0;
+    int stale = 0;
+
+    for (;;) {
+        if (stale && HPMClientReopen(hpm) == kIOReturnSuccess)
+            stale = 0;
+
+        if (!stale) {
+            HPMConnectionType connection = HPMGetConnectionType(hpm);
+            if (connection == kHPMConnectionTypeError) {
+                // Most likely the service went away with the device.
+                HPMDebug("Lost service for RID %d.", hpm->rid);
+                detached = stale = 1;
+            } else if (connection == kHPMConnectionTypeNone) {
+                detached = 1;
+            } else if (detached) {
+                HPMInvalidateState(hpm);
+                return kIOReturnSuccess;
+            }
+        }
+
+        uint64_t now = HPMNow();
+        if (now >= deadline)
+            return kIOReturnTimeout;
+
+        // A notification usually means more are on the way, so go back to
+        // checking quickly; otherwise back off to keep the polling cheap.
+        uint64_t wait = deadline - now < interval ? deadline - now : interval;
+        if (HPMServiceCacheWait(backend, &generation, wait) == kIOReturnSuccess)
+            interval = kHPMReattachMinPollNs;
+        else if ((interval *= 2) > kHPMReattachMaxPollNs)
+            interval = kHPMReattachMaxPollNs;
+    }
 }
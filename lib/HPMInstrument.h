@@ -0,0 +1,52 @@
+//
+//  HPMInstrument.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMStats.h"
+#include "HPMTrace.h"
+
+#include <stdatomic.h>
+#include <time.h>
+
+// Hooks placed around every hardware operation. Keep these cheap: they sit
+// on the hot path whether or not anyone is looking.
+
+extern atomic_int gHPMTraceEnabled;
+
+static inline uint64_t HPMNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void HPMTraceRecord(HPMTraceOp op, int32_t rid, uint64_t chip, uint32_t arg, uint32_t flags, uint32_t length,
+    IOReturn result, uint64_t start);
+
+/// Count an operation started at \p start in the latency statistics. Unlike
+/// tracing, this is always on.
+void HPMStatsRecord(HPMStatsOp op, int32_t rid, uint64_t start, IOReturn result);
+
+/// Get a start timestamp for an operation, or zero if nothing is recording.
+static inline uint64_t HPMInstrumentBegin(void)
+{
+    if (__builtin_expect(atomic_load_explicit(&gHPMTraceEnabled, memory_order_relaxed), 0))
+        return HPMNow();
+
+    return 0;
+}
+
+/// Record the end of an operation started with HPMInstrumentBegin.
+static inline void HPMInstrumentEnd(uint64_t start, HPMTraceOp op, int32_t rid,
+    uint64_t chip, uint32_t arg, uint32_t flags, uint32_t length, IOReturn result)
+{
+    if (__builtin_expect(start != 0, 0))
+        HPMTraceRecord(op, rid, chip, arg, flags, length, result, start);
+}
@@ -0,0 +1,188 @@
+//
+//  HPMMetrics.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "HPMMetrics.h"
+
+#include "HPMRetry.h"
+#include "HPMStats.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+/// Histogram buckets are exported at powers of four from 2^10 ns (about 1 us)
+/// to 2^32 ns (about 4 s); these fall on HPMHistogram bucket boundaries, so
+/// the exported counts are exact.
+#define kHPMMetricsMinBucketBits 10
+#define kHPMMetricsMaxBucketBits 32
+
+static void HPMMetricsWriteHeader(FILE *file, char const *name, char const *type, char const *help)
+{
+    fprintf(file, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+static void HPMMetricsWriteHistogram(FILE *file, char const *op, int rid, HPMHistogram const *h)
+{
+    char const *name = "vdmpoke_operation_duration_seconds";
+    uint64_t cumulative = 0;
+    unsigned next = 0;
+    for (unsigned bits = kHPMMetricsMinBucketBits; bits <= kHPMMetricsMaxBucketBits; bits += 2) {
+        // Values below 2^bits fill exactly the buckets below this one.
+        unsigned end = (bits - 2) * kHPMHistogramSubBuckets;
+        for (; next < end; ++next)
+            cumulative += h->buckets[next];
+
+        fprintf(file, "%s_bucket{op=\"%s\",rid=\"%d\",le=\"%.9f\"} %" PRIu64 "\n", name, op, rid,
+            (double)(1ull << bits) / 1e9, cumulative);
+    }
+
+    fprintf(file, "%s_bucket{op=\"%s\",rid=\"%d\",le=\"+Inf\"} %" PRIu64 "\n", name, op, rid, h->count);
+    fprintf(file, "%s_count{op=\"%s\",rid=\"%d\"} %" PRIu64 "\n", name, op, rid, h->count);
+    fprintf(file, "%s_sum{op=\"%s\",rid=\"%d\"} %.9f\n", name, op, rid, (double)h->sum / 1e9);
+}
+
+static void HPMMetricsWriteStats(FILE *file, HPMStats const *stats)
+{
+    HPMMetricsWriteHeader(file, "vdmpoke_operation_duration_seconds", "histogram",
+        "Duration of port operations, including retries.");
+    fprintf(file, "# UNIT vdmpoke_operation_duration_seconds seconds\n");
+    for (int op = 0; op < kHPMStatsOpCount; ++op)
+        for (int rid = 0; rid < kHPMMaxRIDs; ++rid)
+            if (stats->histograms[op][rid].count)
+                HPMMetricsWriteHistogram(file, HPMStatsOpGetName(op), rid, &stats->histograms[op][rid]);
+
+    HPMMetricsWriteHeader(file, "vdmpoke_operation_failures", "counter", "Port operations that failed.");
+    for (int op = 0; op < kHPMStatsOpCount; ++op) {
+        for (int rid = 0; rid < kHPMMaxRIDs; ++rid) {
+            HPMHistogram const *h = &stats->histograms[op][rid];
+            if (h->count)
+                fprintf(file, "vdmpoke_operation_failures_total{op=\"%s\",rid=\"%d\"} %" PRIu64 "\n",
+                    HPMStatsOpGetName(op), rid, h->errors);
+        }
+    }
+}
+
+static void HPMMetricsWriteCounters(FILE *file, HPMCounters const *counters)
+{
+    HPMMetricsWriteHeader(file, "vdmpoke_vdms_sent", "counter", "VDMs sent successfully.");
+    for (int rid = 0; rid < kHPMMaxRIDs; ++rid)
+        if (counters->vdmsSent[rid])
+            fprintf(file, "vdmpoke_vdms_sent_total{rid=\"%d\"} %" PRIu64 "\n", rid, counters->vdmsSent[rid]);
+
+    HPMMetricsWriteHeader(file, "vdmpoke_backend_errors", "counter",
+        "Failed calls to the HPM backend, including ones later retried.");
+    for (size_t i = 0; i < counters->numErrors; ++i)
+        fprintf(file, "vdmpoke_backend_errors_total{code=\"%#x\"} %" PRIu64 "\n", (unsigned)counters->errors[i].code,
+            counters->errors[i].count);
+    if (counters->otherErrors)
+        fprintf(file, "vdmpoke_backend_errors_total{code=\"other\"} %" PRIu64 "\n", counters->otherErrors);
+
+    HPMMetricsWriteHeader(file, "vdmpoke_unlock_attempts", "counter",
+        "LOCK attempts made to unlock ACE, including retries.");
+    for (int rid = 0; rid < kHPMMaxRIDs; ++rid)
+        if (counters->unlockAttempts[rid])
+            fprintf(file, "vdmpoke_unlock_attempts_total{rid=\"%d\"} %" PRIu64 "\n", rid,
+                counters->unlockAttempts[rid]);
+
+    // Each port's state is a set of flags, exactly one of which is set.
+    static HPMConnectionType const connections[] = {
+        kHPMConnectionTypeNone,
+        kHPMConnectionTypeSource,
+        kHPMConnectionTypeSink,
+        kHPMConnectionTypeError,
+    };
+    HPMMetricsWriteHeader(file, "vdmpoke_port_connection", "stateset", "Connection type last read from the port.");
+    for (int rid = 0; rid < kHPMMaxRIDs; ++rid) {
+        if (!counters->statusAt[rid])
+            continue;
+
+        for (size_t i = 0; i < sizeof(connections) / sizeof(connections[0]); ++i)
+            fprintf(file, "vdmpoke_port_connection{rid=\"%d\",vdmpoke_port_connection=\"%s\"} %d\n", rid,
+                HPMConnectionTypeGetName(connections[i]), counters->connection[rid] == connections[i]);
+    }
+
+    static HPMMode const modes[] = { kHPMModeApp, kHPMModeDBMA, kHPMModeUnknown, kHPMModeError };
+    HPMMetricsWriteHeader(file, "vdmpoke_port_mode", "stateset", "Mode last read from the port.");
+    for (int rid = 0; rid < kHPMMaxRIDs; ++rid) {
+        if (!counters->statusAt[rid])
+            continue;
+
+        for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i)
+            fprintf(file, "vdmpoke_port_mode{rid=\"%d\",vdmpoke_port_mode=\"%s\"} %d\n", rid,
+                HPMModeGetName(modes[i]), counters->mode[rid] == modes[i]);
+    }
+}
+
+static void HPMMetricsWriteUnlockPolicy(FILE *file)
+{
+    HPMRetryStats stats;
+    HPMRetryPolicyGetStats(HPMGetUnlockRetryPolicy(), &stats);
+
+    HPMMetricsWriteHeader(file, "vdmpoke_unlock_retries", "counter", "Times unlocking ACE was tried again.");
+    fprintf(file, "vdmpoke_unlock_retries_total %" PRIu64 "\n", stats.attempts - stats.operations);
+    HPMMetricsWriteHeader(file, "vdmpoke_unlock_recoveries", "counter", "Gaid commands issued to recover unlocking.");
+    fprintf(file, "vdmpoke_unlock_recoveries_total %" PRIu64 "\n", stats.recoveries);
+    HPMMetricsWriteHeader(file, "vdmpoke_unlock_failures", "counter", "Times unlocking ACE failed for good.");
+    fprintf(file, "vdmpoke_unlock_failures_total %" PRIu64 "\n", stats.failures);
+}
+
+IOReturn HPMMetricsWrite(FILE *file)
+{
+    HPMStats *stats = calloc(1, sizeof(*stats));
+    if (!stats)
+        return kIOReturnNoMemory;
+
+    HPMCounters counters;
+    HPMGetCounters(&counters);
+    HPMStatsCollect(stats);
+
+    HPMMetricsWriteCounters(file, &counters);
+    HPMMetricsWriteUnlockPolicy(file);
+    HPMMetricsWriteStats(file, stats);
+    fprintf(file, "# EOF\n");
+
+    free(stats);
+    return ferror(file) ? kIOReturnIOError : kIOReturnSuccess;
+}
+
+IOReturn HPMMetricsWriteFile(char const *path)
+{
+    // Write next to the destination and rename it over, which is atomic as
+    // long as both are on the same file system.
+    char temp[1024];
+    if (snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid()) >= (int)sizeof(temp))
+        return kIOReturnBadArgument;
+
+    // A leftover from a previous process with our PID is removed first; that
+    // only ever removes a link, never what it points to.
+    unlink(temp);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    FILE *file = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!file) {
+        if (fd >= 0)
+            close(fd);
+        return kIOReturnNotPermitted;
+    }
+
+    IOReturn ret = HPMMetricsWrite(file);
+    if (fflush(file) != 0 || fsync(fd) != 0)
+        ret = kIOReturnIOError;
+    if (fclose(file) != 0 && ret == kIOReturnSuccess)
+        ret = kIOReturnIOError;
+
+    if (ret == kIOReturnSuccess && rename(temp, path) != 0)
+        ret = kIOReturnIOError;
+    if (ret != kIOReturnSuccess)
+        unlink(temp);
+
+    return ret;
+}
@@ -0,0 +1,776 @@
+//
+//  HPMRecord.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "HPMRecord.h"
+
+#include "HPMBackend.h"
+#include "HPMDebug.h"
+#include "HPMInstrument.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Logs are a header followed by one entry per call, each entry followed by
+// its payload: the services found for Enumerate, the reply for Read, and the
+// data sent for Write and SendVDM. Everything is in host byte order.
+
+#define kHPMRecordMagic 0x524d5048 // 'HPMR'
+#define kHPMRecordVersion 1
+
+typedef enum {
+    kHPMRecordTypeEnumerate = 1,
+    kHPMRecordTypeOpen,
+    kHPMRecordTypeClose,
+    kHPMRecordTypeRead,
+    kHPMRecordTypeWrite,
+    kHPMRecordTypeCommand,
+    kHPMRecordTypeSendVDM,
+    kHPMRecordTypeNotify,
+} HPMRecordType;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t hasUnlockKey;
+    uint8_t unlockKey[4];
+} HPMRecordHeader;
+
+typedef struct {
+    uint8_t type;
+    uint8_t reserved[3];
+    uint32_t client;        ///< Client the call was made on, numbered from 1 in order of opening.
+    IOReturn result;
+    uint32_t arg;           ///< Register address, command, VDM argument, the RID for Open, or for
+                            ///< notifications, whether services came or went.
+    uint64_t chip;
+    uint32_t flags;
+    uint32_t length;        ///< Length of the buffer passed in.
+    uint32_t payloadLength; ///< Length of the payload following the entry.
+    uint32_t reserved2;
+    uint64_t start;         ///< Time since recording started, in nanoseconds.
+    uint64_t duration;      ///< Duration of the call, in nanoseconds.
+} HPMRecordEntry;
+
+//----------------------------------------------------------------------------
+// Recording
+
+typedef struct {
+    void *inner;
+    uint32_t client;
+} HPMRecordContext;
+
+static struct {
+    pthread_mutex_t lock;
+    HPMBackend const *inner;
+    FILE *file;
+    IOReturn error;
+    uint64_t origin;
+    uint32_t lastClient;
+
+    void (*changed)(void *refcon, int services);
+    void *refcon;
+} sRecorder = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void HPMRecordAppend(HPMRecordEntry *entry, uint64_t start, void const *payload, size_t payloadLength)
+{
+    uint64_t end = HPMNow();
+
+    pthread_mutex_lock(&sRecorder.lock);
+    if (sRecorder.file) {
+        entry->start = start - sRecorder.origin;
+        entry->duration = end - start;
+        entry->payloadLength = (uint32_t)payloadLength;
+
+        if (fwrite(entry, sizeof(*entry), 1, sRecorder.file) != 1
+            || (payloadLength && fwrite(payload, payloadLength, 1, sRecorder.file) != 1))
+            sRecorder.error = kIOReturnIOError;
+    }
+    pthread_mutex_unlock(&sRecorder.lock);
+}
+
+static IOReturn HPMRecordEnumerate(HPMBackendService *services, size_t maxServices, size_t *numServices)
+{
+    uint64_t start = HPMNow();
+    IOReturn ret = sRecorder.inner->Enumerate(services, maxServices, numServices);
+
+    HPMRecordEntry entry = { .type = kHPMRecordTypeEnumerate, .result = ret };
+    size_t count = ret == kIOReturnSuccess ? *numServices : 0;
+    HPMRecordAppend(&entry, start, services, count * sizeof(*services));
+    return ret;
+}
+
+static void HPMRecordRetainService(uint64_t handle)
+{
+    sRecorder.inner->RetainService(handle);
+}
+
+static void HPMRecordReleaseService(uint64_t handle)
+{
+    sRecorder.inner->ReleaseService(handle);
+}
+
+static void HPMRecordChanged(void *refcon, int services)
+{
+    (void)refcon;
+
+    HPMRecordEntry entry = { .type = kHPMRecordTypeNotify, .arg = (uint32_t)services };
+    HPMRecordAppend(&entry, HPMNow(), NULL, 0);
+
+    // The inner backend only delivers to one watcher, which is now us; keep
+    // its own service cache from going stale.
+    HPMServiceCacheNotify(sRecorder.inner, services);
+    if (sRecorder.changed)
+        sRecorder.changed(sRecorder.refcon, services);
+}
+
+static IOReturn HPMRecordWatch(void (*changed)(void *refcon, int services), void *refcon)
+{
+    sRecorder.changed = changed;
+    sRecorder.refcon = refcon;
+    return sRecorder.inner->Watch(HPMRecordChanged, NULL);
+}
+
+static IOReturn HPMRecordOpen(HPMBackendService const *service, void **context)
+{
+    HPMRecordContext *record = calloc(1, sizeof(*record));
+    if (!record)
+        return kIOReturnNoMemory;
+
+    uint64_t start = HPMNow();
+    IOReturn ret = sRecorder.inner->Open(service, &record->inner);
+    if (ret == kIOReturnSuccess) {
+        pthread_mutex_lock(&sRecorder.lock);
+        record->client = ++sRecorder.lastClient;
+        pthread_mutex_unlock(&sRecorder.lock);
+    }
+
+    HPMRecordEntry entry = {
+        .type = kHPMRecordTypeOpen,
+        .client = record->client,
+        .result = ret,
+        .arg = (uint32_t)service->info.rid,
+    };
+    HPMRecordAppend(&entry, start, NULL, 0);
+
+    if (ret != kIOReturnSuccess) {
+        free(record);
+        return ret;
+    }
+
+    *context = record;
+    return kIOReturnSuccess;
+}
+
+static void HPMRecordClose(void *context)
+{
+    HPMRecordContext *record = context;
+
+    uint64_t start = HPMNow();
+    sRecorder.inner->Close(record->inner);
+
+    HPMRecordEntry entry = { .type = kHPMRecordTypeClose, .client = record->client };
+    HPMRecordAppend(&entry, start, NULL, 0);
+    free(record);
+}
+
+static IOReturn HPMRecordRead(void *context, uint64_t chip, uint8_t address,
+    void *buffer, size_t length, uint32_t flags, uint64_t *readLength)
+{
+    HPMRecordContext *record = context;
+
+    uint64_t start = HPMNow();
+    IOReturn ret = sRecorder.inner->Read(record->inner, chip, address, buffer, length, flags, readLength);
+
+    HPMRecordEntry entry = {
+        .type = kHPMRecordTypeRead,
+        .client = record->client,
+        .result = ret,
+        .arg = address,
+        .chip = chip,
+        .flags = flags,
+        .length = (uint32_t)length,
+    };
+    size_t replyLength = ret != kIOReturnSuccess ? 0 : *readLength < length ? *readLength : length;
+    HPMRecordAppend(&entry, start, buffer, replyLength);
+    return ret;
+}
+
+static IOReturn HPMRecordWrite(void *context, uint64_t chip, uint8_t address,
+    void const *buffer, size_t length, uint32_t flags)
+{
+    HPMRecordContext *record = context;
+
+    uint64_t start = HPMNow();
+    IOReturn ret = sRecorder.inner->Write(record->inner, chip, address, buffer, length, flags);
+
+    HPMRecordEntry entry = {
+        .type = kHPMRecordTypeWrite,
+        .client = record->client,
+        .result = ret,
+        .arg = address,
+        .chip = chip,
+        .flags = flags,
+        .length = (uint32_t)length,
+    };
+    HPMRecordAppend(&entry, start, buffer, length);
+    return ret;
+}
+
+static IOReturn HPMRecordCommand(void *context, uint64_t chip, uint32_t command, uint32_t flags)
+{
+    HPMRecordContext *record = context;
+
+    uint64_t start = HPMNow();
+    IOReturn ret = sRecorder.inner->Command(record->inner, chip, command, flags);
+
+    HPMRecordEntry entry = {
+        .type = kHPMRecordTypeCommand,
+        .client = record->client,
+        .result = ret,
+        .arg = command,
+        .chip = chip,
+        .flags = flags,
+    };
+    HPMRecordAppend(&entry, start, NULL, 0);
+    return ret;
+}
+
+static IOReturn HPMRecordSendVDM(void *context, uint64_t chip, int arg, void const *buffer, size_t length, uint32_t flags)
+{
+    HPMRecordContext *record = context;
+
+    uint64_t start = HPMNow();
+    IOReturn ret = sRecorder.inner->SendVDM(record->inner, chip, arg, buffer, length, flags);
+
+    HPMRecordEntry entry = {
+        .type = kHPMRecordTypeSendVDM,
+        .client = record->client,
+        .result = ret,
+        .arg = (uint32_t)arg,
+        .chip = chip,
+        .flags = flags,
+        .length = (uint32_t)length,
+    };
+    HPMRecordAppend(&entry, start, buffer, length);
+    return ret;
+}
+
+static uint8_t const *HPMRecordGetUnlockKey(void)
+{
+    return sRecorder.inner->GetUnlockKey ? sRecorder.inner->GetUnlockKey() : NULL;
+}
+
+static HPMServiceCache sRecordCache = kHPMServiceCacheInitializer;
+
+static HPMBackend const sRecordBackend = {
+    .name = "record",
+    .cache = &sRecordCache,
+    .Enumerate = HPMRecordEnumerate,
+    .RetainService = HPMRecordRetainService,
+    .ReleaseService = HPMRecordReleaseService,
+    .Watch = HPMRecordWatch,
+    .Open = HPMRecordOpen,
+    .Close = HPMRecordClose,
+    .Read = HPMRecordRead,
+    .Write = HPMRecordWrite,
+    .Command = HPMRecordCommand,
+    .SendVDM = HPMRecordSendVDM,
+    .GetUnlockKey = HPMRecordGetUnlockKey,
+};
+
+IOReturn HPMRecordStart(HPMBackend const *backend, char const *path, HPMBackend const **recorder)
+{
+    if (!backend || backend == &sRecordBackend || !path || !recorder)
+        return kIOReturnBadArgument;
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return kIOReturnNotPermitted;
+
+    HPMRecordHeader header = { .magic = kHPMRecordMagic, .version = kHPMRecordVersion };
+    uint8_t const *key = backend->GetUnlockKey ? backend->GetUnlockKey() : NULL;
+    if (key) {
+        header.hasUnlockKey = 1;
+        memcpy(header.unlockKey, key, sizeof(header.unlockKey));
+    }
+
+    pthread_mutex_lock(&sRecorder.lock);
+    if (sRecorder.file) {
+        pthread_mutex_unlock(&sRecorder.lock);
+        fclose(file);
+        return kIOReturnBusy;
+    }
+
+    sRecorder.inner = backend;
+    sRecorder.file = file;
+    sRecorder.error = fwrite(&header, sizeof(header), 1, file) == 1 ? kIOReturnSuccess : kIOReturnIOError;
+    sRecorder.origin = HPMNow();
+    sRecorder.lastClient = 0;
+    pthread_mutex_unlock(&sRecorder.lock);
+
+    // Services cached by an earlier recording belong to its backend.
+    HPMInvalidateServices(&sRecordBackend);
+    if (sRecorder.changed)
+        backend->Watch(HPMRecordChanged, NULL);
+
+    *recorder = &sRecordBackend;
+    return kIOReturnSuccess;
+}
+
+IOReturn HPMRecordStop(void)
+{
+    pthread_mutex_lock(&sRecorder.lock);
+    FILE *file = sRecorder.file;
+    IOReturn ret = sRecorder.error;
+    sRecorder.file = NULL;
+    pthread_mutex_unlock(&sRecorder.lock);
+
+    if (!file)
+        return kIOReturnNotOpen;
+    if (fclose(file) != 0)
+        ret = kIOReturnIOError;
+
+    return ret;
+}
+
+//----------------------------------------------------------------------------
+// Replay
+
+typedef struct {
+    /// Copied out of the log, where payloads leave entries unaligned.
+    HPMRecordEntry entry;
+    uint8_t const *payload;
+} HPMReplayRecord;
+
+typedef struct {
+    uint32_t client;
+
+    /// Position of the next record to look at in the client's records.
+    size_t cursor;
+} HPMReplayContext;
+
+static struct {
+    pthread_mutex_t lock;
+    HPMReplayConfig config;
+
+    uint8_t *data;
+    size_t numRecords;
+    HPMReplayRecord *records;
+    uint8_t *claimed;
+
+    /// Indices into \p records grouped by client; client \p c's records are
+    /// byClient[clientStart[c]] up to byClient[clientStart[c + 1]].
+    size_t *byClient;
+    size_t *clientStart;
+
+    int hasUnlockKey;
+    uint8_t unlockKey[4];
+
+    /// Index of the record after the last Enumerate served.
+    size_t enumerateCursor;
+    /// Index of the first record whose notification hasn't been delivered.
+    size_t notifyCursor;
+
+    void (*changed)(void *refcon, int services);
+    void *refcon;
+} sReplay = { .lock = PTHREAD_MUTEX_INITIALIZER, .config = { .timeScale = 1 } };
+
+static void HPMReplayUnload(void)
+{
+    free(sReplay.data);
+    free(sReplay.records);
+    free(sReplay.claimed);
+    free(sReplay.byClient);
+    free(sReplay.clientStart);
+
+    sReplay.data = NULL;
+    sReplay.records = NULL;
+    sReplay.claimed = NULL;
+    sReplay.byClient = NULL;
+    sReplay.clientStart = NULL;
+    sReplay.numRecords = 0;
+    sReplay.hasUnlockKey = 0;
+    sReplay.enumerateCursor = 0;
+    sReplay.notifyCursor = 0;
+}
+
+/// Index the records of a log that has been read into memory.
+static IOReturn HPMReplayIndex(size_t size)
+{
+    if (size < sizeof(HPMRecordHeader))
+        return kIOReturnUnderrun;
+
+    HPMRecordHeader header;
+    memcpy(&header, sReplay.data, sizeof(header));
+    if (header.magic != kHPMRecordMagic || header.version != kHPMRecordVersion)
+        return kIOReturnBadArgument;
+
+    sReplay.hasUnlockKey = header.hasUnlockKey != 0;
+    memcpy(sReplay.unlockKey, header.unlockKey, sizeof(sReplay.unlockKey));
+
+    size_t count = 0;
+    uint32_t maxClient = 0;
+    for (size_t offset = sizeof(header); offset < size; ++count) {
+        HPMRecordEntry entry;
+        if (size - offset < sizeof(entry))
+            return kIOReturnUnderrun;
+        memcpy(&entry, sReplay.data + offset, sizeof(entry));
+        if (size - offset - sizeof(entry) < entry.payloadLength)
+            return kIOReturnUnderrun;
+
+        offset += sizeof(entry) + entry.payloadLength;
+        if (entry.client > maxClient)
+            maxClient = entry.client;
+    }
+
+    // Clients are numbered from one as they are opened, and each open is
+    // recorded, so no valid log has more clients than records. Checking keeps
+    // the per-client tables below from overflowing.
+    if (maxClient > count)
+        return kIOReturnBadArgument;
+
+    sReplay.records = calloc(count ? count : 1, sizeof(*sReplay.records));
+    sReplay.claimed = calloc(count ? count : 1, 1);
+    sReplay.byClient = calloc(count ? count : 1, sizeof(*sReplay.byClient));
+    sReplay.clientStart = calloc((size_t)maxClient + 2, sizeof(*sReplay.clientStart));
+    size_t *filled = calloc((size_t)maxClient + 1, sizeof(*filled));
+    if (!sReplay.records || !sReplay.claimed || !sReplay.byClient || !sReplay.clientStart || !filled) {
+        free(filled);
+        return kIOReturnNoMemory;
+    }
+
+    size_t offset = sizeof(header);
+    for (size_t i = 0; i < count; ++i) {
+        HPMReplayRecord *record = &sReplay.records[i];
+        memcpy(&record->entry, sReplay.data + offset, sizeof(record->entry));
+        record->payload = sReplay.data + offset + sizeof(record->entry);
+        offset += sizeof(record->entry) + record->entry.payloadLength;
+
+        sReplay.clientStart[record->entry.client + 1]++;
+    }
+
+    for (uint32_t client = 0; client <= maxClient; ++client)
+        sReplay.clientStart[client + 1] += sReplay.clientStart[client];
+
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t client = sReplay.records[i].entry.client;
+        sReplay.byClient[sReplay.clientStart[client] + filled[client]++] = i;
+    }
+    free(filled);
+
+    sReplay.numRecords = count;
+    return kIOReturnSuccess;
+}
+
+IOReturn HPMReplayLoad(char const *path, HPMReplayConfig const *config)
+{
+    if (!path)
+        return kIOReturnBadArgument;
+
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return kIOReturnNotFound;
+
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0)
+        size = ftell(file);
+    uint8_t *data = size > 0 && fseek(file, 0, SEEK_SET) == 0 ? malloc((size_t)size) : NULL;
+    int ok = data && fread(data, (size_t)size, 1, file) == 1;
+    fclose(file);
+    if (!ok) {
+        free(data);
+        return size == 0 ? kIOReturnUnderrun : kIOReturnIOError;
+    }
+
+    pthread_mutex_lock(&sReplay.lock);
+    HPMReplayUnload();
+    sReplay.data = data;
+    IOReturn ret = HPMReplayIndex((size_t)size);
+    if (ret != kIOReturnSuccess)
+        HPMReplayUnload();
+    if (config)
+        sReplay.config = *config;
+    pthread_mutex_unlock(&sReplay.lock);
+
+    HPMInvalidateServices(HPMGetReplayBackend());
+    return ret;
+}
+
+/// Note that replay has reached \p index, and count the notifications
+/// recorded before it that are now due; \p services is set if any of them
+/// were for services coming or going. Must hold the replay lock.
+static size_t HPMReplayAdvance(size_t index, int *services)
+{
+    size_t due = 0;
+    for (; sReplay.notifyCursor < index; ++sReplay.notifyCursor) {
+        HPMRecordEntry const *entry = &sReplay.records[sReplay.notifyCursor].entry;
+        if (entry->type == kHPMRecordTypeNotify) {
+            ++due;
+            *services |= entry->arg != 0;
+        }
+    }
+
+    return due;
+}
+
+/// Deliver due notifications and wait out the recorded duration of a call.
+/// Must not hold the replay lock.
+static void HPMReplayFinish(size_t due, int services, uint64_t duration)
+{
+    for (; due && sReplay.changed; --due)
+        sReplay.changed(sReplay.refcon, services);
+
+    uint64_t delayNs = (uint64_t)((double)duration * sReplay.config.timeScale);
+    if (delayNs) {
+        struct timespec nap = { .tv_sec = delayNs / 1000000000, .tv_nsec = delayNs % 1000000000 };
+        nanosleep(&nap, NULL);
+    }
+}
+
+static IOReturn HPMReplayEnumerate(HPMBackendService *services, size_t maxServices, size_t *numServices)
+{
+    pthread_mutex_lock(&sReplay.lock);
+
+    // Serve the next enumeration, or repeat the last one once there are no
+    // more ahead.
+    HPMReplayRecord const *record = NULL;
+    for (size_t i = sReplay.enumerateCursor; i < sReplay.numRecords && !record; ++i)
+        if (sReplay.records[i].entry.type == kHPMRecordTypeEnumerate)
+            record = &sReplay.records[i];
+    for (size_t i = sReplay.enumerateCursor; i > 0 && !record; --i)
+        if (sReplay.records[i - 1].entry.type == kHPMRecordTypeEnumerate)
+            record = &sReplay.records[i - 1];
+
+    IOReturn ret = kIOReturnSuccess;
+    size_t count = 0;
+    if (record) {
+        sReplay.enumerateCursor = record - sReplay.records + 1;
+        ret = record->entry.result;
+
+        count = record->entry.payloadLength / sizeof(HPMBackendService);
+        if (count > maxServices)
+            count = maxServices;
+        memcpy(services, record->payload, count * sizeof(HPMBackendService));
+
+        // Handles belong to the recording's backend; RIDs are all replay needs.
+        for (size_t i = 0; i < count; ++i)
+            services[i].handle = (uint64_t)services[i].info.rid;
+    }
+
+    pthread_mutex_unlock(&sReplay.lock);
+
+    if (ret == kIOReturnSuccess)
+        *numServices = count;
+    return ret;
+}
+
+static void HPMReplayRetainService(uint64_t handle)
+{
+    (void)handle;
+}
+
+static void HPMReplayReleaseService(uint64_t handle)
+{
+    (void)handle;
+}
+
+static IOReturn HPMReplayWatch(void (*changed)(void *refcon, int services), void *refcon)
+{
+    sReplay.changed = changed;
+    sReplay.refcon = refcon;
+    return kIOReturnSuccess;
+}
+
+static IOReturn HPMReplayOpen(HPMBackendService const *service, void **context)
+{
+    HPMReplayContext *replay = calloc(1, sizeof(*replay));
+    if (!replay)
+        return kIOReturnNoMemory;
+
+    pthread_mutex_lock(&sReplay.lock);
+
+    // Take the first recorded open of the RID not already taken; once they
+    // are used up, clients share the last one's calls.
+    HPMReplayRecord const *record = NULL;
+    size_t index = 0;
+    for (size_t i = 0; i < sReplay.numRecords; ++i) {
+        HPMRecordEntry const *entry = &sReplay.records[i].entry;
+        if (entry->type != kHPMRecordTypeOpen || (int32_t)entry->arg != service->info.rid)
+            continue;
+
+        record = &sReplay.records[i];
+        index = i;
+        if (!sReplay.claimed[i])
+            break;
+    }
+
+    IOReturn ret = kIOReturnNotFound;
+    size_t due = 0;
+    int services = 0;
+    uint64_t duration = 0;
+    if (record) {
+        sReplay.claimed[index] = 1;
+        ret = record->entry.result;
+        duration = record->entry.duration;
+        due = HPMReplayAdvance(index, &services);
+
+        replay->client = record->entry.client;
+        replay->cursor = 0;
+    }
+
+    pthread_mutex_unlock(&sReplay.lock);
+
+    HPMReplayFinish(due, services, duration);
+    if (ret != kIOReturnSuccess) {
+        free(replay);
+        return ret;
+    }
+
+    *context = replay;
+    return kIOReturnSuccess;
+}
+
+static void HPMReplayClose(void *context)
+{
+    free(context);
+}
+
+/// Check whether a record is for a call; \p data, if given, must also match
+/// the data that was sent. \p differs is set for records that only differ in
+/// the data.
+static int HPMReplayMatches(HPMReplayRecord const *record, HPMRecordType type, uint64_t chip, uint32_t arg,
+    void const *data, size_t length, int *differs)
+{
+    if (record->entry.type != type || record->entry.chip != chip || record->entry.arg != arg)
+        return 0;
+    if (data && (record->entry.length != length || record->entry.payloadLength != length
+            || memcmp(record->payload, data, length) != 0)) {
+        *differs = 1;
+        return 0;
+    }
+
+    return 1;
+}
+
+/// Find the record answering a call, as described in HPMReplayLoad, and
+/// move the client's cursor past it. Must hold the replay lock.
+static HPMReplayRecord const *HPMReplayMatch(HPMReplayContext *replay, HPMRecordType type, uint64_t chip, uint32_t arg,
+    void const *data, size_t length)
+{
+    size_t begin = sReplay.clientStart[replay->client];
+    size_t end = sReplay.clientStart[replay->client + 1];
+    int differs = 0;
+
+    for (size_t i = begin + replay->cursor; i < end; ++i) {
+        HPMReplayRecord const *record = &sReplay.records[sReplay.byClient[i]];
+        if (HPMReplayMatches(record, type, chip, arg, data, length, &differs)) {
+            replay->cursor = i - begin + 1;
+            return record;
+        }
+    }
+
+    for (size_t i = begin + replay->cursor; i > begin; --i) {
+        HPMReplayRecord const *record = &sReplay.records[sReplay.byClient[i - 1]];
+        if (HPMReplayMatches(record, type, chip, arg, data, length, &differs))
+            return record;
+    }
+
+    if (differs)
+        HPMDebug("Recorded calls of type %d, chip %llu, arg %#x sent different data.", type,
+            (unsigned long long)chip, arg);
+    return NULL;
+}
+
+/// Answer a call; \p data is what the call sends, if anything. Copies the
+/// recorded reply to \p buffer, if given.
+static IOReturn HPMReplayServe(void *context, HPMRecordType type, uint64_t chip, uint32_t arg,
+    void const *data, size_t dataLength, void *buffer, size_t length, uint64_t *readLength)
+{
+    HPMReplayContext *replay = context;
+
+    pthread_mutex_lock(&sReplay.lock);
+    HPMReplayRecord const *record = HPMReplayMatch(replay, type, chip, arg, data, dataLength);
+
+    IOReturn ret = kIOReturnUnsupported;
+    size_t due = 0;
+    int services = 0;
+    uint64_t duration = 0;
+    if (record) {
+        ret = record->entry.result;
+        duration = record->entry.duration;
+        due = HPMReplayAdvance((size_t)(record - sReplay.records), &services);
+
+        if (buffer && ret == kIOReturnSuccess) {
+            size_t copied = record->entry.payloadLength < length ? record->entry.payloadLength : length;
+            memcpy(buffer, record->payload, copied);
+            *readLength = copied;
+        }
+    } else {
+        HPMDebug("No recorded call matches type %d, chip %llu, arg %#x.", type, (unsigned long long)chip, arg);
+    }
+    pthread_mutex_unlock(&sReplay.lock);
+
+    HPMReplayFinish(due, services, duration);
+    return ret;
+}
+
+static IOReturn HPMReplayRead(void *context, uint64_t chip, uint8_t address,
+    void *buffer, size_t length, uint32_t flags, uint64_t *readLength)
+{
+    (void)flags;
+    return HPMReplayServe(context, kHPMRecordTypeRead, chip, address, NULL, 0, buffer, length, readLength);
+}
+
+static IOReturn HPMReplayWrite(void *context, uint64_t chip, uint8_t address,
+    void const *buffer, size_t length, uint32_t flags)
+{
+    (void)flags;
+    return HPMReplayServe(context, kHPMRecordTypeWrite, chip, address, buffer, length, NULL, 0, NULL);
+}
+
+static IOReturn HPMReplayCommand(void *context, uint64_t chip, uint32_t command, uint32_t flags)
+{
+    (void)flags;
+    return HPMReplayServe(context, kHPMRecordTypeCommand, chip, command, NULL, 0, NULL, 0, NULL);
+}
+
+static IOReturn HPMReplaySendVDM(void *context, uint64_t chip, int arg, void const *buffer, size_t length, uint32_t flags)
+{
+    (void)flags;
+    return HPMReplayServe(context, kHPMRecordTypeSendVDM, chip, (uint32_t)arg, buffer, length, NULL, 0, NULL);
+}
+
+static uint8_t const *HPMReplayGetUnlockKey(void)
+{
+    return sReplay.hasUnlockKey ? sReplay.unlockKey : NULL;
+}
+
+static HPMServiceCache sReplayCache = kHPMServiceCacheInitializer;
+
+static HPMBackend const sReplayBackend = {
+    .name = "replay",
+    .cache = &sReplayCache,
+    .Enumerate = HPMReplayEnumerate,
+    .RetainService = HPMReplayRetainService,
+    .ReleaseService = HPMReplayReleaseService,
+    .Watch = HPMReplayWatch,
+    .Open = HPMReplayOpen,
+    .Close = HPMReplayClose,
+    .Read = HPMReplayRead,
+    .Write = HPMReplayWrite,
+    .Command = HPMReplayCommand,
+    .SendVDM = HPMReplaySendVDM,
+    .GetUnlockKey = HPMReplayGetUnlockKey,
+};
+
+HPMBackend const *HPMGetReplayBackend(void)
+{
+    return &sReplayBackend;
+}
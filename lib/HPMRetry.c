@@ -0,0 +1,210 @@
+//
+//  HPMRetry.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "HPMRetry.h"
+
+#include "HPMDebug.h"
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct HPMRetryPolicy {
+    HPMRetryConfig config;
+
+    atomic_uint_fast64_t operations;
+    atomic_uint_fast64_t attempts;
+    atomic_uint_fast64_t recoveries;
+    atomic_uint_fast64_t failures;
+    atomic_uint_fast64_t backoffNs;
+};
+
+static HPMRetryPolicy sUnlockPolicy = {
+    .config = {
+        .maxAttempts = 2,
+        .retryOn = kHPMRetryClassAll,
+        .recovery = kHPMRetryRecoveryGAID,
+    },
+};
+
+HPMRetryClass HPMRetryClassify(IOReturn ret)
+{
+    switch (ret) {
+    case kIOReturnSuccess:
+        return 0;
+    case kIOReturnBusy:
+    case kIOReturnNotReady:
+        return kHPMRetryClassBusy;
+    case kIOReturnTimeout:
+    case kIOReturnNotResponding:
+        return kHPMRetryClassTimeout;
+    case kIOReturnIOError:
+    case kIOReturnError:
+    case kIOReturnAborted:
+        return kHPMRetryClassIOError;
+    default:
+        return kHPMRetryClassOther;
+    }
+}
+
+void HPMRetryConfigGetDefault(HPMRetryConfig *config)
+{
+    *config = (HPMRetryConfig) {
+        .maxAttempts = 3,
+        .initialBackoffUs = 1000,
+        .maxBackoffUs = 20000,
+        .multiplier = 2,
+        .retryOn = kHPMRetryClassTransient,
+        .recovery = kHPMRetryRecoveryNone,
+    };
+}
+
+IOReturn HPMRetryPolicyCreate(HPMRetryConfig const *config, HPMRetryPolicy **out)
+{
+    if (!config || !out)
+        return kIOReturnBadArgument;
+
+    HPMRetryPolicy *policy = calloc(1, sizeof(*policy));
+    if (!policy)
+        return kIOReturnNoMemory;
+
+    policy->config = *config;
+    *out = policy;
+    return kIOReturnSuccess;
+}
+
+void HPMRetryPolicyDestroy(HPMRetryPolicy *policy)
+{
+    if (policy != &sUnlockPolicy)
+        free(policy);
+}
+
+void HPMRetryPolicyGetConfig(HPMRetryPolicy const *policy, HPMRetryConfig *config)
+{
+    *config = policy->config;
+}
+
+void HPMRetryPolicyGetStats(HPMRetryPolicy const *policy, HPMRetryStats *stats)
+{
+    // Atomic loads don't take const pointers in C11.
+    HPMRetryPolicy *p = (HPMRetryPolicy *)policy;
+
+    stats->operations = atomic_load_explicit(&p->operations, memory_order_relaxed);
+    stats->attempts = atomic_load_explicit(&p->attempts, memory_order_relaxed);
+    stats->recoveries = atomic_load_explicit(&p->recoveries, memory_order_relaxed);
+    stats->failures = atomic_load_explicit(&p->failures, memory_order_relaxed);
+    stats->backoffNs = atomic_load_explicit(&p->backoffNs, memory_order_relaxed);
+}
+
+HPMRetryPolicy *HPMGetUnlockRetryPolicy(void)
+{
+    return &sUnlockPolicy;
+}
+
+/// Issue a recovery action, once; retrying it under the client's policy could
+/// recurse into recovering from the recovery.
+///
+/// `Gaid` drops the port back to app mode, so the state the client tracks is
+/// restored afterwards; otherwise a VDM retried right after it would fail, and
+/// the client would go on believing the port was in DBMa mode. Restoring works
+/// on a copy of the client, retrying like \p policy but without recovery.
+static IOReturn HPMRetryRecover(HPMRetryPolicy const *policy, HPMClient const *hpm)
+{
+    switch (policy->config.recovery) {
+    case kHPMRetryRecoveryGAID: {
+        HPMClient plain = *hpm;
+        plain.retryPolicy = NULL;
+
+        // If this fails, the mode may or may not have changed; restoring it
+        // below copes with either.
+        IOReturn ret = HPMDoCommand(&plain, 0, kHPMCommandGAID, NULL, 0, NULL);
+        if (ret != kIOReturnSuccess)
+            HPMDebug("Gaid failed. (%#x)", ret);
+
+        HPMRetryPolicy restorePolicy = { .config = policy->config };
+        restorePolicy.config.recovery = kHPMRetryRecoveryNone;
+        plain.retryPolicy = &restorePolicy;
+
+        switch (hpm->state) {
+        case kHPMStateUnlocked:
+            plain.state = kHPMStateApp;
+            ret = HPMUnlockACE(&plain);
+            break;
+        case kHPMStateDBMA:
+            HPMInvalidateState(&plain);
+            ret = HPMEnterDBMA(&plain);
+            break;
+        default:
+            return kIOReturnSuccess;
+        }
+
+        // The client's state no longer matches the port. Clients are never
+        // const objects; the qualifier only says operations leave them alone,
+        // which stopped being true when the port was reset behind its back.
+        if (ret != kIOReturnSuccess)
+            HPMInvalidateState((HPMClient *)hpm);
+
+        return ret;
+    }
+    default:
+        return kIOReturnSuccess;
+    }
+}
+
+IOReturn HPMRetryRun(HPMRetryPolicy *policy, HPMClient const *hpm, HPMRetryOperation operation, void *refcon)
+{
+    HPMRetryConfig const *config = &policy->config;
+    uint32_t maxAttempts = config->maxAttempts ? config->maxAttempts : 1;
+    uint64_t backoffNs = (uint64_t)config->initialBackoffUs * 1000;
+
+    atomic_fetch_add_explicit(&policy->operations, 1, memory_order_relaxed);
+
+    IOReturn ret = kIOReturnSuccess;
+    for (uint32_t attempt = 1;; ++attempt) {
+        atomic_fetch_add_explicit(&policy->attempts, 1, memory_order_relaxed);
+        ret = operation(hpm, refcon);
+        if (ret == kIOReturnSuccess)
+            return ret;
+
+        if (attempt >= maxAttempts || !(HPMRetryClassify(ret) & config->retryOn))
+            break;
+
+        HPMDebug("Attempt %u failed, retrying. (%#x)", attempt, ret);
+
+        if (backoffNs) {
+            struct timespec nap = { .tv_sec = backoffNs / 1000000000, .tv_nsec = backoffNs % 1000000000 };
+            nanosleep(&nap, NULL);
+            atomic_fetch_add_explicit(&policy->backoffNs, backoffNs, memory_order_relaxed);
+
+            backoffNs *= config->multiplier ? config->multiplier : 1;
+            if (backoffNs > (uint64_t)config->maxBackoffUs * 1000)
+                backoffNs = (uint64_t)config->maxBackoffUs * 1000;
+        }
+
+        // If recovery fails, the port isn't in the state the client expects,
+        // so another attempt would only fail for a different reason.
+        if (config->recovery != kHPMRetryRecoveryNone) {
+            atomic_fetch_add_explicit(&policy->recoveries, 1, memory_order_relaxed);
+
+            IOReturn recoverRet = HPMRetryRecover(policy, hpm);
+            if (recoverRet != kIOReturnSuccess) {
+                HPMDebug("Recovery failed. (%#x)", recoverRet);
+                break;
+            }
+        }
+    }
+
+    atomic_fetch_add_explicit(&policy->failures, 1, memory_order_relaxed);
+    return ret;
+}
+
+void HPMClientSetRetryPolicy(HPMClient *hpm, HPMRetryPolicy *policy)
+{
+    hpm->retryPolicy = policy;
+}
@@ -0,0 +1,214 @@
+//
+//  HPMServices.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "HPMBackend.h"
+#include "HPMDebug.h"
+
+#include <string.h>
+#include <time.h>
+
+static void HPMServiceCacheChanged(void *refcon, int services)
+{
+    HPMServiceCache *cache = refcon;
+
+    pthread_mutex_lock(&cache->lock);
+    if (services)
+        cache->valid = 0;
+    cache->generation++;
+    pthread_cond_broadcast(&cache->changed);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/// Start receiving notifications if not already. Must hold the cache lock.
+static void HPMServiceCacheWatch(HPMBackend const *backend)
+{
+    HPMServiceCache *cache = backend->cache;
+    if (!cache->watching)
+        cache->watching = backend->Watch(HPMServiceCacheChanged, cache) == kIOReturnSuccess;
+}
+
+/// Make sure the cache reflects the registry. Must hold the cache lock.
+static IOReturn HPMServiceCacheRefresh(HPMBackend const *backend)
+{
+    HPMServiceCache *cache = backend->cache;
+
+    // Without notifications there is no way to tell when the table goes out
+    // of date, so every lookup has to walk the registry again.
+    HPMServiceCacheWatch(backend);
+    if (cache->valid && cache->watching)
+        return kIOReturnSuccess;
+
+    HPMDebug("Rebuilding %s service table.", backend->name);
+
+    for (size_t i = 0; i < cache->numServices; ++i)
+        backend->ReleaseService(cache->services[i].handle);
+    cache->numServices = 0;
+    cache->valid = 0;
+    memset(cache->slotForRID, -1, sizeof(cache->slotForRID));
+
+    size_t count = 0;
+    IO_TRY(backend->Enumerate(cache->services, kHPMMaxRIDs, &count));
+
+    for (size_t i = 0; i < count; ++i) {
+        int32_t rid = cache->services[i].info.rid;
+        if (rid >= 0 && rid < kHPMMaxRIDs && cache->slotForRID[rid] < 0)
+            cache->slotForRID[rid] = (int8_t)i;
+    }
+
+    cache->numServices = count;
+    cache->valid = 1;
+    return kIOReturnSuccess;
+}
+
+IOReturn HPMServiceCacheLookup(HPMBackend const *backend, int32_t rid, HPMBackendService *service)
+{
+    HPMServiceCache *cache = backend->cache;
+
+    pthread_mutex_lock(&cache->lock);
+    IOReturn ret = HPMServiceCacheRefresh(backend);
+    if (ret == kIOReturnSuccess) {
+        ret = kIOReturnNotFound;
+        if (rid >= 0 && rid < kHPMMaxRIDs) {
+            if (cache->slotForRID[rid] >= 0) {
+                *service = cache->services[cache->slotForRID[rid]];
+                backend->RetainService(service->handle);
+                ret = kIOReturnSuccess;
+            }
+        } else {
+            for (size_t i = 0; i < cache->numServices; ++i) {
+                if (cache->services[i].info.rid == rid) {
+                    *service = cache->services[i];
+                    backend->RetainService(service->handle);
+                    ret = kIOReturnSuccess;
+                    break;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return ret;
+}
+
+void HPMServiceCacheNotify(HPMBackend const *backend, int services)
+{
+    HPMServiceCacheChanged(backend->cache, services);
+}
+
+uint64_t HPMServiceCacheGetGeneration(HPMBackend const *backend)
+{
+    HPMServiceCache *cache = backend->cache;
+
+    pthread_mutex_lock(&cache->lock);
+    HPMServiceCacheWatch(backend);
+    uint64_t generation = cache->generation;
+    pthread_mutex_unlock(&cache->lock);
+
+    return generation;
+}
+
+IOReturn HPMServiceCacheWait(HPMBackend const *backend, uint64_t *generation, uint64_t timeoutNs)
+{
+    HPMServiceCache *cache = backend->cache;
+
+    // Condition variables time out against the wall clock.
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t)(timeoutNs / 1000000000);
+    deadline.tv_nsec += (long)(timeoutNs % 1000000000);
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    IOReturn ret = kIOReturnSuccess;
+    pthread_mutex_lock(&cache->lock);
+    HPMServiceCacheWatch(backend);
+    while (cache->generation == *generation && ret == kIOReturnSuccess)
+        if (pthread_cond_timedwait(&cache->changed, &cache->lock, &deadline) != 0)
+            ret = kIOReturnTimeout;
+
+    if (cache->generation != *generation) {
+        *generation = cache->generation;
+        ret = kIOReturnSuccess;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return ret;
+}
+
+IOReturn HPMGetServices(HPMBackend const *backend, HPMServiceInfo *services,
+    size_t maxServices, size_t *numServices)
+{
+    if (!backend || !services || !numServices)
+        return kIOReturnBadArgument;
+
+    HPMServiceCache *cache = backend->cache;
+
+    pthread_mutex_lock(&cache->lock);
+    IOReturn ret = HPMServiceCacheRefresh(backend);
+    if (ret == kIOReturnSuccess) {
+        size_t count = 0;
+        for (; count < cache->numServices && count < maxServices; ++count)
+            services[count] = cache->services[count].info;
+
+        *numServices = count;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return ret;
+}
+
+IOReturn HPMLookupService(HPMBackend const *backend, int32_t rid, HPMServiceInfo *info)
+{
+    if (!backend || !info)
+        return kIOReturnBadArgument;
+
+    HPMBackendService service;
+    IO_TRY(HPMServiceCacheLookup(backend, rid, &service));
+    backend->ReleaseService(service.handle);
+
+    *info = service.info;
+    return kIOReturnSuccess;
+}
+
+void HPMInvalidateServices(HPMBackend const *backend)
+{
+    HPMServiceCacheChanged(backend->cache, 1);
+}
+
+uint64_t HPMGetChangeGeneration(HPMBackend const *backend)
+{
+    return HPMServiceCacheGetGeneration(backend);
+}
+
+IOReturn HPMWaitForChange(HPMBackend const *backend, uint64_t *generation, uint32_t timeoutMs)
+{
+    if (!backend || !generation)
+        return kIOReturnBadArgument;
+
+    return HPMServiceCacheWait(backend, generation, (uint64_t)timeoutMs * 1000000);
+}
+
+IOReturn HPMEnumerateRIDs(HPMBackend const *backend, int32_t *rids, size_t maxRIDs, size_t *numRIDs)
+{
+    if (!rids || !numRIDs)
+        return kIOReturnBadArgument;
+
+    HPMServiceInfo services[kHPMMaxRIDs];
+    size_t count = 0;
+    IO_TRY(HPMGetServices(backend, services, kHPMMaxRIDs, &count));
+
+    size_t stored = 0;
+    for (; stored < count && stored < maxRIDs; ++stored)
+        rids[stored] = services[stored].rid;
+
+    *numRIDs = stored;
+    return kIOReturnSuccess;
+}
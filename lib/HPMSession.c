@@ -0,0 +1,227 @@
+//
+//  HPMSession.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "HPMSession.h"
+
+#include "HPMDebug.h"
+
+#include <stdlib.h>
+
+/// How long the status snapshot from a connection check stays good for.
+#define kHPMSessionStatusMaxAgeMs 250
+
+struct HPMSession {
+    HPMSessionConfig config;
+    HPMClient hpm;
+
+    /// Whether \p hpm is open, and whether it needs reopening before it can
+    /// be used again. A stale client may still be open, e.g. after a failed
+    /// status read, or closed, if reopening it failed.
+    int open;
+    int stale;
+    HPMSessionStep failedStep;
+};
+
+char const *HPMSessionStepGetDescription(HPMSessionStep step)
+{
+    switch (step) {
+    case kHPMSessionStepNone:
+        return "Success";
+    case kHPMSessionStepOpen:
+        return "Failed to open HPM client";
+    case kHPMSessionStepConnection:
+        return "Failed to get port status";
+    case kHPMSessionStepUnlock:
+        return "Failed to unlock ACE";
+    case kHPMSessionStepEnterDBMA:
+        return "Failed to switch to DBMa mode";
+    case kHPMSessionStepSendVDM:
+        return "Failed to send VDM";
+    case kHPMSessionStepExitDBMA:
+        return "Failed to switch to app mode";
+    case kHPMSessionStepReattach:
+        return "Device did not re-attach";
+    default:
+        return "Unknown error";
+    }
+}
+
+static IOReturn HPMSessionOpenClient(HPMSession *session)
+{
+    IO_TRY(HPMClientOpenWithBackend(&session->hpm, session->config.backend, session->config.rid));
+
+    HPMClientSetOptions(&session->hpm, session->config.options);
+    HPMClientSetStatusMaxAge(&session->hpm, kHPMSessionStatusMaxAgeMs);
+    if (session->config.modeTimeoutMs)
+        HPMClientSetModeTimeout(&session->hpm, session->config.modeTimeoutMs);
+    HPMClientSetRetryPolicy(&session->hpm, session->config.retryPolicy);
+
+    session->open = 1;
+    session->stale = 0;
+    return kIOReturnSuccess;
+}
+
+/// Record the outcome of a step; returns \p ret.
+static IOReturn HPMSessionFail(HPMSession *session, HPMSessionStep step, IOReturn ret)
+{
+    session->failedStep = ret == kIOReturnSuccess ? kHPMSessionStepNone : step;
+    return ret;
+}
+
+/// Start an operation, reopening the client first if it went stale.
+static IOReturn HPMSessionBegin(HPMSession *session)
+{
+    session->failedStep = kHPMSessionStepNone;
+    if (!session->stale)
+        return kIOReturnSuccess;
+
+    HPMDebug("Reopening client for RID %d.", session->config.rid);
+    if (session->open) {
+        HPMClientClose(&session->hpm);
+        session->open = 0;
+    }
+
+    return HPMSessionFail(session, kHPMSessionStepOpen, HPMSessionOpenClient(session));
+}
+
+IOReturn HPMSessionCreate(HPMSessionConfig const *config, HPMSession **out)
+{
+    if (!config || !out)
+        return kIOReturnBadArgument;
+
+    HPMSession *session = calloc(1, sizeof(*session));
+    if (!session)
+        return kIOReturnNoMemory;
+
+    session->config = *config;
+    if (!session->config.backend)
+        session->config.backend = HPMGetDefaultBackend();
+
+    IOReturn ret = HPMSessionOpenClient(session);
+    if (ret != kIOReturnSuccess) {
+        free(session);
+        return ret;
+    }
+
+    *out = session;
+    return kIOReturnSuccess;
+}
+
+void HPMSessionDestroy(HPMSession *session)
+{
+    if (session->open)
+        HPMClientClose(&session->hpm);
+    free(session);
+}
+
+HPMClient *HPMSessionGetClient(HPMSession *session)
+{
+    return &session->hpm;
+}
+
+void HPMSessionSetOptions(HPMSession *session, uint32_t options)
+{
+    session->config.options = options;
+    HPMClientSetOptions(&session->hpm, options);
+}
+
+HPMSessionStep HPMSessionGetFailedStep(HPMSession const *session)
+{
+    return session->failedStep;
+}
+
+IOReturn HPMSessionCheckConnection(HPMSession *session)
+{
+    IO_TRY(HPMSessionBegin(session));
+
+    HPMStatus status;
+    IOReturn ret = HPMGetStatus(&session->hpm, 0, &status);
+    if (ret != kIOReturnSuccess) {
+        // Most likely the service went away; start over with a fresh client.
+        session->stale = 1;
+        return HPMSessionFail(session, kHPMSessionStepConnection, ret);
+    }
+
+    if (status.connection == kHPMConnectionTypeNone)
+        return HPMSessionFail(session, kHPMSessionStepConnection, kIOReturnNoDevice);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn HPMSessionEnterDBMA(HPMSession *session)
+{
+    IO_TRY(HPMSessionBegin(session));
+
+    IOReturn ret = HPMEnterDBMA(&session->hpm);
+    if (ret == kIOReturnSuccess)
+        return ret;
+
+    HPMSessionStep step = HPMGetState(&session->hpm) == kHPMStateApp
+        ? kHPMSessionStepUnlock
+        : kHPMSessionStepEnterDBMA;
+    return HPMSessionFail(session, step, ret);
+}
+
+IOReturn HPMSessionExitDBMA(HPMSession *session)
+{
+    IO_TRY(HPMSessionBegin(session));
+
+    return HPMSessionFail(session, kHPMSessionStepExitDBMA, HPMExitDBMA(&session->hpm));
+}
+
+/// Arguments of the VDM to send, one way or the other.
+typedef struct {
+    void const *body;
+    size_t bodyLength;
+    int known;
+    HPMKnownVDM knownVDM;
+} HPMSessionVDM;
+
+static IOReturn HPMSessionSend(HPMSession *session, HPMSessionVDM const *vdm)
+{
+    // Once in DBMa mode, a missing device shows up as a failed send anyway.
+    if (HPMGetState(&session->hpm) != kHPMStateDBMA || session->stale)
+        IO_TRY(HPMSessionCheckConnection(session));
+    IO_TRY(HPMSessionEnterDBMA(session));
+
+    IOReturn ret = vdm->known
+        ? HPMSendKnownVDM(&session->hpm, 0, vdm->knownVDM)
+        : HPMSendVDM(&session->hpm, 0, vdm->body, vdm->bodyLength);
+    if (ret != kIOReturnSuccess) {
+        // The port may have been reset underneath us, so its state can't be
+        // trusted any more; still try to leave it in app mode.
+        HPMInvalidateState(&session->hpm);
+        HPMExitDBMA(&session->hpm);
+        return HPMSessionFail(session, kHPMSessionStepSendVDM, ret);
+    }
+
+    return HPMSessionExitDBMA(session);
+}
+
+IOReturn HPMSessionSendVDM(HPMSession *session, void const *body, size_t bodyLength)
+{
+    if (!body || !bodyLength)
+        return HPMSessionFail(session, kHPMSessionStepSendVDM, kIOReturnBadArgument);
+
+    HPMSessionVDM vdm = { .body = body, .bodyLength = bodyLength };
+    return HPMSessionSend(session, &vdm);
+}
+
+IOReturn HPMSessionSendKnownVDM(HPMSession *session, HPMKnownVDM knownVDM)
+{
+    HPMSessionVDM vdm = { .known = 1, .knownVDM = knownVDM };
+    return HPMSessionSend(session, &vdm);
+}
+
+IOReturn HPMSessionWaitForReattach(HPMSession *session, uint32_t timeoutMs)
+{
+    IO_TRY(HPMSessionBegin(session));
+
+    return HPMSessionFail(session, kHPMSessionStepReattach, HPMWaitForReattach(&session->hpm, timeoutMs));
+}
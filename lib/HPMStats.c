@@ -0,0 +1,372 @@
+//
+//  HPMStats.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "HPMStats.h"
+
+#include "HPMFile.h"
+#include "HPMInstrument.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define kHPMStatsFileVersion 1
+
+/// Bits of a value below its leading one that pick its bucket.
+#define kHPMHistogramSubBits 3
+
+_Static_assert(1 << kHPMHistogramSubBits == kHPMHistogramSubBuckets, "histogram layout");
+
+/// HPMHistogram, but safe to update from several threads at once.
+typedef struct {
+    atomic_uint_least64_t count;
+    atomic_uint_least64_t errors;
+    atomic_uint_least64_t sum;
+    atomic_uint_least64_t min;
+    atomic_uint_least64_t max;
+    atomic_uint_least64_t buckets[kHPMHistogramBuckets];
+} HPMLiveHistogram;
+
+static HPMLiveHistogram sLive[kHPMStatsOpCount][kHPMMaxRIDs];
+
+static unsigned HPMHistogramGetBucket(uint64_t value)
+{
+    if (value < kHPMHistogramSubBuckets)
+        return (unsigned)value;
+
+    unsigned shift = 63 - (unsigned)__builtin_clzll(value) - kHPMHistogramSubBits;
+    unsigned bucket = (shift + 1) * kHPMHistogramSubBuckets
+        + (unsigned)((value >> shift) & (kHPMHistogramSubBuckets - 1));
+    return bucket < kHPMHistogramBuckets ? bucket : kHPMHistogramBuckets - 1;
+}
+
+/// Get the midpoint of the values falling in a bucket.
+static uint64_t HPMHistogramGetBucketValue(unsigned bucket)
+{
+    if (bucket < kHPMHistogramSubBuckets)
+        return bucket;
+
+    unsigned shift = bucket / kHPMHistogramSubBuckets - 1;
+    uint64_t low = (uint64_t)(kHPMHistogramSubBuckets + bucket % kHPMHistogramSubBuckets) << shift;
+    return low + ((1ull << shift) >> 1);
+}
+
+void HPMHistogramRecord(HPMHistogram *histogram, uint64_t durationNs, IOReturn result)
+{
+    if (!histogram->count || durationNs < histogram->min)
+        histogram->min = durationNs;
+    if (durationNs > histogram->max)
+        histogram->max = durationNs;
+
+    histogram->count++;
+    histogram->errors += result != kIOReturnSuccess;
+    histogram->sum += durationNs;
+    histogram->buckets[HPMHistogramGetBucket(durationNs)]++;
+}
+
+void HPMHistogramMerge(HPMHistogram *into, HPMHistogram const *from)
+{
+    if (!from->count)
+        return;
+
+    if (!into->count || from->min < into->min)
+        into->min = from->min;
+    if (from->max > into->max)
+        into->max = from->max;
+
+    into->count += from->count;
+    into->errors += from->errors;
+    into->sum += from->sum;
+    for (unsigned i = 0; i < kHPMHistogramBuckets; ++i)
+        into->buckets[i] += from->buckets[i];
+}
+
+uint64_t HPMHistogramGetPercentile(HPMHistogram const *histogram, double percentile)
+{
+    if (!histogram->count)
+        return 0;
+
+    uint64_t rank = (uint64_t)(percentile / 100 * (double)(histogram->count - 1));
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < kHPMHistogramBuckets; ++i) {
+        seen += histogram->buckets[i];
+        if (seen > rank) {
+            // The ends are known exactly; don't let bucket rounding pass them.
+            uint64_t value = HPMHistogramGetBucketValue(i);
+            return value < histogram->min ? histogram->min : value > histogram->max ? histogram->max : value;
+        }
+    }
+
+    return histogram->max;
+}
+
+void HPMStatsRecord(HPMStatsOp op, int32_t rid, uint64_t start, IOReturn result)
+{
+    uint64_t duration = HPMNow() - start;
+    if (rid < 0 || rid >= kHPMMaxRIDs)
+        return;
+
+    HPMLiveHistogram *h = &sLive[op][rid];
+    atomic_fetch_add_explicit(&h->buckets[HPMHistogramGetBucket(duration)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, duration, memory_order_relaxed);
+    if (result != kIOReturnSuccess)
+        atomic_fetch_add_explicit(&h->errors, 1, memory_order_relaxed);
+
+    // Zero means no minimum yet; a zero duration isn't worth distinguishing.
+    uint64_t min = atomic_load_explicit(&h->min, memory_order_relaxed);
+    while ((!min || duration < min)
+        && !atomic_compare_exchange_weak_explicit(&h->min, &min, duration, memory_order_relaxed, memory_order_relaxed))
+        ;
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (duration > max
+        && !atomic_compare_exchange_weak_explicit(&h->max, &max, duration, memory_order_relaxed, memory_order_relaxed))
+        ;
+
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_release);
+}
+
+void HPMStatsCollect(HPMStats *stats)
+{
+    for (int op = 0; op < kHPMStatsOpCount; ++op) {
+        for (int rid = 0; rid < kHPMMaxRIDs; ++rid) {
+            HPMLiveHistogram *live = &sLive[op][rid];
+            HPMHistogram snapshot;
+            snapshot.count = atomic_load_explicit(&live->count, memory_order_acquire);
+            if (!snapshot.count)
+                continue;
+
+            // Operations finishing during the copy may be partly counted;
+            // that is good enough for statistics.
+            snapshot.errors = atomic_load_explicit(&live->errors, memory_order_relaxed);
+            snapshot.sum = atomic_load_explicit(&live->sum, memory_order_relaxed);
+            snapshot.min = atomic_load_explicit(&live->min, memory_order_relaxed);
+            snapshot.max = atomic_load_explicit(&live->max, memory_order_relaxed);
+            for (unsigned i = 0; i < kHPMHistogramBuckets; ++i)
+                snapshot.buckets[i] = atomic_load_explicit(&live->buckets[i], memory_order_relaxed);
+
+            HPMHistogramMerge(&stats->histograms[op][rid], &snapshot);
+        }
+    }
+}
+
+void HPMStatsReset(void)
+{
+    for (int op = 0; op < kHPMStatsOpCount; ++op) {
+        for (int rid = 0; rid < kHPMMaxRIDs; ++rid) {
+            HPMLiveHistogram *live = &sLive[op][rid];
+            atomic_store_explicit(&live->count, 0, memory_order_relaxed);
+            atomic_store_explicit(&live->errors, 0, memory_order_relaxed);
+            atomic_store_explicit(&live->sum, 0, memory_order_relaxed);
+            atomic_store_explicit(&live->min, 0, memory_order_relaxed);
+            atomic_store_explicit(&live->max, 0, memory_order_relaxed);
+            for (unsigned i = 0; i < kHPMHistogramBuckets; ++i)
+                atomic_store_explicit(&live->buckets[i], 0, memory_order_relaxed);
+        }
+    }
+}
+
+// The text format is one header line, then one line per histogram, with its
+// buckets as sparse index:count pairs:
+//
+//     hpmstats 1 8 256
+//     send-vdm 0 12 0 5123000 301000 611000 120:3 121:7 123:2
+//
+// i.e. op, RID, count, errors, sum, min and max. It is the same on every host,
+// so files can be gathered from several and merged.
+
+IOReturn HPMStatsWrite(HPMStats const *stats, FILE *file)
+{
+    fprintf(file, "hpmstats %d %d %d\n", kHPMStatsFileVersion, kHPMHistogramSubBuckets, kHPMHistogramBuckets);
+
+    for (int op = 0; op < kHPMStatsOpCount; ++op) {
+        for (int rid = 0; rid < kHPMMaxRIDs; ++rid) {
+            HPMHistogram const *h = &stats->histograms[op][rid];
+            if (!h->count)
+                continue;
+
+            fprintf(file, "%s %d %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64, HPMStatsOpGetName(op),
+                rid, h->count, h->errors, h->sum, h->min, h->max);
+            for (unsigned i = 0; i < kHPMHistogramBuckets; ++i)
+                if (h->buckets[i])
+                    fprintf(file, " %u:%" PRIu64, i, h->buckets[i]);
+            fputc('\n', file);
+        }
+    }
+
+    return ferror(file) ? kIOReturnIOError : kIOReturnSuccess;
+}
+
+static int HPMStatsParseOp(char const *name)
+{
+    for (int op = 0; op < kHPMStatsOpCount; ++op)
+        if (strcmp(HPMStatsOpGetName(op), name) == 0)
+            return op;
+
+    return -1;
+}
+
+/// Parse a histogram line; returns its op, or -1 if it is malformed.
+static int HPMStatsParseLine(char *line, int *rid, HPMHistogram *h)
+{
+    char name[32];
+    int consumed = 0;
+    if (sscanf(line, "%31s %d %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 "%n", name, rid, &h->count,
+            &h->errors, &h->sum, &h->min, &h->max, &consumed)
+        != 7)
+        return -1;
+
+    int op = HPMStatsParseOp(name);
+    if (op < 0 || *rid < 0 || *rid >= kHPMMaxRIDs)
+        return -1;
+
+    memset(h->buckets, 0, sizeof(h->buckets));
+    for (char *p = line + consumed; *p && *p != '\n';) {
+        unsigned bucket = 0;
+        uint64_t n = 0;
+        int len = 0;
+        if (sscanf(p, " %u:%" SCNu64 "%n", &bucket, &n, &len) != 2 || bucket >= kHPMHistogramBuckets)
+            return -1;
+
+        h->buckets[bucket] += n;
+        p += len;
+    }
+
+    return op;
+}
+
+IOReturn HPMStatsRead(HPMStats *stats, FILE *file)
+{
+    int version = 0, subBuckets = 0, buckets = 0;
+    if (fscanf(file, "hpmstats %d %d %d\n", &version, &subBuckets, &buckets) != 3 || version != kHPMStatsFileVersion
+        || subBuckets != kHPMHistogramSubBuckets || buckets != kHPMHistogramBuckets)
+        return kIOReturnBadArgument;
+
+    char *line = NULL;
+    size_t capacity = 0;
+    IOReturn ret = kIOReturnSuccess;
+    while (getline(&line, &capacity, file) > 0) {
+        int rid = 0;
+        HPMHistogram h;
+        int op = HPMStatsParseLine(line, &rid, &h);
+        if (op < 0) {
+            ret = kIOReturnBadArgument;
+            break;
+        }
+
+        HPMHistogramMerge(&stats->histograms[op][rid], &h);
+    }
+
+    free(line);
+    return ret;
+}
+
+/// Check whether any operations have been counted.
+static int HPMStatsAnyCounted(void)
+{
+    for (int op = 0; op < kHPMStatsOpCount; ++op)
+        for (int rid = 0; rid < kHPMMaxRIDs; ++rid)
+            if (atomic_load_explicit(&sLive[op][rid].count, memory_order_relaxed))
+                return 1;
+
+    return 0;
+}
+
+IOReturn HPMStatsSave(char const *path)
+{
+    if (!HPMStatsAnyCounted())
+        return kIOReturnSuccess;
+
+    HPMStats *stats = calloc(1, sizeof(*stats));
+    if (!stats)
+        return kIOReturnNoMemory;
+
+    char temp[1024];
+    if (snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid()) >= (int)sizeof(temp)) {
+        free(stats);
+        return kIOReturnBadArgument;
+    }
+
+    // Savers take turns by locking the current file. It may have been
+    // replaced while we waited for the lock, in which case try again on the
+    // new one.
+    FILE *file = NULL;
+    for (;;) {
+        int fd = HPMOpenStateFile(path, O_RDWR | O_CREAT);
+        file = fd >= 0 ? fdopen(fd, "r") : NULL;
+        if (!file) {
+            if (fd >= 0)
+                close(fd);
+            free(stats);
+            return kIOReturnNotPermitted;
+        }
+
+        flock(fd, LOCK_EX);
+        struct stat locked, current;
+        if (fstat(fd, &locked) == 0 && stat(path, &current) == 0 && locked.st_dev == current.st_dev
+            && locked.st_ino == current.st_ino)
+            break;
+
+        fclose(file);
+    }
+
+    // Start over if the file is empty or unreadable, e.g. written by an
+    // incompatible version.
+    if (HPMStatsRead(stats, file) != kIOReturnSuccess)
+        memset(stats, 0, sizeof(*stats));
+    HPMStatsCollect(stats);
+
+    // Write a new file and rename it over, so readers never see a partial
+    // one. A leftover from a previous process with our PID is removed first;
+    // that only ever removes a link, never what it points to.
+    unlink(temp);
+    int out_fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    FILE *out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    IOReturn ret = out ? HPMStatsWrite(stats, out) : kIOReturnNotPermitted;
+    if (out) {
+        if (fflush(out) != 0 || fsync(out_fd) != 0)
+            ret = kIOReturnIOError;
+        if (fclose(out) != 0 && ret == kIOReturnSuccess)
+            ret = kIOReturnIOError;
+        if (ret == kIOReturnSuccess && rename(temp, path) != 0)
+            ret = kIOReturnIOError;
+        if (ret != kIOReturnSuccess)
+            unlink(temp);
+    } else if (out_fd >= 0) {
+        close(out_fd);
+        unlink(temp);
+    }
+
+    // Closing the old file drops the lock.
+    fclose(file);
+    free(stats);
+    return ret;
+}
+
+char const *HPMStatsOpGetName(HPMStatsOp op)
+{
+    switch (op) {
+    case kHPMStatsOpOpen:
+        return "open";
+    case kHPMStatsOpUnlock:
+        return "unlock";
+    case kHPMStatsOpEnterDBMA:
+        return "enter-dbma";
+    case kHPMStatsOpExitDBMA:
+        return "exit-dbma";
+    case kHPMStatsOpSendVDM:
+        return "send-vdm";
+    default:
+        return "unknown";
+    }
+}
@@ -0,0 +1,294 @@
+//
+//  HPMStatusTable.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "HPMStatusTable.h"
+
+#include "HPMDebug.h"
+#include "HPMInstrument.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define kHPMStatusTableMagic 0x54535048 // 'HPST'
+#define kHPMStatusTableVersion 1
+
+/// Attempts HPMStatusTableRead makes at getting a consistent copy.
+#define kHPMStatusTableReadAttempts 1024
+
+typedef struct {
+    /// Odd while the entry is being written.
+    atomic_uint seq;
+    HPMPortStatus status;
+} HPMStatusSlot;
+
+typedef struct {
+    atomic_uint magic;
+    uint32_t version;
+    uint32_t numSlots;
+    atomic_int publisher;
+    HPMStatusSlot slots[kHPMMaxRIDs];
+} HPMStatusLayout;
+
+struct HPMStatusTable {
+    HPMStatusLayout *layout;
+    char name[64];
+    int writable;
+
+    /// Publisher side only: the last published entries, so that updates only
+    /// need to change some fields, and the lock serializing them.
+    pthread_mutex_t lock;
+    HPMPortStatus published[kHPMMaxRIDs];
+};
+
+static IOReturn HPMStatusTableMap(char const *name, int writable, HPMStatusTable **out)
+{
+    if (!name)
+        name = kHPMStatusTableDefaultName;
+    if (!out || strlen(name) >= sizeof(((HPMStatusTable *)0)->name))
+        return kIOReturnBadArgument;
+
+    int fd = shm_open(name, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (fd < 0)
+        return writable ? kIOReturnNotPermitted : kIOReturnNotFound;
+
+    // Shared memory objects can only be sized once on some systems, so an
+    // object that is already big enough is left alone.
+    struct stat st;
+    int ok = fstat(fd, &st) == 0;
+    if (ok && (size_t)st.st_size < sizeof(HPMStatusLayout))
+        ok = writable && ftruncate(fd, sizeof(HPMStatusLayout)) == 0;
+
+    HPMStatusLayout *layout = ok
+        ? mmap(NULL, sizeof(HPMStatusLayout), writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0)
+        : MAP_FAILED;
+    close(fd);
+    if (layout == MAP_FAILED)
+        return writable ? kIOReturnNoResources : kIOReturnNotReady;
+
+    HPMStatusTable *table = calloc(1, sizeof(*table));
+    if (!table) {
+        munmap(layout, sizeof(*layout));
+        return kIOReturnNoMemory;
+    }
+
+    table->layout = layout;
+    strcpy(table->name, name);
+    table->writable = writable;
+    pthread_mutex_init(&table->lock, NULL);
+
+    *out = table;
+    return kIOReturnSuccess;
+}
+
+static void HPMStatusTableUnmap(HPMStatusTable *table)
+{
+    munmap(table->layout, sizeof(*table->layout));
+    pthread_mutex_destroy(&table->lock);
+    free(table);
+}
+
+/// Write an entry under its sequence lock. Must hold the table lock.
+static void HPMStatusTablePublish(HPMStatusTable *table, HPMPortStatus const *status)
+{
+    HPMStatusSlot *slot = &table->layout->slots[status->rid];
+
+    unsigned seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->status = *status;
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+IOReturn HPMStatusTableCreate(char const *name, HPMStatusTable **out)
+{
+    HPMStatusTable *table = NULL;
+    IO_TRY(HPMStatusTableMap(name, 1, &table));
+
+    HPMStatusLayout *layout = table->layout;
+    int compatible = atomic_load(&layout->magic) == kHPMStatusTableMagic
+        && layout->version == kHPMStatusTableVersion
+        && layout->numSlots == kHPMMaxRIDs;
+
+    // Readers check the magic last, so they never see a half-built table.
+    if (!compatible) {
+        HPMDebug("Initializing status table %s.", table->name);
+        atomic_store(&layout->magic, 0);
+        memset(layout->slots, 0, sizeof(layout->slots));
+        layout->version = kHPMStatusTableVersion;
+        layout->numSlots = kHPMMaxRIDs;
+        atomic_store(&layout->magic, kHPMStatusTableMagic);
+    }
+
+    for (int32_t rid = 0; rid < kHPMMaxRIDs; ++rid) {
+        // A previous publisher that died mid-update leaves its slot's count
+        // odd, which would make readers see it as busy for good.
+        HPMStatusSlot *slot = &layout->slots[rid];
+        unsigned seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+        if (seq & 1)
+            atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+
+        if (compatible)
+            table->published[rid] = slot->status;
+        table->published[rid].rid = rid;
+    }
+
+    atomic_store(&layout->publisher, (int)getpid());
+    *out = table;
+    return kIOReturnSuccess;
+}
+
+IOReturn HPMStatusTableOpen(char const *name, HPMStatusTable **out)
+{
+    HPMStatusTable *table = NULL;
+    IO_TRY(HPMStatusTableMap(name, 0, &table));
+
+    HPMStatusLayout const *layout = table->layout;
+    if (atomic_load((atomic_uint *)&layout->magic) != kHPMStatusTableMagic
+        || layout->version != kHPMStatusTableVersion || layout->numSlots != kHPMMaxRIDs) {
+        HPMStatusTableUnmap(table);
+        return kIOReturnNotReady;
+    }
+
+    *out = table;
+    return kIOReturnSuccess;
+}
+
+void HPMStatusTableClose(HPMStatusTable *table)
+{
+    HPMStatusTableUnmap(table);
+}
+
+void HPMStatusTableDestroy(HPMStatusTable *table)
+{
+    shm_unlink(table->name);
+    HPMStatusTableUnmap(table);
+}
+
+int32_t HPMStatusTableGetPublisher(HPMStatusTable const *table)
+{
+    return atomic_load((atomic_int *)&table->layout->publisher);
+}
+
+IOReturn HPMStatusTableRead(HPMStatusTable const *table, int32_t rid, HPMPortStatus *status)
+{
+    if (!table || !status || rid < 0 || rid >= kHPMMaxRIDs)
+        return kIOReturnBadArgument;
+
+    // Atomic loads don't take const pointers in C11.
+    HPMStatusSlot *slot = (HPMStatusSlot *)&table->layout->slots[rid];
+
+    for (int attempt = 0; attempt < kHPMStatusTableReadAttempts; ++attempt) {
+        unsigned begin = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (begin & 1)
+            continue;
+
+        HPMPortStatus copy = slot->status;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != begin)
+            continue;
+
+        if (!copy.updates)
+            return kIOReturnNotFound;
+
+        *status = copy;
+        return kIOReturnSuccess;
+    }
+
+    return kIOReturnBusy;
+}
+
+IOReturn HPMStatusTableRefresh(HPMStatusTable *table, HPMBackend const *backend)
+{
+    if (!table || !table->writable || !backend)
+        return kIOReturnBadArgument;
+
+    int32_t rids[kHPMMaxRIDs];
+    size_t numRIDs = 0;
+    IO_TRY(HPMEnumerateRIDs(backend, rids, kHPMMaxRIDs, &numRIDs));
+
+    int present[kHPMMaxRIDs] = { 0 };
+    for (size_t i = 0; i < numRIDs; ++i) {
+        int32_t rid = rids[i];
+        if (rid < 0 || rid >= kHPMMaxRIDs)
+            continue;
+
+        // Read outside the table lock, so VDM results never wait on hardware.
+        HPMClient hpm;
+        HPMStatus status = { .connection = kHPMConnectionTypeError, .mode = kHPMModeError };
+        IOReturn ret = HPMClientOpenWithBackend(&hpm, backend, rid);
+        if (ret == kIOReturnSuccess) {
+            ret = HPMGetStatus(&hpm, 0, &status);
+            HPMClientClose(&hpm);
+        }
+
+        present[rid] = 1;
+
+        pthread_mutex_lock(&table->lock);
+        HPMPortStatus *entry = &table->published[rid];
+        uint64_t now = HPMNow();
+        if (!entry->present || entry->connection != status.connection || entry->mode != status.mode)
+            entry->changedAt = now;
+
+        entry->present = 1;
+        entry->connection = status.connection;
+        entry->connectionRaw = status.connectionRaw;
+        entry->mode = status.mode;
+        entry->readResult = ret;
+        entry->updatedAt = now;
+        entry->updates++;
+        HPMStatusTablePublish(table, entry);
+        pthread_mutex_unlock(&table->lock);
+    }
+
+    // Only ports that were seen before are worth publishing as gone.
+    pthread_mutex_lock(&table->lock);
+    uint64_t now = HPMNow();
+    for (int32_t rid = 0; rid < kHPMMaxRIDs; ++rid) {
+        HPMPortStatus *entry = &table->published[rid];
+        if (present[rid] || !entry->updates)
+            continue;
+
+        if (entry->present)
+            entry->changedAt = now;
+
+        entry->present = 0;
+        entry->connection = kHPMConnectionTypeNone;
+        entry->connectionRaw = 0;
+        entry->mode = kHPMModeError;
+        entry->readResult = kIOReturnNoDevice;
+        entry->updatedAt = now;
+        entry->updates++;
+        HPMStatusTablePublish(table, entry);
+    }
+    pthread_mutex_unlock(&table->lock);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn HPMStatusTableRecordVDM(HPMStatusTable *table, int32_t rid, IOReturn result)
+{
+    if (!table || !table->writable || rid < 0 || rid >= kHPMMaxRIDs)
+        return kIOReturnBadArgument;
+
+    pthread_mutex_lock(&table->lock);
+    HPMPortStatus *entry = &table->published[rid];
+    entry->lastVDMResult = result;
+    entry->lastVDMAt = HPMNow();
+    entry->updates++;
+    HPMStatusTablePublish(table, entry);
+    pthread_mutex_unlock(&table->lock);
+
+    return kIOReturnSuccess;
+}
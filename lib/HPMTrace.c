@@ -0,0 +1,321 @@
+//
+//  HPMTrace.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "HPMFile.h"
+#include "HPMInstrument.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct {
+    /// Index of the event in the slot plus one, or zero while being written.
+    atomic_uint_least64_t seq;
+    HPMTraceEvent event;
+} HPMTraceSlot;
+
+// Slots double as the records of trace files.
+_Static_assert(sizeof(HPMTraceSlot) == sizeof(HPMTraceFileRecord), "trace slot layout");
+_Static_assert(sizeof(HPMTraceFileHeader) == 64, "trace file header layout");
+
+atomic_int gHPMTraceEnabled = 0;
+
+static HPMTraceSlot *sSlots = NULL;
+static size_t sCapacity = 0;
+
+/// Count of events recorded, which lives in the header when tracing to a file.
+static atomic_uint_least64_t sMemoryHead = 0;
+static atomic_uint_least64_t *sHead = &sMemoryHead;
+
+/// Mapping of the trace file, if tracing to one.
+static void *sMap = NULL;
+static size_t sMapSize = 0;
+
+static size_t HPMTraceRoundCapacity(size_t capacity)
+{
+    size_t rounded = 1;
+    while (rounded < capacity)
+        rounded <<= 1;
+
+    return rounded;
+}
+
+IOReturn HPMTraceEnable(size_t capacity)
+{
+    if (!capacity)
+        return kIOReturnBadArgument;
+
+    HPMTraceDisable();
+
+    size_t rounded = HPMTraceRoundCapacity(capacity);
+    sSlots = calloc(rounded, sizeof(*sSlots));
+    if (!sSlots)
+        return kIOReturnNoMemory;
+
+    sCapacity = rounded;
+    sHead = &sMemoryHead;
+    atomic_store(sHead, 0);
+    atomic_store(&gHPMTraceEnabled, 1);
+    return kIOReturnSuccess;
+}
+
+/// Give a new trace file its full size.
+static int HPMTraceSizeFile(int fd, size_t size)
+{
+    if (ftruncate(fd, (off_t)size) != 0)
+        return 0;
+
+#if defined(__linux__)
+    // Allocate the blocks now, rather than failing on a page fault mid-trace
+    // once the disk fills up.
+    if (posix_fallocate(fd, 0, (off_t)size) != 0)
+        return 0;
+#endif
+
+    return 1;
+}
+
+/// Create a new, locked trace file of \p size and rename it over \p path.
+/// Returns the new file, or -1 on failure.
+static int HPMTraceReplaceFile(char const *path, size_t size)
+{
+    char temp[1024];
+    if (snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid()) >= (int)sizeof(temp))
+        return -1;
+
+    // Removing a leftover only ever removes a link, never what it points to.
+    unlink(temp);
+    int fd = open(temp, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+
+    // Processes waiting for the old file's lock move on to this one once it
+    // is renamed over, so lock it first.
+    flock(fd, LOCK_EX);
+    if (!HPMTraceSizeFile(fd, size) || rename(temp, path) != 0) {
+        unlink(temp);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+IOReturn HPMTraceEnableFile(char const *path, size_t capacity)
+{
+    if (!path || !capacity)
+        return kIOReturnBadArgument;
+
+    HPMTraceDisable();
+
+    size_t rounded = HPMTraceRoundCapacity(capacity);
+    size_t size = sizeof(HPMTraceFileHeader) + rounded * sizeof(HPMTraceSlot);
+
+    // Setting the file up happens under the file lock, so that processes
+    // starting at the same time agree on whether to reuse it. The file may
+    // have been replaced while we waited for the lock, in which case try
+    // again on the new one.
+    int fd = -1;
+    struct stat st;
+    for (;;) {
+        fd = HPMOpenStateFile(path, O_RDWR | O_CREAT);
+        if (fd < 0)
+            return kIOReturnNotPermitted;
+
+        flock(fd, LOCK_EX);
+        struct stat current;
+        if (fstat(fd, &st) == 0 && stat(path, &current) == 0 && st.st_dev == current.st_dev
+            && st.st_ino == current.st_ino)
+            break;
+
+        close(fd);
+    }
+
+    HPMTraceFileHeader existing;
+    int reuse = (size_t)st.st_size == size
+        && pread(fd, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing)
+        && existing.magic == kHPMTraceFileMagic && existing.version == kHPMTraceFileVersion
+        && existing.recordSize == sizeof(HPMTraceSlot) && existing.capacity == rounded;
+
+    // Only a file we just created can be sized in place. Shrinking one that
+    // others have mapped would crash them the next time they touch it.
+    int ok = 1;
+    if (!reuse && st.st_size == 0) {
+        ok = HPMTraceSizeFile(fd, size);
+    } else if (!reuse) {
+        int replacement = HPMTraceReplaceFile(path, size);
+        close(fd);
+        fd = replacement;
+        ok = fd >= 0;
+    }
+
+    HPMTraceFileHeader *header = ok ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (header != MAP_FAILED && !reuse) {
+        struct timespec realtime;
+        clock_gettime(CLOCK_REALTIME, &realtime);
+        uint64_t now = HPMNow();
+
+        header->version = kHPMTraceFileVersion;
+        header->recordSize = sizeof(HPMTraceSlot);
+        header->capacity = rounded;
+        header->realtimeOffset = (int64_t)((uint64_t)realtime.tv_sec * 1000000000ull + (uint64_t)realtime.tv_nsec - now);
+        header->magic = kHPMTraceFileMagic;
+    }
+    if (fd >= 0) {
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+
+    if (header == MAP_FAILED)
+        return kIOReturnNoResources;
+
+    sMap = header;
+    sMapSize = size;
+    sSlots = (HPMTraceSlot *)(header + 1);
+    sCapacity = rounded;
+    sHead = (atomic_uint_least64_t *)&header->head;
+    atomic_store(&gHPMTraceEnabled, 1);
+    return kIOReturnSuccess;
+}
+
+void HPMTraceDisable(void)
+{
+    atomic_store(&gHPMTraceEnabled, 0);
+
+    if (sMap)
+        munmap(sMap, sMapSize);
+    else
+        free(sSlots);
+
+    sMap = NULL;
+    sMapSize = 0;
+    sSlots = NULL;
+    sCapacity = 0;
+    sHead = &sMemoryHead;
+}
+
+void HPMTraceRecord(HPMTraceOp op, int32_t rid, uint64_t chip, uint32_t arg, uint32_t flags, uint32_t length,
+    IOReturn result, uint64_t start)
+{
+    uint64_t end = HPMNow();
+    if (!sSlots)
+        return;
+
+    uint64_t index = atomic_fetch_add_explicit(sHead, 1, memory_order_relaxed);
+    HPMTraceSlot *slot = &sSlots[index & (sCapacity - 1)];
+
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->event = (HPMTraceEvent) {
+        .start = start,
+        .duration = end - start,
+        .chip = chip,
+        .arg = arg,
+        .flags = flags,
+        .length = length,
+        .rid = rid,
+        .result = result,
+        .op = op,
+    };
+    atomic_store_explicit(&slot->seq, index + 1, memory_order_release);
+}
+
+size_t HPMTraceCopyEvents(HPMTraceEvent *events, size_t maxEvents)
+{
+    if (!sSlots)
+        return 0;
+
+    uint64_t head = atomic_load_explicit(sHead, memory_order_acquire);
+    uint64_t first = head > sCapacity ? head - sCapacity : 0;
+
+    size_t count = 0;
+    for (uint64_t i = first; i < head && count < maxEvents; ++i) {
+        HPMTraceSlot *slot = &sSlots[i & (sCapacity - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != i + 1)
+            continue;
+
+        events[count] = slot->event;
+
+        // Skip the event if a writer lapped us while copying it.
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == i + 1)
+            ++count;
+    }
+
+    return count;
+}
+
+char const *HPMTraceOpGetName(HPMTraceOp op)
+{
+    switch (op) {
+    case kHPMTraceOpClientOpen:
+        return "open";
+    case kHPMTraceOpRead:
+        return "read";
+    case kHPMTraceOpWrite:
+        return "write";
+    case kHPMTraceOpCommand:
+        return "command";
+    case kHPMTraceOpDoCommand:
+        return "do-command";
+    case kHPMTraceOpSendVDM:
+        return "send-vdm";
+    case kHPMTraceOpWaitForMode:
+        return "wait-mode";
+    default:
+        return "unknown";
+    }
+}
+
+IOReturn HPMTraceExport(FILE *file, HPMTraceFormat format)
+{
+    HPMTraceEvent *events = sCapacity ? malloc(sCapacity * sizeof(*events)) : NULL;
+    if (sCapacity && !events)
+        return kIOReturnNoMemory;
+
+    size_t count = HPMTraceCopyEvents(events, sCapacity);
+
+    if (format == kHPMTraceFormatChrome)
+        fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    else
+        fprintf(file, "[\n");
+
+    // Chrome wants microseconds; keep the nanoseconds as fractional digits.
+    int pid = (int)getpid();
+    for (size_t i = 0; i < count; ++i) {
+        HPMTraceEvent const *e = &events[i];
+        char const *sep = i + 1 < count ? "," : "";
+
+        if (format == kHPMTraceFormatChrome) {
+            fprintf(file,
+                "{\"name\":\"%s\",\"cat\":\"hpm\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                "\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u,"
+                "\"args\":{\"chip\":%" PRIu64 ",\"arg\":%u,\"flags\":%u,\"length\":%u,\"result\":%d}}%s\n",
+                HPMTraceOpGetName(e->op), pid, e->rid,
+                e->start / 1000, (unsigned)(e->start % 1000), e->duration / 1000, (unsigned)(e->duration % 1000),
+                e->chip, e->arg, e->flags, e->length, e->result, sep);
+        } else {
+            fprintf(file,
+                "{\"op\":\"%s\",\"rid\":%d,\"chip\":%" PRIu64 ",\"arg\":%u,\"flags\":%u,\"length\":%u,"
+                "\"start_ns\":%" PRIu64 ",\"duration_ns\":%" PRIu64 ",\"result\":%d}%s\n",
+                HPMTraceOpGetName(e->op), e->rid, e->chip, e->arg, e->flags, e->length, e->start, e->duration,
+                e->result, sep);
+        }
+    }
+
+    fprintf(file, format == kHPMTraceFormatChrome ? "]}\n" : "]\n");
+    free(events);
+
+    return ferror(file) ? kIOReturnIOError : kIOReturnSuccess;
+}
@@ -0,0 +1,52 @@
+//
+//  HPMVDM.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+/// VDM main commands.
+typedef enum {
+    kVDMCommandList = 0x5ac8010,   ///< Get supported actions.
+    kVDMCommandInfo = 0x5ac8011,   ///< Get info for an action.
+    kVDMCommandAction = 0x5ac8012, ///< Perform an action.
+} VDMCommand;
+
+/// VDM actions used with the "perform" command.
+typedef enum {
+    kVDMActionReboot = 0x105,    ///< Reboot the device.
+    kVDMActionDFU = 0x106,       ///< Go to DFU mode.
+    kVDMActionDebugUSB = 0x4606, ///< Pull up Debug USB.
+} VDMAction;
+
+/// VDM action flags.
+typedef enum {
+    kVDMFlagsLine1 = (1 << 17),    ///< Map line 1.
+    kVDMFlagsGraceful = (1 << 23), ///< Exit conflicting modes if possible.
+    kVDMFlagsPersist = (1 << 24),  ///< Persist through soft reset.
+    kVDMFlagsExit = (1 << 25),     ///< Exit mode (instead of enter).
+} VDMFlags;
+
+/// Command type bits of a structured VDM header, as set in responses.
+typedef enum {
+    kVDMResponseMask = (3 << 6),
+    kVDMResponseACK = (1 << 6),  ///< Request handled.
+    kVDMResponseNAK = (2 << 6),  ///< Request not supported.
+    kVDMResponseBusy = (3 << 6), ///< Try again later.
+} VDMResponse;
+
+/// Registers holding USB PD messages received from the partner.
+///
+/// Both start with a byte whose low three bits give the number of valid
+/// 32-bit objects, which follow in little-endian order.
+typedef enum {
+    kVDMRegisterRxIdentity = 0x48, ///< Discover Identity response.
+    kVDMRegisterRxVDM = 0x4f,      ///< Most recently received VDM.
+} VDMRegister;
+
+/// Most objects a PD message can carry, header included.
+#define kVDMMaxObjects 7
@@ -0,0 +1,78 @@
+//
+//  barrier.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include "barrier.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#if defined(__APPLE__)
+#include <pthread/qos.h>
+#endif
+
+void spin_barrier_init(spin_barrier_t *barrier, int count)
+{
+    pthread_mutex_init(&barrier->lock, NULL);
+    pthread_cond_init(&barrier->gathered, NULL);
+    barrier->waiting = count;
+
+    atomic_init(&barrier->remaining, count);
+    atomic_init(&barrier->released, 0);
+    barrier->yield = count > sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+void spin_barrier_wait(spin_barrier_t *barrier)
+{
+    pthread_mutex_lock(&barrier->lock);
+    if (--barrier->waiting == 0)
+        pthread_cond_broadcast(&barrier->gathered);
+    while (barrier->waiting > 0)
+        pthread_cond_wait(&barrier->gathered, &barrier->lock);
+    pthread_mutex_unlock(&barrier->lock);
+
+    // Everyone is here; line them up again as they wake, for the release.
+    if (atomic_fetch_sub_explicit(&barrier->remaining, 1, memory_order_acq_rel) == 1) {
+        atomic_store_explicit(&barrier->released, 1, memory_order_release);
+        return;
+    }
+
+    while (!atomic_load_explicit(&barrier->released, memory_order_acquire)) {
+        if (barrier->yield)
+            sched_yield();
+    }
+}
+
+void spin_barrier_destroy(spin_barrier_t *barrier)
+{
+    pthread_cond_destroy(&barrier->gathered);
+    pthread_mutex_destroy(&barrier->lock);
+}
+
+void thread_pin_to_cpu(int index)
+{
+#if defined(__linux__)
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(num_cpus > 0 ? index % num_cpus : 0, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(__APPLE__)
+    // macOS has no hard affinity; the best we can do is ask to be scheduled
+    // promptly.
+    (void)index;
+    pthread_set_qos_class_self_np(QOS_CLASS_USER_INTERACTIVE, 0);
+#else
+    (void)index;
+#endif
+}
@@ -0,0 +1,50 @@
+//
+//  barrier.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Spinning barrier for releasing several threads at (nearly) the same
+// instant. Blocking barriers wake waiters one by one through the scheduler,
+// which spreads them over tens of microseconds or more; spinning waiters
+// see the release within a cache line transfer.
+//
+// Threads may take a long time to arrive (e.g. behind a port lock), so they
+// first gather blocking, and only spin while the others are being woken.
+
+typedef struct {
+    /// Guards \p waiting; the gather phase sleeps on \p gathered.
+    pthread_mutex_t lock;
+    pthread_cond_t gathered;
+    int waiting;
+
+    atomic_int remaining;
+    atomic_int released;
+
+    /// Whether waiters should yield instead of spinning; see spin_barrier_init.
+    int yield;
+} spin_barrier_t;
+
+/// Prepare a barrier for \p count threads; destroy it once they are through.
+///
+/// If there are more threads than CPUs, spinning waiters could keep the last
+/// ones from ever arriving, so waiters yield the CPU instead (at the cost of
+/// a less precise release).
+void spin_barrier_init(spin_barrier_t *barrier, int count);
+
+/// Wait until all threads have arrived.
+void spin_barrier_wait(spin_barrier_t *barrier);
+
+void spin_barrier_destroy(spin_barrier_t *barrier);
+
+/// Pin the calling thread to a CPU (modulo the number of CPUs), or just raise
+/// its scheduling priority where pinning isn't supported.
+void thread_pin_to_cpu(int index);
@@ -0,0 +1,270 @@
+//
+//  bench.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "HPMFraud.h"
+#include "flow.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+// Microbenchmarks for HPMFraud operations. Results are printed as JSON lines,
+// one object per benchmark, so they can be collected for trend tracking.
+
+#define fatalf(...)                   \
+    do {                              \
+        fprintf(stderr, __VA_ARGS__); \
+        exit(1);                      \
+    } while (0)
+
+#define BENCH_TRY(STMT)                   \
+    do {                                  \
+        IOReturn _try_ret = STMT;         \
+        if (_try_ret != kIOReturnSuccess) \
+            return _try_ret;              \
+    } while (0)
+
+typedef IOReturn (*bench_fn_t)(HPMClient *hpm);
+
+typedef struct {
+    char const *name;
+    bench_fn_t fn;
+    int needs_dbma;
+
+    /// Whether this acts on the attached device (e.g. rebooting it), so it
+    /// only runs against real hardware when asked for by name.
+    int destructive;
+} bench_t;
+
+static HPMBackend const *s_backend = NULL;
+static int s_rid = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static IOReturn bench_get_mode(HPMClient *hpm)
+{
+    HPMMode mode;
+    return HPMGetMode(hpm, &mode);
+}
+
+static IOReturn bench_get_connection_type(HPMClient *hpm)
+{
+    return HPMGetConnectionType(hpm) == kHPMConnectionTypeError ? kIOReturnError : kIOReturnSuccess;
+}
+
+static IOReturn bench_do_command(HPMClient *hpm)
+{
+    // Re-requesting DBMa while already in it exercises the full write,
+    // command and read sequence without changing anything.
+    return HPMDoCommand(hpm, 0, kHPMCommandDBMA, kHPMCommandArg1, 1, NULL);
+}
+
+static IOReturn bench_send_vdm(HPMClient *hpm)
+{
+    static uint32_t const body[] = { 0x5ac8010 };
+    return HPMSendVDM(hpm, 0, body, sizeof(body));
+}
+
+/// Everything vdmpoke does for a single known VDM, minus opening the client.
+static IOReturn bench_known_vdm_flow(HPMClient *hpm, HPMKnownVDM vdm)
+{
+    HPMInvalidateState(hpm);
+    BENCH_TRY(HPMEnterDBMA(hpm));
+    BENCH_TRY(HPMSendKnownVDM(hpm, 0, vdm));
+    return HPMExitDBMA(hpm);
+}
+
+static IOReturn bench_reboot_flow(HPMClient *hpm)
+{
+    return bench_known_vdm_flow(hpm, kHPMKnownVDMReboot);
+}
+
+static IOReturn bench_dfu_flow(HPMClient *hpm)
+{
+    return bench_known_vdm_flow(hpm, kHPMKnownVDMDFU);
+}
+
+static IOReturn bench_open_close(HPMClient *hpm)
+{
+    (void)hpm;
+
+    HPMClient other;
+    BENCH_TRY(HPMClientOpenWithBackend(&other, s_backend, s_rid));
+    HPMClientClose(&other);
+    return kIOReturnSuccess;
+}
+
+static bench_t const s_benches[] = {
+    { "get-mode", bench_get_mode, 0, 0 },
+    { "get-connection-type", bench_get_connection_type, 0, 0 },
+    { "do-command", bench_do_command, 1, 0 },
+    { "send-vdm", bench_send_vdm, 1, 0 },
+    { "reboot-flow", bench_reboot_flow, 0, 1 },
+    { "dfu-flow", bench_dfu_flow, 0, 1 },
+    { "open-close", bench_open_close, 0, 0 },
+};
+
+static int compare_u64(void const *a, void const *b)
+{
+    uint64_t x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t const *sorted, size_t count, double p)
+{
+    size_t index = (size_t)(p * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+static int bench_run(bench_t const *bench, HPMClient *hpm, size_t iterations, size_t warmup, uint64_t *samples)
+{
+    if (bench->needs_dbma) {
+        IOReturn ret = HPMEnterDBMA(hpm);
+        if (ret != kIOReturnSuccess) {
+            fprintf(stderr, "%s: Failed to enter DBMa mode. (%#x)\n", bench->name, ret);
+            return 0;
+        }
+    }
+
+    for (size_t i = 0; i < warmup + iterations; ++i) {
+        uint64_t start = now_ns();
+        IOReturn ret = bench->fn(hpm);
+        uint64_t end = now_ns();
+
+        if (ret != kIOReturnSuccess) {
+            fprintf(stderr, "%s: Iteration %zu failed. (%#x)\n", bench->name, i, ret);
+            return 0;
+        }
+        if (i >= warmup)
+            samples[i - warmup] = end - start;
+    }
+
+    if (bench->needs_dbma)
+        HPMExitDBMA(hpm);
+
+    uint64_t total = 0;
+    for (size_t i = 0; i < iterations; ++i)
+        total += samples[i];
+
+    qsort(samples, iterations, sizeof(*samples), compare_u64);
+
+    printf("{\"bench\":\"%s\",\"backend\":\"%s\",\"iterations\":%zu,\"ops_per_sec\":%.1f,"
+           "\"mean_ns\":%" PRIu64 ",\"min_ns\":%" PRIu64 ",\"p50_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64
+           ",\"max_ns\":%" PRIu64 "}\n",
+        bench->name, HPMBackendGetName(s_backend), iterations, total ? iterations * 1e9 / total : 0.0,
+        total / iterations, samples[0], percentile(samples, iterations, 0.50),
+        percentile(samples, iterations, 0.99), samples[iterations - 1]);
+    fflush(stdout);
+
+    return 1;
+}
+
+static void usage(char const *prog)
+{
+    printf("Usage: %s [-B <backend>] [-r <rid>] [-n <iterations>] [-w <warmup>] [<bench>...]\n\n", prog);
+
+    puts("Options:");
+    puts("  -B <backend>          HPM backend to use (default: sim); see vdmpoke -h");
+    puts("  -r <rid>              HPM RID (port number) to benchmark against");
+    puts("  -n <iterations>       Measured iterations per benchmark (default: 10000)");
+    puts("  -w <warmup>           Unmeasured iterations per benchmark (default: 100)");
+    puts("  -h                    Show this usage info\n");
+
+    puts("Benchmarks (all by default; those marked * only with the sim backend unless named):");
+    for (size_t i = 0; i < sizeof(s_benches) / sizeof(s_benches[0]); ++i)
+        printf("  %s%s\n", s_benches[i].name, s_benches[i].destructive ? " *" : "");
+}
+
+static size_t parse_uint(char const *str, char const *what)
+{
+    char *end = NULL;
+    errno = 0;
+    unsigned long value = strtoul(str, &end, 0);
+    if (errno == ERANGE || end == str || *end != 0)
+        fatalf("Invalid %s '%s'.\n", what, str);
+
+    return value;
+}
+
+static size_t parse_count(char const *str)
+{
+    size_t value = parse_uint(str, "count");
+    if (!value)
+        fatalf("Invalid count '%s'.\n", str);
+
+    return value;
+}
+
+int main(int argc, char **argv)
+{
+    size_t iterations = 10000;
+    size_t warmup = 100;
+    s_backend = HPMGetSimBackend();
+
+    int opt_char = 0;
+    while ((opt_char = getopt(argc, argv, "B:r:n:w:h")) != -1) {
+        switch (opt_char) {
+        case 'B':
+            if (flow_select_backend(optarg, &s_backend) != kIOReturnSuccess)
+                fatalf("Unknown or unavailable backend '%s'.\n", optarg);
+            break;
+        case 'r':
+            s_rid = (int)parse_uint(optarg, "RID");
+            break;
+        case 'n':
+            iterations = parse_count(optarg);
+            break;
+        case 'w':
+            warmup = parse_uint(optarg, "warmup count");
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (s_backend == HPMGetIOKitBackend() && geteuid() != 0)
+        fatalf("Error: The IOKit backend requires root permissions!\n");
+
+    uint64_t *samples = malloc(iterations * sizeof(*samples));
+    if (!samples)
+        fatalf("Out of memory.\n");
+
+    HPMClient hpm;
+    IOReturn ret = HPMClientOpenWithBackend(&hpm, s_backend, s_rid);
+    if (ret != kIOReturnSuccess)
+        fatalf("Failed to open HPM client for RID %d. (%#x)\n", s_rid, ret);
+
+    int failures = 0;
+    size_t num_benches = sizeof(s_benches) / sizeof(s_benches[0]);
+    for (size_t i = 0; i < num_benches; ++i) {
+        // Don't reboot real devices thousands of times unless asked to.
+        int selected = optind == argc && (!s_benches[i].destructive || s_backend == HPMGetSimBackend());
+        for (int j = optind; j < argc && !selected; ++j)
+            selected = strcmp(argv[j], s_benches[i].name) == 0;
+
+        if (selected && !bench_run(&s_benches[i], &hpm, iterations, warmup, samples))
+            ++failures;
+    }
+
+    HPMClientClose(&hpm);
+    free(samples);
+
+    return failures ? 1 : 0;
+}
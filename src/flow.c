@@ -0,0 +1,92 @@
+//
+//  flow.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "flow.h"
+
+#include "HPMSim.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+IOReturn flow_select_backend(char const *spec, HPMBackend const **out)
+{
+    char name[16];
+    size_t name_len = strcspn(spec, ":");
+    if (name_len >= sizeof(name))
+        return kIOReturnBadArgument;
+    memcpy(name, spec, name_len);
+    name[name_len] = 0;
+
+    HPMBackend const *backend = HPMGetBackendByName(name);
+    if (!backend)
+        return kIOReturnNotFound;
+
+    if (spec[name_len] == ':') {
+        if (backend != HPMGetSimBackend())
+            return kIOReturnBadArgument;
+
+        HPMSimConfig config;
+        HPMSimGetConfig(&config);
+        IOReturn ret = HPMSimParseConfig(spec + name_len + 1, &config);
+        if (ret != kIOReturnSuccess)
+            return ret;
+
+        HPMSimSetConfig(&config);
+    }
+
+    *out = backend;
+    return kIOReturnSuccess;
+}
+
+IOReturn flow_create_retry_policy(uint32_t retries, HPMRetryPolicy **out)
+{
+    *out = NULL;
+    if (!retries)
+        return kIOReturnSuccess;
+
+    HPMRetryConfig config;
+    HPMRetryConfigGetDefault(&config);
+    config.maxAttempts = retries + 1;
+    return HPMRetryPolicyCreate(&config, out);
+}
+
+int flow_parse_known_vdm(char const *name, HPMKnownVDM *out)
+{
+    if (strcmp(name, "list") == 0)
+        *out = kHPMKnownVDMList;
+    else if (strcmp(name, "reboot") == 0)
+        *out = kHPMKnownVDMReboot;
+    else if (strcmp(name, "dfu") == 0)
+        *out = kHPMKnownVDMDFU;
+    else if (strcmp(name, "debug") == 0)
+        *out = kHPMKnownVDMDebugUSB;
+    else
+        return 0;
+
+    return 1;
+}
+
+int flow_parse_vdm_words(char const *const *strs, int num_strs, uint32_t *words)
+{
+    if (num_strs < 1 || num_strs > FLOW_MAX_VDM_WORDS)
+        return -1;
+
+    for (int i = 0; i < num_strs; ++i) {
+        char *end = NULL;
+        errno = 0;
+        unsigned long word = strtoul(strs[i], &end, 16);
+        if (errno == ERANGE || end == strs[i] || *end != 0 || word > UINT32_MAX)
+            return -1;
+
+        words[i] = (uint32_t)word;
+    }
+
+    return num_strs;
+}
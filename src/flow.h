@@ -0,0 +1,31 @@
+//
+//  flow.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMFraud.h"
+#include "HPMRetry.h"
+
+/// Maximum number of words accepted for a custom VDM.
+#define FLOW_MAX_VDM_WORDS 8
+
+/// Select a backend from a command-line spec, e.g. "iokit" or "sim:ports=4".
+///
+/// Anything after the colon is passed to HPMSimParseConfig.
+IOReturn flow_select_backend(char const *spec, HPMBackend const **out);
+
+/// Create a retry policy for transient errors allowing \p retries retries on
+/// top of the first attempt; sets \p out to NULL if \p retries is zero.
+IOReturn flow_create_retry_policy(uint32_t retries, HPMRetryPolicy **out);
+
+/// Look up a known VDM by its command-line name (e.g. "dfu").
+int flow_parse_known_vdm(char const *name, HPMKnownVDM *out);
+
+/// Parse hexadecimal VDM words; returns the number of words, or -1.
+int flow_parse_vdm_words(char const *const *strs, int num_strs, uint32_t *words);
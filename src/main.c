@@ -7,13 +7,30 @@
 //  of the license can be found in the LICENSE.txt file.
 //
 
+#include "HPMDiscovery.h"
 #include "HPMFraud.h"
+#include "HPMMetrics.h"
+#include "HPMRecord.h"
+#include "HPMSession.h"
+#include "HPMStats.h"
+#include "HPMStatusTable.h"
+#include "HPMTrace.h"
+#include "barrier.h"
+#include "flow.h"
+#include "portlock.h"
+#include "script.h"
+#include "watch.h"
 
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
 #define fatalf(...)                   \
@@ -22,18 +39,55 @@
         exit(1);                      \
     } while (0)
 
+#define CLI_TRACE_CAPACITY 65536
+
 typedef enum {
     CMD_HELP,
     CMD_REBOOT,
     CMD_DFU,
     CMD_DEBUG,
     CMD_CUSTOM,
+    CMD_PORTS,
+    CMD_SCRIPT,
+    CMD_DUMP,
+    CMD_CAPS,
+    CMD_STATUS,
+    CMD_WATCH,
+    CMD_STATS,
+    CMD_METRICS,
 } cmd_t;
 
 typedef struct {
     char const *prog;
     cmd_t cmd;
     int rid;
+    int stay_in_dbma;
+    int wait;
+    uint32_t wait_timeout_ms;
+    int sync;
+    uint32_t poll_max_ms;
+    uint32_t mode_timeout_ms;
+    uint32_t retries;
+    int all_rids;
+    char const *any_rid;
+    int num_rids;
+    int rids[kHPMMaxRIDs];
+    char const *backend;
+    char const *socket;
+    char const *trace_path;
+    HPMTraceFormat trace_format;
+    int trace_binary;
+    uint32_t trace_capacity;
+    char const *record_path;
+    char const *replay_path;
+    double replay_scale;
+    char const *cache_path;
+    char const *status_table;
+    char const *stats_path;
+    char const *metrics_path;
+    char const *lock_path;
+    int use_lock;
+    uint32_t lock_timeout_ms;
     int num_rest;
     char const *rest[8];
 } args_t;
@@ -49,27 +103,212 @@ int args_parse_int(char const *str, uint64_t *out)
     return 1;
 }
 
+/// Parse a RID argument, which can be a single RID, a comma-separated list of
+/// RIDs, or 'all'. 'any' and 'any:<pid>' are passed on to vdmpokd as is.
+void args_parse_rids(args_t *args, char *spec)
+{
+    if (strcmp(spec, "all") == 0) {
+        args->all_rids = 1;
+        return;
+    }
+    if (strcmp(spec, "any") == 0 || strncmp(spec, "any:", 4) == 0) {
+        args->any_rid = spec;
+        return;
+    }
+
+    args->num_rids = 0;
+    for (char *tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+        uint64_t rid;
+        if (!args_parse_int(tok, &rid) || args->num_rids == kHPMMaxRIDs)
+            continue;
+
+        args->rids[args->num_rids++] = (int)rid;
+    }
+
+    if (args->num_rids)
+        args->rid = args->rids[0];
+}
+
 void args_parse(args_t *args, int argc, char **argv)
 {
     args->prog = argv[0];
     args->cmd = CMD_HELP;
     args->rid = 0;
+    args->stay_in_dbma = 0;
+    args->sync = 0;
+    args->poll_max_ms = WATCH_DEFAULT_MAX_POLL_MS;
+    args->wait = 0;
+    args->wait_timeout_ms = 30000;
+    args->mode_timeout_ms = kHPMDefaultModeTimeoutMs;
+    args->retries = 0;
+    args->all_rids = 0;
+    args->any_rid = NULL;
+    args->num_rids = 0;
+    args->backend = NULL;
+    args->socket = NULL;
+    args->trace_path = NULL;
+    args->trace_format = kHPMTraceFormatChrome;
+    args->trace_binary = 0;
+    args->trace_capacity = CLI_TRACE_CAPACITY;
+    args->record_path = NULL;
+    args->replay_path = NULL;
+    args->replay_scale = 1;
+    args->cache_path = getenv("VDMPOKE_CACHE");
+    args->status_table = getenv("VDMPOKE_STATUS_TABLE");
+    args->stats_path = getenv("VDMPOKE_STATS");
+    args->metrics_path = NULL;
+    args->lock_path = getenv("VDMPOKE_LOCK_FILE");
+    if (!args->lock_path)
+        args->lock_path = PORT_LOCK_DEFAULT_PATH;
+    args->use_lock = 1;
+    args->lock_timeout_ms = 60000;
     args->num_rest = 0;
 
     // Silence the default 'getopt' output. We will produce our own error
     // messages as needed.
     opterr = 0;
 
+    enum {
+        OPT_TRACE = 0x100,
+        OPT_TRACE_FORMAT,
+        OPT_TRACE_CAPACITY,
+        OPT_WAIT,
+        OPT_WAIT_TIMEOUT,
+        OPT_CACHE,
+        OPT_LOCK_TIMEOUT,
+        OPT_NO_LOCK,
+        OPT_MODE_TIMEOUT,
+        OPT_RETRIES,
+        OPT_SYNC,
+        OPT_STATUS_TABLE,
+        OPT_STATS,
+        OPT_METRICS,
+        OPT_POLL_MAX,
+        OPT_RECORD,
+        OPT_REPLAY,
+        OPT_REPLAY_SCALE,
+    };
+
+    static struct option const long_opts[] = {
+        { "trace", required_argument, NULL, OPT_TRACE },
+        { "trace-format", required_argument, NULL, OPT_TRACE_FORMAT },
+        { "trace-capacity", required_argument, NULL, OPT_TRACE_CAPACITY },
+        { "wait", no_argument, NULL, OPT_WAIT },
+        { "wait-timeout", required_argument, NULL, OPT_WAIT_TIMEOUT },
+        { "cache", required_argument, NULL, OPT_CACHE },
+        { "lock-timeout", required_argument, NULL, OPT_LOCK_TIMEOUT },
+        { "no-lock", no_argument, NULL, OPT_NO_LOCK },
+        { "mode-timeout", required_argument, NULL, OPT_MODE_TIMEOUT },
+        { "retries", required_argument, NULL, OPT_RETRIES },
+        { "sync", no_argument, NULL, OPT_SYNC },
+        { "status-table", required_argument, NULL, OPT_STATUS_TABLE },
+        { "stats", required_argument, NULL, OPT_STATS },
+        { "metrics", required_argument, NULL, OPT_METRICS },
+        { "poll-max", required_argument, NULL, OPT_POLL_MAX },
+        { "record", required_argument, NULL, OPT_RECORD },
+        { "replay", required_argument, NULL, OPT_REPLAY },
+        { "replay-scale", required_argument, NULL, OPT_REPLAY_SCALE },
+        { NULL, 0, NULL, 0 },
+    };
+
     int opt_char = 0;
-    while ((opt_char = getopt(argc, argv, "r:")) != -1) {
+    while ((opt_char = getopt_long(argc, argv, "r:KB:S:", long_opts, NULL)) != -1) {
         switch (opt_char) {
-        case 'r': {
-            uint64_t rid;
-            if (args_parse_int(optarg, &rid))
-                args->rid = (int)rid;
-
+        case OPT_TRACE:
+            args->trace_path = optarg;
+            break;
+        case OPT_TRACE_FORMAT:
+            if (strcmp(optarg, "json") == 0)
+                args->trace_format = kHPMTraceFormatJSON;
+            else if (strcmp(optarg, "chrome") == 0)
+                args->trace_format = kHPMTraceFormatChrome;
+            else if (strcmp(optarg, "binary") == 0)
+                args->trace_binary = 1;
+            break;
+        case OPT_TRACE_CAPACITY: {
+            uint64_t capacity;
+            if (args_parse_int(optarg, &capacity) && capacity > 0 && capacity <= UINT32_MAX)
+                args->trace_capacity = (uint32_t)capacity;
+            break;
+        }
+        case OPT_WAIT:
+            args->wait = 1;
+            break;
+        case OPT_RECORD:
+            args->record_path = optarg;
+            break;
+        case OPT_REPLAY:
+            args->replay_path = optarg;
+            break;
+        case OPT_REPLAY_SCALE: {
+            char *end = NULL;
+            double scale = strtod(optarg, &end);
+            if (end != optarg && *end == 0 && scale >= 0)
+                args->replay_scale = scale;
+            break;
+        }
+        case OPT_CACHE:
+            args->cache_path = optarg;
+            break;
+        case OPT_STATUS_TABLE:
+            args->status_table = optarg;
+            break;
+        case OPT_STATS:
+            args->stats_path = optarg;
+            break;
+        case OPT_METRICS:
+            args->metrics_path = optarg;
+            break;
+        case OPT_LOCK_TIMEOUT: {
+            uint64_t timeout;
+            if (args_parse_int(optarg, &timeout) && timeout <= UINT32_MAX)
+                args->lock_timeout_ms = (uint32_t)timeout;
+            break;
+        }
+        case OPT_NO_LOCK:
+            args->use_lock = 0;
+            break;
+        case OPT_SYNC:
+            args->sync = 1;
+            break;
+        case OPT_RETRIES: {
+            uint64_t retries;
+            if (args_parse_int(optarg, &retries) && retries < UINT32_MAX)
+                args->retries = (uint32_t)retries;
             break;
         }
+        case OPT_POLL_MAX: {
+            uint64_t interval;
+            if (args_parse_int(optarg, &interval) && interval <= UINT32_MAX)
+                args->poll_max_ms = (uint32_t)interval;
+            break;
+        }
+        case OPT_MODE_TIMEOUT: {
+            uint64_t timeout;
+            if (args_parse_int(optarg, &timeout) && timeout <= UINT32_MAX)
+                args->mode_timeout_ms = (uint32_t)timeout;
+            break;
+        }
+        case OPT_WAIT_TIMEOUT: {
+            uint64_t timeout;
+            if (args_parse_int(optarg, &timeout) && timeout <= UINT32_MAX) {
+                args->wait = 1;
+                args->wait_timeout_ms = (uint32_t)timeout;
+            }
+            break;
+        }
+        case 'r':
+            args_parse_rids(args, optarg);
+            break;
+        case 'K':
+            args->stay_in_dbma = 1;
+            break;
+        case 'B':
+            args->backend = optarg;
+            break;
+        case 'S':
+            args->socket = optarg;
+            break;
         default:
             break;
         }
@@ -87,70 +326,849 @@ void args_parse(args_t *args, int argc, char **argv)
         args->cmd = CMD_DEBUG;
     else if (strcmp(cmd, "custom") == 0)
         args->cmd = CMD_CUSTOM;
+    else if (strcmp(cmd, "ports") == 0)
+        args->cmd = CMD_PORTS;
+    else if (strcmp(cmd, "script") == 0)
+        args->cmd = CMD_SCRIPT;
+    else if (strcmp(cmd, "dump") == 0)
+        args->cmd = CMD_DUMP;
+    else if (strcmp(cmd, "caps") == 0)
+        args->cmd = CMD_CAPS;
+    else if (strcmp(cmd, "status") == 0)
+        args->cmd = CMD_STATUS;
+    else if (strcmp(cmd, "watch") == 0)
+        args->cmd = CMD_WATCH;
+    else if (strcmp(cmd, "stats") == 0)
+        args->cmd = CMD_STATS;
+    else if (strcmp(cmd, "metrics") == 0)
+        args->cmd = CMD_METRICS;
 
-    for (int i = optind; i < argc; ++i) {
-        if (i >= 8)
+    for (int i = optind + 1; i < argc; ++i) {
+        if (args->num_rest >= 8)
             break;
 
-        args->rest[i - 2] = argv[i];
-        args->num_rest++;
+        args->rest[args->num_rest++] = argv[i];
     }
 }
 
+#define CLI_DEFAULT_CACHE "/var/run/vdmpoke-capabilities"
+#define CLI_DEFAULT_SOCKET "/var/run/vdmpokd.sock"
+
 void args_help(args_t const *args)
 {
-    printf("Usage: %s [-r <rid>] <command> [...]\n\n", args->prog);
+    printf("Usage: %s [-r <rid>[,<rid>...]|all|any[:<pid>]] <command> [...]\n\n", args->prog);
 
     puts("Commands:");
     puts("  reboot                Reboot the connected device");
     puts("  dfu                   Send the connected device to DFU mode");
     puts("  debug                 Pull up Debug USB mode on the connected device");
     puts("  custom <word>...      Send a custom VDM");
+    puts("  ports                 List available HPM instances");
+    puts("  script [<file>]       Run a batch of operations from a file (or stdin)");
+    puts("  dump [<chip>...]      Read every register (0x00-0xff) of the given chips (default: 0)");
+    puts("  caps [refresh]        Show the VDM actions the connected device supports");
+    puts("  status                Show port status as published by vdmpokd -p, without");
+    puts("                        touching the hardware");
+    puts("  watch                 Print a JSON line for every port plugged, unplugged or");
+    puts("                        changing mode, until interrupted");
+    puts("  stats [reset]         Show latency percentiles of port operations, from past");
+    puts("                        runs and vdmpokd (-S, or " CLI_DEFAULT_SOCKET ")");
+    puts("  metrics               Print vdmpokd's counters and histograms in the OpenMetrics");
+    puts("                        text format");
     puts("  help                  Show this usage info\n");
 
     puts("Options:");
-    puts("  -r <rid>              HPM RID (port number) to match against\n");
+    puts("  -r <rid>              HPM RID (port number) to match against; pass a list or");
+    puts("                        'all' to run on several ports in parallel; with -S, 'any'");
+    puts("                        runs on whichever port with a device attached is free first,");
+    puts("                        and 'any:<pid>' likewise for devices of that product ID");
+    puts("  -K                    Keep the port in DBMa mode afterwards, which speeds up");
+    puts("                        back-to-back invocations");
+    puts("  -B <backend>          HPM backend: 'iokit' (default on macOS) or 'sim[:<key>=<value>,...]'");
+    puts("  -S <socket>           Forward the command to a running vdmpokd");
+    puts("  --sync                With several RIDs, prepare every port first, then send all");
+    puts("                        VDMs at the same instant and report the skew between them");
+    puts("  --wait                Wait for the device to disconnect and re-attach, e.g.");
+    puts("                        after rebooting or entering DFU");
+    puts("  --wait-timeout <ms>   Give up waiting after this long (default: 30000)");
+    puts("  --retries <n>         Retry operations failing with transient errors up to this");
+    puts("                        many times, with backoff (default: 0)");
+    puts("  --mode-timeout <ms>   How long to wait for the port to switch modes (default: 1000)");
+    puts("  --cache <file>        Capability cache (default: $VDMPOKE_CACHE, or " CLI_DEFAULT_CACHE ")");
+    puts("  --poll-max <ms>       Longest interval between polls while watching (default: 500)");
+    puts("  --stats <file>        Add this run's latency statistics to a file on exit, and");
+    puts("                        include it in 'stats' (default: $VDMPOKE_STATS, if set)");
+    puts("  --metrics <file>      Write this run's counters and histograms to a file in the");
+    puts("                        OpenMetrics text format on exit, e.g. for a textfile collector");
+    puts("  --status-table <name> Status table to read (default: $VDMPOKE_STATUS_TABLE, or");
+    puts("                        " kHPMStatusTableDefaultName ")");
+    puts("  --lock-timeout <ms>   How long to wait for other invocations using the same");
+    puts("                        port (default: 60000)");
+    puts("  --no-lock             Don't wait for other invocations using the same port");
+    puts("  --record <file>       Log every call made to the hardware, with its replies and");
+    puts("                        timing, for replaying later");
+    puts("  --replay <file>       Answer calls from a log written by --record instead of the");
+    puts("                        hardware");
+    puts("  --replay-scale <x>    Scale recorded call durations by this factor when replaying;");
+    puts("                        0 to reply immediately (default: 1)");
+    puts("  --trace <file>        Record timings of every HPM operation to a file");
+    puts("  --trace-format <fmt>  Trace file format: 'chrome' (default), 'json', or 'binary'");
+    puts("                        to append to a fixed-size file as events happen; read it");
+    puts("                        with vdmpoke-trace");
+    puts("  --trace-capacity <n>  Number of events a binary trace holds (default: 65536)\n");
 
     puts("Note:\n  This tool must run with root permissions to perform any useful operations,");
     puts("  which is enforced by AppleHPMUserClient.");
 }
 
-static void cli_enter_dbma_mode(HPMClient *hpm)
+/// Describe why the last operation on a session failed.
+static char const *cli_describe_failure(HPMSession const *session, IOReturn ret)
+{
+    HPMSessionStep step = HPMSessionGetFailedStep(session);
+    if (step == kHPMSessionStepConnection && ret == kIOReturnNoDevice)
+        return "No connection found";
+
+    return HPMSessionStepGetDescription(step);
+}
+
+static void cli_enter_dbma_mode(HPMSession *session)
 {
-    HPMMode mode;
-    IOReturn ret = HPMGetMode(hpm, &mode);
+    IOReturn ret = HPMSessionEnterDBMA(session);
     if (ret != kIOReturnSuccess)
-        fatalf("Failed to get HPM mode. (%#x)\n", ret);
-    if (mode == kHPMModeDBMA)
+        fatalf("%s. (%#x)\n", cli_describe_failure(session, ret), ret);
+}
+
+static void cli_exit_dbma_mode(HPMSession *session)
+{
+    IOReturn ret = HPMSessionExitDBMA(session);
+    if (ret != kIOReturnSuccess)
+        fatalf("%s. (%#x)\n", cli_describe_failure(session, ret), ret);
+}
+
+static char const *cli_cmd_name(cmd_t cmd)
+{
+    switch (cmd) {
+    case CMD_REBOOT:
+        return "reboot";
+    case CMD_DFU:
+        return "dfu";
+    case CMD_DEBUG:
+        return "debug";
+    case CMD_CUSTOM:
+        return "custom";
+    case CMD_PORTS:
+        return "ports";
+    case CMD_SCRIPT:
+        return "script";
+    case CMD_DUMP:
+        return "dump";
+    case CMD_CAPS:
+        return "caps";
+    case CMD_STATUS:
+        return "status";
+    case CMD_WATCH:
+        return "watch";
+    case CMD_STATS:
+        return "stats";
+    case CMD_METRICS:
+        return "metrics";
+    default:
+        return NULL;
+    }
+}
+
+/// Run the whole connection check/unlock/DBMa/VDM/exit flow for a command.
+static IOReturn cli_send_vdm(HPMSession *session, cmd_t cmd, uint32_t const *words, int num_words)
+{
+    switch (cmd) {
+    case CMD_REBOOT:
+        return HPMSessionSendKnownVDM(session, kHPMKnownVDMReboot);
+    case CMD_DFU:
+        return HPMSessionSendKnownVDM(session, kHPMKnownVDMDFU);
+    case CMD_DEBUG:
+        return HPMSessionSendKnownVDM(session, kHPMKnownVDMDebugUSB);
+    case CMD_CUSTOM:
+        return HPMSessionSendVDM(session, words, num_words * sizeof(uint32_t));
+    default:
+        __builtin_unreachable();
+    }
+}
+
+/// Send a VDM on a port that is already in DBMa mode.
+static IOReturn cli_fire_vdm(HPMClient const *hpm, cmd_t cmd, uint32_t const *words, int num_words)
+{
+    switch (cmd) {
+    case CMD_REBOOT:
+        return HPMSendKnownVDM(hpm, 0, kHPMKnownVDMReboot);
+    case CMD_DFU:
+        return HPMSendKnownVDM(hpm, 0, kHPMKnownVDMDFU);
+    case CMD_DEBUG:
+        return HPMSendKnownVDM(hpm, 0, kHPMKnownVDMDebugUSB);
+    case CMD_CUSTOM:
+        return HPMSendVDM(hpm, 0, words, num_words * sizeof(uint32_t));
+    default:
+        __builtin_unreachable();
+    }
+}
+
+static uint64_t cli_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static double cli_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/// Wait for other invocations using the same port to finish.
+static IOReturn cli_lock_port(args_t const *args, int rid, port_lock_t *lock, char const **what)
+{
+    lock->map = NULL;
+    if (!args->use_lock)
+        return kIOReturnSuccess;
+
+    IOReturn ret = port_lock_acquire(lock, args->lock_path, rid, args->lock_timeout_ms, stderr);
+    if (ret == kIOReturnTimeout) {
+        *what = "Timed out waiting for other invocations using the port";
+    } else if (ret == kIOReturnBusy) {
+        *what = "Too many invocations waiting for the port";
+    } else if (ret != kIOReturnSuccess) {
+        // Not being able to coordinate is no reason not to do the job.
+        fprintf(stderr, "Warning: Failed to open port lock file %s. (%#x)\n", args->lock_path, ret);
+        ret = kIOReturnSuccess;
+    }
+
+    return ret;
+}
+
+typedef struct {
+    args_t const *args;
+    HPMSessionConfig config;
+    cmd_t cmd;
+    uint32_t const *words;
+    int num_words;
+    int wait;
+    uint32_t wait_timeout_ms;
+
+    /// Barrier all ports meet at before sending, with --sync.
+    spin_barrier_t *barrier;
+    int index;
+    int arrived;
+
+    int rid;
+    IOReturn ret;
+    char const *what;
+    double elapsed_ms;
+
+    /// When sending the VDM started and finished, with --sync.
+    uint64_t fired_ns;
+    uint64_t sent_ns;
+} port_job_t;
+
+/// Prepare the port, wait for all others to be ready too, then send.
+static IOReturn cli_fire_synced(port_job_t *job, HPMSession *session)
+{
+    IOReturn ret = HPMSessionCheckConnection(session);
+    if (ret == kIOReturnSuccess)
+        ret = HPMSessionEnterDBMA(session);
+
+    job->arrived = 1;
+    spin_barrier_wait(job->barrier);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    job->fired_ns = cli_now_ns();
+    ret = cli_fire_vdm(HPMSessionGetClient(session), job->cmd, job->words, job->num_words);
+    job->sent_ns = cli_now_ns();
+
+    if (ret != kIOReturnSuccess) {
+        job->what = "Failed to send VDM";
+        HPMSessionExitDBMA(session);
+        return ret;
+    }
+
+    return HPMSessionExitDBMA(session);
+}
+
+/// Run the whole open/unlock/DBMa/VDM/exit sequence for a single port.
+static void *cli_port_worker(void *arg)
+{
+    port_job_t *job = arg;
+    double start = cli_now_ms();
+
+    if (job->barrier)
+        thread_pin_to_cpu(job->index);
+
+    port_lock_t lock;
+    job->ret = cli_lock_port(job->args, job->rid, &lock, &job->what);
+    if (job->ret != kIOReturnSuccess)
+        goto done;
+
+    HPMSession *session = NULL;
+    job->ret = HPMSessionCreate(&job->config, &session);
+    if (job->ret != kIOReturnSuccess) {
+        job->what = HPMSessionStepGetDescription(kHPMSessionStepOpen);
+        port_lock_release(&lock);
+        goto done;
+    }
+
+    if (job->barrier)
+        job->ret = cli_fire_synced(job, session);
+    else
+        job->ret = cli_send_vdm(session, job->cmd, job->words, job->num_words);
+    if (job->ret == kIOReturnSuccess && job->wait)
+        job->ret = HPMSessionWaitForReattach(session, job->wait_timeout_ms);
+    if (job->ret != kIOReturnSuccess && !job->what)
+        job->what = cli_describe_failure(session, job->ret);
+
+    HPMSessionDestroy(session);
+    port_lock_release(&lock);
+
+done:
+    // The other ports can't go until every one has shown up.
+    if (job->barrier && !job->arrived)
+        spin_barrier_wait(job->barrier);
+
+    job->elapsed_ms = cli_now_ms() - start;
+    return NULL;
+}
+
+/// Send the same VDM to several ports at once, one thread per port.
+static int cli_fan_out(args_t const *args, HPMSessionConfig const *config, uint32_t const *words, int num_words)
+{
+    int32_t rids[kHPMMaxRIDs];
+    size_t num_rids = 0;
+    if (args->all_rids) {
+        IOReturn ret = HPMEnumerateRIDs(config->backend, rids, kHPMMaxRIDs, &num_rids);
+        if (ret != kIOReturnSuccess)
+            fatalf("Failed to enumerate HPM instances. (%#x)\n", ret);
+        if (!num_rids)
+            fatalf("No HPM instances found.\n");
+    } else {
+        for (int i = 0; i < args->num_rids; ++i)
+            rids[num_rids++] = args->rids[i];
+    }
+
+    port_job_t jobs[kHPMMaxRIDs];
+    pthread_t threads[kHPMMaxRIDs];
+    double start = cli_now_ms();
+
+    spin_barrier_t barrier;
+    spin_barrier_init(&barrier, (int)num_rids);
+
+    for (size_t i = 0; i < num_rids; ++i) {
+        jobs[i] = (port_job_t) {
+            .args = args,
+            .config = *config,
+            .cmd = args->cmd,
+            .words = words,
+            .num_words = num_words,
+            .wait = args->wait,
+            .wait_timeout_ms = args->wait_timeout_ms,
+            .barrier = args->sync ? &barrier : NULL,
+            .index = (int)i,
+            .rid = rids[i],
+        };
+        jobs[i].config.rid = rids[i];
+
+        if (pthread_create(&threads[i], NULL, cli_port_worker, &jobs[i]) != 0)
+            fatalf("Failed to start worker for RID %d.\n", rids[i]);
+    }
+
+    for (size_t i = 0; i < num_rids; ++i)
+        pthread_join(threads[i], NULL);
+    spin_barrier_destroy(&barrier);
+
+    // Skew is measured between the ports that got to send.
+    uint64_t first_fired = UINT64_MAX, last_fired = 0;
+    uint64_t first_sent = UINT64_MAX, last_sent = 0;
+    for (size_t i = 0; i < num_rids; ++i) {
+        if (!jobs[i].fired_ns)
+            continue;
+
+        first_fired = jobs[i].fired_ns < first_fired ? jobs[i].fired_ns : first_fired;
+        last_fired = jobs[i].fired_ns > last_fired ? jobs[i].fired_ns : last_fired;
+        first_sent = jobs[i].sent_ns < first_sent ? jobs[i].sent_ns : first_sent;
+        last_sent = jobs[i].sent_ns > last_sent ? jobs[i].sent_ns : last_sent;
+    }
+
+    int failures = 0;
+    for (size_t i = 0; i < num_rids; ++i) {
+        port_job_t const *job = &jobs[i];
+        if (job->ret != kIOReturnSuccess) {
+            printf("RID %d: %s. (%#x)\n", job->rid, job->what, job->ret);
+            ++failures;
+        } else if (job->fired_ns) {
+            printf("RID %d: OK (%.1f ms, sent at +%.1f us)\n", job->rid, job->elapsed_ms,
+                (job->fired_ns - first_fired) / 1e3);
+        } else {
+            printf("RID %d: OK (%.1f ms)\n", job->rid, job->elapsed_ms);
+        }
+    }
+
+    printf("%zu port(s), %d failed, %.1f ms total\n", num_rids, failures, cli_now_ms() - start);
+    if (last_fired)
+        printf("Skew: %.1f us between sends starting, %.1f us between them finishing\n",
+            (last_fired - first_fired) / 1e3, (last_sent - first_sent) / 1e3);
+    return failures ? 1 : 0;
+}
+
+#define CLI_DUMP_MAX_CHIPS 8
+#define CLI_DUMP_REGISTERS 256
+
+/// Print one register's contents as hex and ASCII, 16 bytes per line.
+static void cli_print_register(uint8_t address, HPMReadResult const *result)
+{
+    if (result->result != kIOReturnSuccess) {
+        printf("  %02x: (error %#x)\n", address, result->result);
         return;
+    }
+
+    size_t length = result->length < sizeof(result->reply) ? result->length : sizeof(result->reply);
+    for (size_t line = 0; line == 0 || line < length; line += 16) {
+        if (line == 0)
+            printf("  %02x:", address);
+        else
+            printf("     ");
+
+        char ascii[17] = { 0 };
+        for (size_t i = 0; i < 16; ++i) {
+            if (line + i < length) {
+                uint8_t byte = result->reply[line + i];
+                printf(" %02x", byte);
+                ascii[i] = byte >= 0x20 && byte < 0x7f ? (char)byte : '.';
+            } else {
+                printf("   ");
+            }
+        }
+
+        printf("  |%s|\n", ascii);
+    }
+}
+
+/// Snapshot the whole register space of one or more chips.
+static int cli_dump(HPMClient const *hpm, args_t const *args)
+{
+    uint64_t chips[CLI_DUMP_MAX_CHIPS] = { 0 };
+    int num_chips = args->num_rest ? 0 : 1;
+    for (int i = 0; i < args->num_rest && num_chips < CLI_DUMP_MAX_CHIPS; ++i)
+        if (!args_parse_int(args->rest[i], &chips[num_chips++]))
+            fatalf("Invalid chip '%s'.\n", args->rest[i]);
+
+    size_t count = (size_t)num_chips * CLI_DUMP_REGISTERS;
+    HPMReadRequest *requests = calloc(count, sizeof(*requests));
+    HPMReadResult *results = calloc(count, sizeof(*results));
+    if (!requests || !results)
+        fatalf("Out of memory.\n");
 
-    ret = HPMUnlockACE(hpm);
+    for (size_t i = 0; i < count; ++i) {
+        requests[i].chip = chips[i / CLI_DUMP_REGISTERS];
+        requests[i].address = (uint8_t)(i % CLI_DUMP_REGISTERS);
+    }
+
+    // Failures of individual registers are expected and shown inline.
+    double start = cli_now_ms();
+    HPMReadMany(hpm, requests, count, results, kHPMReadManyOptionParallelChips);
+    double elapsed = cli_now_ms() - start;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (i % CLI_DUMP_REGISTERS == 0)
+            printf("Chip %#llx:\n", (unsigned long long)requests[i].chip);
+
+        cli_print_register(requests[i].address, &results[i]);
+    }
+
+    printf("%zu registers in %.1f ms\n", count, elapsed);
+
+    free(requests);
+    free(results);
+    return 0;
+}
+
+/// Show what the connected device supports, probing it only if the cache
+/// doesn't know the device yet (or a refresh was asked for).
+static int cli_show_capabilities(HPMClient *hpm, args_t const *args)
+{
+    HPMDeviceIdentity identity;
+    IOReturn ret = HPMGetDeviceIdentity(hpm, &identity);
     if (ret != kIOReturnSuccess)
-        fatalf("Failed to unlock ACE. (%#x)\n", ret);
+        fatalf("Failed to identify device. (%#x)\n", ret);
+
+    printf("Device: %04x:%04x (bcdDevice %04x)\n", identity.vendorID, identity.productID, identity.bcdDevice);
 
-    ret = HPMDoCommand(hpm, 0, kHPMCommandDBMA, kHPMCommandArg1, 1, NULL);
+    // The cache is only an optimization; carry on without it.
+    char const *path = args->cache_path ? args->cache_path : CLI_DEFAULT_CACHE;
+    HPMCapabilityCache *cache = NULL;
+    ret = HPMCapabilityCacheOpen(path, &cache);
     if (ret != kIOReturnSuccess)
-        fatalf("Failed to request DBMa mode. (%#x)\n", ret);
+        fprintf(stderr, "Warning: Failed to open capability cache %s. (%#x)\n", path, ret);
+
+    int refresh = args->num_rest && strcmp(args->rest[0], "refresh") == 0;
 
-    ret = HPMGetMode(hpm, &mode);
+    HPMCapabilities caps;
+    int cached = 0;
+    ret = HPMGetCapabilities(hpm, refresh ? NULL : cache, &caps, &cached);
+    if (ret == kIOReturnSuccess && refresh && cache)
+        ret = HPMCapabilityCacheStore(cache, &identity, &caps);
+    if (cache)
+        HPMCapabilityCacheClose(cache);
     if (ret != kIOReturnSuccess)
-        fatalf("Failed to get HPM mode. (%#x)\n", ret);
-    if (mode != kHPMModeDBMA)
-        fatalf("Failed to switch to DBMa mode.\n");
+        fatalf("Failed to discover capabilities. (%#x)\n", ret);
+
+    printf("Source: %s\n", cached ? "cache" : "device");
+    printf("Known: %s%s%s\n", caps.capabilities & kHPMCapabilityReboot ? "reboot " : "",
+        caps.capabilities & kHPMCapabilityDFU ? "dfu " : "",
+        caps.capabilities & kHPMCapabilityDebugUSB ? "debug" : "");
+    for (uint32_t i = 0; i < caps.numActions; ++i)
+        printf("  Action %#06x: info %#010x\n", caps.actions[i], caps.actionInfo[i]);
+
+    return 0;
 }
 
-static void cli_exit_dbma_mode(HPMClient *hpm)
+static char const *s_trace_path = NULL;
+static HPMTraceFormat s_trace_format = kHPMTraceFormatChrome;
+
+/// Dump the trace on the way out; registered with atexit so that failed runs,
+/// which are the interesting ones, get traced too.
+static void cli_write_trace(void)
 {
-    HPMMode mode;
-    IOReturn ret = HPMDoCommand(hpm, 0, kHPMCommandDBMA, kHPMCommandArg0, 1, NULL);
+    FILE *file = fopen(s_trace_path, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to open %s. (%s)\n", s_trace_path, strerror(errno));
+        return;
+    }
+
+    IOReturn ret = HPMTraceExport(file, s_trace_format);
+    if (fclose(file) != 0 || ret != kIOReturnSuccess)
+        fprintf(stderr, "Failed to write trace to %s.\n", s_trace_path);
+}
+
+static int cli_list_ports(args_t const *args, HPMBackend const *backend)
+{
+    HPMServiceInfo services[kHPMMaxRIDs];
+    size_t num_services = 0;
+    IOReturn ret = HPMGetServices(backend, services, kHPMMaxRIDs, &num_services);
     if (ret != kIOReturnSuccess)
-        fatalf("Failed to request app mode. (%#X)\n", ret);
+        fatalf("Failed to enumerate HPM instances. (%#x)\n", ret);
+
+    printf("%-4s %-18s %-10s %-6s %s\n", "RID", "Registry ID", "Location", "Queue", "Name");
+    for (size_t i = 0; i < num_services; ++i) {
+        HPMServiceInfo const *info = &services[i];
+
+        char queue[16] = "-";
+        uint32_t depth = 0;
+        if (port_lock_get_depth(args->lock_path, info->rid, &depth) == kIOReturnSuccess)
+            snprintf(queue, sizeof(queue), "%u", depth);
+
+        printf("%-4d %#-18llx %-10s %-6s %s\n", info->rid, (unsigned long long)info->registryID,
+            info->location[0] ? info->location : "-", queue, info->name);
+    }
+
+    return 0;
+}
+
+static void cli_stop_recording(void)
+{
+    IOReturn ret = HPMRecordStop();
+    if (ret != kIOReturnSuccess)
+        fprintf(stderr, "Warning: Failed to write recording. (%#x)\n", ret);
+}
+
+/// Format the time since \p then, e.g. "1.2 s ago".
+static void cli_format_age(char *buf, size_t size, uint64_t now, uint64_t then)
+{
+    if (!then) {
+        snprintf(buf, size, "never");
+        return;
+    }
+
+    double ms = now > then ? (now - then) / 1e6 : 0;
+    if (ms < 1000)
+        snprintf(buf, size, "%.0f ms ago", ms);
+    else
+        snprintf(buf, size, "%.1f s ago", ms / 1000);
+}
+
+static int cli_show_status(args_t const *args)
+{
+    char const *name = args->status_table ? args->status_table : kHPMStatusTableDefaultName;
 
-    ret = HPMGetMode(hpm, &mode);
+    HPMStatusTable *table = NULL;
+    IOReturn ret = HPMStatusTableOpen(name, &table);
+    if (ret == kIOReturnNotFound)
+        fatalf("Nothing is publishing port status to %s; start vdmpokd with -p.\n", name);
     if (ret != kIOReturnSuccess)
-        fatalf("Failed to get HPM mode. (%#x)\n", ret);
-    if (mode == kHPMModeDBMA)
-        fatalf("Failed to switch to app mode.\n");
+        fatalf("Failed to open status table %s. (%#x)\n", name, ret);
+
+    uint64_t now = cli_now_ns();
+    printf("%-4s %-10s %-8s %-24s %-14s %s\n", "RID", "Connection", "Mode", "Last VDM", "Changed", "Updated");
+    for (int32_t rid = 0; rid < kHPMMaxRIDs; ++rid) {
+        HPMPortStatus status;
+        if (HPMStatusTableRead(table, rid, &status) != kIOReturnSuccess)
+            continue;
+
+        char vdm_age[24], changed[24], updated[24];
+        cli_format_age(vdm_age, sizeof(vdm_age), now, status.lastVDMAt);
+        cli_format_age(changed, sizeof(changed), now, status.changedAt);
+        cli_format_age(updated, sizeof(updated), now, status.updatedAt);
+
+        char const *connection = !status.present ? "gone"
+            : status.readResult != kIOReturnSuccess ? "error"
+                                                    : HPMConnectionTypeGetName(status.connection);
+        char const *mode = status.present && status.readResult == kIOReturnSuccess ? HPMModeGetName(status.mode) : "-";
+
+        char vdm[48] = "-";
+        if (status.lastVDMAt && status.lastVDMResult == kIOReturnSuccess)
+            snprintf(vdm, sizeof(vdm), "ok, %s", vdm_age);
+        else if (status.lastVDMAt)
+            snprintf(vdm, sizeof(vdm), "%#x, %s", status.lastVDMResult, vdm_age);
+
+        printf("%-4d %-10s %-8s %-24s %-14s %s\n", rid, connection, mode, vdm, changed, updated);
+    }
+
+    HPMStatusTableClose(table);
+    return 0;
+}
+
+/// Connect to vdmpokd; returns the socket, or -1 with errno set.
+static int cli_connect_to_daemon(char const *path)
+{
+    struct sockaddr_un addr = { 0 };
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+
+    return fd;
+}
+
+/// Hand the command off to vdmpokd, which already holds the port open.
+static int cli_forward_to_daemon(args_t const *args)
+{
+    int fd = cli_connect_to_daemon(args->socket);
+    if (fd < 0)
+        fatalf("Failed to connect to %s. (%s)\n", args->socket, strerror(errno));
+
+    char line[512];
+    int len = args->any_rid ? snprintf(line, sizeof(line), "%s %s", args->any_rid, cli_cmd_name(args->cmd))
+                            : snprintf(line, sizeof(line), "%d %s", args->rid, cli_cmd_name(args->cmd));
+    for (int i = 0; i < args->num_rest && len < (int)sizeof(line); ++i)
+        len += snprintf(line + len, sizeof(line) - len, " %s", args->rest[i]);
+    if (len >= (int)sizeof(line) - 1)
+        fatalf("Command is too long.\n");
+    line[len++] = '\n';
+
+    if (write(fd, line, len) != len)
+        fatalf("Failed to send command. (%s)\n", strerror(errno));
+
+    len = 0;
+    while (len < (int)sizeof(line) - 1) {
+        ssize_t n = read(fd, line + len, sizeof(line) - 1 - len);
+        if (n <= 0)
+            break;
+
+        len += (int)n;
+        if (memchr(line, '\n', len))
+            break;
+    }
+    close(fd);
+
+    line[len] = 0;
+    line[strcspn(line, "\n")] = 0;
+    if (strncmp(line, "ok", 2) != 0 || (line[2] != 0 && line[2] != ' '))
+        fatalf("Daemon: %s\n", len ? line : "no response");
+
+    // Requests for any port are answered with the one that was used.
+    if (line[2] == ' ')
+        printf("Ran on RID %s.\n", line + 3);
+
+    return 0;
+}
+
+static char const *s_stats_path = NULL;
+static char const *s_metrics_path = NULL;
+
+/// Add this run's latencies to the stats file; registered with atexit.
+static void cli_save_stats(void)
+{
+    IOReturn ret = HPMStatsSave(s_stats_path);
+    if (ret != kIOReturnSuccess)
+        fprintf(stderr, "Warning: Failed to save statistics to %s. (%#x)\n", s_stats_path, ret);
+}
+
+static void cli_write_metrics(void)
+{
+    IOReturn ret = HPMMetricsWriteFile(s_metrics_path);
+    if (ret != kIOReturnSuccess)
+        fprintf(stderr, "Warning: Failed to write metrics to %s. (%#x)\n", s_metrics_path, ret);
+}
+
+/// Send a request to vdmpokd whose reply has a body ahead of the reply line,
+/// e.g. 'stats'. Returns the body, to be freed, or NULL if the daemon can't be
+/// reached.
+static char *cli_query_daemon(char const *socket_path, char const *request)
+{
+    int fd = cli_connect_to_daemon(socket_path);
+    if (fd < 0)
+        return NULL;
+
+    // Hanging up our end makes the daemon close the connection once it has
+    // replied, so the reply can simply be read to the end.
+    size_t request_len = strlen(request);
+    if (write(fd, request, request_len) != (ssize_t)request_len || write(fd, "\n", 1) != 1
+        || shutdown(fd, SHUT_WR) != 0)
+        fatalf("Failed to send request to %s. (%s)\n", socket_path, strerror(errno));
+
+    size_t len = 0, capacity = 4096;
+    char *reply = NULL;
+    for (;;) {
+        if (!reply || len + 1 == capacity) {
+            if (reply)
+                capacity *= 2;
+            if (!(reply = realloc(reply, capacity)))
+                fatalf("Out of memory.\n");
+        }
+
+        ssize_t n = read(fd, reply + len, capacity - 1 - len);
+        if (n <= 0)
+            break;
+
+        len += n;
+    }
+    close(fd);
+
+    reply[len] = 0;
+    if (len && reply[len - 1] == '\n')
+        reply[--len] = 0;
+    char *status = strrchr(reply, '\n');
+    status = status ? status + 1 : reply;
+    if (strcmp(status, "ok") != 0)
+        fatalf("Daemon: %s\n", *status ? status : "no response");
+
+    *status = 0;
+    return reply;
+}
+
+/// Add vdmpokd's statistics to \p stats; returns zero if it can't be reached.
+static int cli_daemon_stats(char const *socket_path, HPMStats *stats)
+{
+    char *body = cli_query_daemon(socket_path, "stats");
+    if (!body)
+        return 0;
+
+    if (*body) {
+        FILE *file = fmemopen(body, strlen(body), "r");
+        if (!file || HPMStatsRead(stats, file) != kIOReturnSuccess)
+            fatalf("Daemon sent malformed statistics.\n");
+        fclose(file);
+    }
+
+    free(body);
+    return 1;
+}
+
+static int cli_show_metrics(args_t const *args)
+{
+    char const *socket_path = args->socket ? args->socket : CLI_DEFAULT_SOCKET;
+    char *body = cli_query_daemon(socket_path, "metrics");
+    if (!body)
+        fatalf("Failed to connect to %s. (%s)\n", socket_path, strerror(errno));
+
+    fputs(body, stdout);
+    free(body);
+    return 0;
+}
+
+static int cli_rid_selected(args_t const *args, int rid)
+{
+    if (args->all_rids || !args->num_rids)
+        return 1;
+
+    for (int i = 0; i < args->num_rids; ++i)
+        if (args->rids[i] == rid)
+            return 1;
+
+    return 0;
+}
+
+static void cli_print_histogram(char const *op, char const *rid, HPMHistogram const *h)
+{
+    printf("%-10s %-4s %8llu %7llu %10.3f %10.3f %10.3f %10.3f %10.3f\n", op, rid, (unsigned long long)h->count,
+        (unsigned long long)h->errors, (double)h->sum / (double)h->count / 1e6, HPMHistogramGetPercentile(h, 50) / 1e6,
+        HPMHistogramGetPercentile(h, 90) / 1e6, HPMHistogramGetPercentile(h, 99) / 1e6, h->max / 1e6);
+}
+
+static int cli_show_stats(args_t const *args)
+{
+    char const *path = args->stats_path;
+    char const *socket_path = args->socket ? args->socket : CLI_DEFAULT_SOCKET;
+
+    if (args->num_rest && strcmp(args->rest[0], "reset") == 0) {
+        if (path && unlink(path) != 0 && errno != ENOENT)
+            fatalf("Failed to remove %s. (%s)\n", path, strerror(errno));
+        char *body = cli_query_daemon(socket_path, "stats reset");
+        if (!body && args->socket)
+            fatalf("Failed to connect to %s. (%s)\n", socket_path, strerror(errno));
+
+        free(body);
+        return 0;
+    }
+
+    // About 160 KiB; keep it off the stack.
+    HPMStats *stats = calloc(1, sizeof(*stats));
+    if (!stats)
+        fatalf("Out of memory.\n");
+
+    FILE *file = path ? fopen(path, "r") : NULL;
+    if (file) {
+        if (HPMStatsRead(stats, file) != kIOReturnSuccess)
+            fatalf("%s is not a statistics file, or is from a different version.\n", path);
+        fclose(file);
+    }
+
+    // Only insist on reaching the daemon if asked to.
+    if (!cli_daemon_stats(socket_path, stats) && args->socket)
+        fatalf("Failed to connect to %s. (%s)\n", socket_path, strerror(errno));
+
+    printf("%-10s %-4s %8s %7s %10s %10s %10s %10s %10s\n", "Op", "RID", "Count", "Errors", "Avg (ms)", "P50 (ms)",
+        "P90 (ms)", "P99 (ms)", "Max (ms)");
+
+    for (int op = 0; op < kHPMStatsOpCount; ++op) {
+        HPMHistogram total = { 0 };
+        int num_rids = 0;
+        for (int rid = 0; rid < kHPMMaxRIDs; ++rid) {
+            HPMHistogram const *h = &stats->histograms[op][rid];
+            if (!h->count || !cli_rid_selected(args, rid))
+                continue;
+
+            char rid_str[8];
+            snprintf(rid_str, sizeof(rid_str), "%d", rid);
+            cli_print_histogram(HPMStatsOpGetName(op), rid_str, h);
+            HPMHistogramMerge(&total, h);
+            ++num_rids;
+        }
+
+        if (num_rids > 1)
+            cli_print_histogram(HPMStatsOpGetName(op), "all", &total);
+    }
+
+    free(stats);
+    return 0;
 }
 
 int main(int argc, char **argv)
@@ -162,55 +1180,213 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    uint32_t words[FLOW_MAX_VDM_WORDS] = { 0 };
+    int num_words = 0;
+    if (args.cmd == CMD_CUSTOM) {
+        num_words = flow_parse_vdm_words(args.rest, args.num_rest, words);
+        if (num_words < 0)
+            fatalf("Invalid VDM words; expected 1-%d hexadecimal words.\n", FLOW_MAX_VDM_WORDS);
+    }
+
+    // Scripts are compiled before touching the hardware at all, so a typo
+    // halfway through doesn't leave the port in DBMa mode.
+    script_t script = { 0 };
+    if (args.cmd == CMD_SCRIPT) {
+        char const *path = args.num_rest ? args.rest[0] : "-";
+        FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+        if (!file)
+            fatalf("Failed to open %s. (%s)\n", path, strerror(errno));
+
+        char err[128];
+        if (!script_compile(file, &script, err, sizeof(err)))
+            fatalf("%s: %s.\n", path, err);
+        if (file != stdin)
+            fclose(file);
+    }
+
+    // The status table is all in memory, so neither a backend nor root is
+    // needed to read it.
+    if (args.cmd == CMD_STATUS)
+        return cli_show_status(&args);
+    if (args.cmd == CMD_STATS)
+        return cli_show_stats(&args);
+    if (args.cmd == CMD_METRICS)
+        return cli_show_metrics(&args);
+
+    // Only the daemon knows which ports are free.
+    if (args.any_rid && (!args.socket || args.cmd == CMD_PORTS))
+        fatalf("'%s' can only be used to forward a command with -S.\n", args.any_rid);
+
+    int fan_out = args.all_rids || args.num_rids > 1;
+    if (args.socket && args.cmd != CMD_PORTS) {
+        if (fan_out)
+            fatalf("Multiple RIDs cannot be combined with -S.\n");
+        if (args.cmd == CMD_SCRIPT || args.cmd == CMD_DUMP || args.cmd == CMD_CAPS || args.cmd == CMD_WATCH)
+            fatalf("%s cannot be combined with -S.\n", cli_cmd_name(args.cmd));
+        if (args.wait)
+            fatalf("--wait cannot be combined with -S.\n");
+
+        return cli_forward_to_daemon(&args);
+    }
+
+    HPMBackend const *backend = HPMGetDefaultBackend();
+    if (args.backend && flow_select_backend(args.backend, &backend) != kIOReturnSuccess)
+        fatalf("Unknown or unavailable backend '%s'.\n", args.backend);
+
+    if (args.replay_path) {
+        if (args.backend)
+            fatalf("--replay cannot be combined with -B.\n");
+
+        HPMReplayConfig replay = { .timeScale = args.replay_scale };
+        IOReturn ret = HPMReplayLoad(args.replay_path, &replay);
+        if (ret != kIOReturnSuccess)
+            fatalf("Failed to load %s for replay. (%#x)\n", args.replay_path, ret);
+
+        backend = HPMGetReplayBackend();
+    }
+
+    if (args.trace_path && args.trace_binary) {
+        IOReturn ret = HPMTraceEnableFile(args.trace_path, args.trace_capacity);
+        if (ret != kIOReturnSuccess)
+            fatalf("Failed to trace to %s. (%#x)\n", args.trace_path, ret);
+    } else if (args.trace_path) {
+        s_trace_path = args.trace_path;
+        s_trace_format = args.trace_format;
+        if (HPMTraceEnable(CLI_TRACE_CAPACITY) != kIOReturnSuccess)
+            fatalf("Failed to enable tracing.\n");
+
+        atexit(cli_write_trace);
+    }
+
+    if (args.stats_path) {
+        s_stats_path = args.stats_path;
+        atexit(cli_save_stats);
+    }
+
+    if (args.metrics_path) {
+        s_metrics_path = args.metrics_path;
+        atexit(cli_write_metrics);
+    }
+
+    // Shared by all ports; freed on exit.
+    HPMRetryPolicy *retry_policy = NULL;
+    if (flow_create_retry_policy(args.retries, &retry_policy) != kIOReturnSuccess)
+        fatalf("Failed to create retry policy.\n");
+
+    // Listing ports only looks at the registry, which anyone may do.
+    if (args.cmd == CMD_PORTS)
+        return cli_list_ports(&args, backend);
+
     // Attempting to open a AppleHPMUserClient later will fail if the tool is
     // not running as root, or has the USB-C entitlement; the former is easier.
-    if (geteuid() != 0)
+    if (backend == HPMGetIOKitBackend() && geteuid() != 0)
         fatalf("Error: Tool must run with root permissions! See help command for more info.\n");
 
-    HPMClient hpm;
-    IOReturn ret = HPMClientOpen(&hpm, args.rid);
+    if (args.record_path) {
+        IOReturn ret = HPMRecordStart(backend, args.record_path, &backend);
+        if (ret != kIOReturnSuccess)
+            fatalf("Failed to start recording to %s. (%#x)\n", args.record_path, ret);
+
+        atexit(cli_stop_recording);
+    }
+
+    // Watching only reads status registers, so it doesn't queue for ports.
+    if (args.cmd == CMD_WATCH) {
+        watch_config_t watch = {
+            .backend = backend,
+            .num_rids = args.all_rids ? 0 : args.num_rids,
+            .rids = args.rids,
+            .max_poll_ms = args.poll_max_ms,
+        };
+        watch_run(&watch, stdout);
+        return 0;
+    }
+
+    HPMSessionConfig config = {
+        .backend = backend,
+        .rid = args.rid,
+        .options = args.stay_in_dbma ? kHPMClientOptionStayInDBMA : 0,
+        .modeTimeoutMs = args.mode_timeout_ms,
+        .retryPolicy = retry_policy,
+    };
+
+    if (args.sync && !fan_out)
+        fatalf("--sync needs several RIDs.\n");
+
+    if (fan_out) {
+        if (args.cmd == CMD_SCRIPT || args.cmd == CMD_DUMP || args.cmd == CMD_CAPS)
+            fatalf("%s can only target a single RID.\n", cli_cmd_name(args.cmd));
+
+        return cli_fan_out(&args, &config, words, num_words);
+    }
+
+    // Held until exit; if we die, waiters notice and skip over us.
+    port_lock_t lock;
+    char const *what = NULL;
+    IOReturn ret = cli_lock_port(&args, args.rid, &lock, &what);
+    if (ret != kIOReturnSuccess)
+        fatalf("%s. (%#x)\n", what, ret);
+
+    HPMSession *session = NULL;
+    ret = HPMSessionCreate(&config, &session);
     if (ret != kIOReturnSuccess)
         fatalf("Failed to open HPM client for RID %d. (%#x)\n", args.rid, ret);
 
-    HPMConnectionType connType = HPMGetConnectionType(&hpm);
-    if (connType == kHPMConnectionTypeError)
-        fatalf("Failed to get connection type.\n");
-    if (connType == kHPMConnectionTypeNone)
+    HPMClient *hpm = HPMSessionGetClient(session);
+
+    // Registers can be read in any mode, so there is no need to set up DBMa.
+    if (args.cmd == CMD_DUMP) {
+        int status = cli_dump(hpm, &args);
+        HPMSessionDestroy(session);
+        port_lock_release(&lock);
+        return status;
+    }
+
+    ret = HPMSessionCheckConnection(session);
+    if (ret == kIOReturnNoDevice)
         fatalf("No connection found; is a device connected to port %d?\n", args.rid);
+    if (ret != kIOReturnSuccess)
+        fatalf("%s. (%#x)\n", cli_describe_failure(session, ret), ret);
+
+    if (args.cmd == CMD_CAPS) {
+        int status = cli_show_capabilities(hpm, &args);
+        HPMSessionDestroy(session);
+        port_lock_release(&lock);
+        return status;
+    }
 
-    cli_enter_dbma_mode(&hpm);
+    if (args.cmd == CMD_SCRIPT) {
+        cli_enter_dbma_mode(session);
 
-    switch (args.cmd) {
-    case CMD_REBOOT:
-        ret = HPMSendKnownVDM(&hpm, 0, kHPMKnownVDMReboot);
-        break;
-    case CMD_DFU:
-        ret = HPMSendKnownVDM(&hpm, 0, kHPMKnownVDMDFU);
-        break;
-    case CMD_DEBUG:
-        ret = HPMSendKnownVDM(&hpm, 0, kHPMKnownVDMDebugUSB);
-        break;
-    case CMD_CUSTOM: {
-        int num_words = 0;
-        uint32_t words[8] = { 0 };
-        for (int i = 0; i < args.num_rest; ++i) {
-            uint32_t word = (uint32_t)strtol(args.rest[i], NULL, 16);
-            words[i] = word;
-            ++num_words;
+        size_t failed_op = 0;
+        ret = script_run(hpm, &script, stdout, &failed_op);
+        if (ret != kIOReturnSuccess) {
+            // Still try to leave the port in app mode before bailing.
+            cli_exit_dbma_mode(session);
+            fatalf("Script failed on line %d. (%#x)\n", script.ops[failed_op].line, ret);
         }
 
-        ret = HPMSendVDM(&hpm, 0, words, num_words);
-        break;
-    }
-    default:
-        __builtin_unreachable();
+        script_free(&script);
+        cli_exit_dbma_mode(session);
+    } else {
+        ret = cli_send_vdm(session, args.cmd, words, num_words);
+        if (ret != kIOReturnSuccess)
+            fatalf("%s. (%#x)\n", cli_describe_failure(session, ret), ret);
     }
 
-    if (ret != kIOReturnSuccess)
-        fatalf("Failed to send VDM. (%#x)\n", ret);
+    if (args.wait) {
+        double start = cli_now_ms();
+        ret = HPMSessionWaitForReattach(session, args.wait_timeout_ms);
+        if (ret == kIOReturnTimeout)
+            fatalf("Device did not re-attach within %u ms.\n", args.wait_timeout_ms);
+        if (ret != kIOReturnSuccess)
+            fatalf("Failed to wait for device to re-attach. (%#x)\n", ret);
+
+        printf("Device re-attached after %.1f ms.\n", cli_now_ms() - start);
+    }
 
-    cli_exit_dbma_mode(&hpm);
-    HPMClientClose(&hpm);
+    HPMSessionDestroy(session);
+    port_lock_release(&lock);
 
     return 0;
 }
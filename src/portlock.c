@@ -0,0 +1,203 @@
+//
+//  portlock.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "portlock.h"
+
+#include "HPMFile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PORT_LOCK_MAGIC 0x4b4c5056 // 'VPLK'
+#define PORT_LOCK_MAX_RIDS kHPMMaxRIDs
+
+/// Owner of a ticket that gave up waiting.
+#define PORT_LOCK_ABANDONED (-1)
+
+typedef struct {
+    atomic_uint next_ticket;
+    atomic_uint now_serving;
+
+    /// PID owning each ticket in flight, indexed by ticket modulo the size.
+    atomic_int owners[PORT_LOCK_MAX_WAITERS];
+} port_lock_slot_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t num_rids;
+    port_lock_slot_t slots[PORT_LOCK_MAX_RIDS];
+} port_lock_file_t;
+
+static IOReturn port_lock_map(char const *path, int *fd_out, port_lock_file_t **map_out)
+{
+    // Anyone else able to write the file could forge or stall tickets.
+    int fd = HPMOpenStateFile(path, O_RDWR | O_CREAT);
+    if (fd < 0)
+        return kIOReturnNotPermitted;
+
+    // Initializing is the only time the file is written outside of the
+    // atomics, which is why it happens under the file lock.
+    struct stat st;
+    flock(fd, LOCK_EX);
+    int ok = fstat(fd, &st) == 0;
+    if (ok && (size_t)st.st_size != sizeof(port_lock_file_t))
+        ok = ftruncate(fd, 0) == 0 && ftruncate(fd, sizeof(port_lock_file_t)) == 0;
+
+    port_lock_file_t *map = ok
+        ? mmap(NULL, sizeof(port_lock_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+        : MAP_FAILED;
+    if (map != MAP_FAILED && map->magic != PORT_LOCK_MAGIC) {
+        memset(map, 0, sizeof(*map));
+        map->num_rids = PORT_LOCK_MAX_RIDS;
+        map->magic = PORT_LOCK_MAGIC;
+    }
+    flock(fd, LOCK_UN);
+
+    if (map == MAP_FAILED) {
+        close(fd);
+        return kIOReturnIOError;
+    }
+
+    *fd_out = fd;
+    *map_out = map;
+    return kIOReturnSuccess;
+}
+
+static void port_lock_unmap(int fd, port_lock_file_t *map)
+{
+    munmap(map, sizeof(*map));
+    close(fd);
+}
+
+static int port_lock_owner_alive(int pid)
+{
+    return pid > 0 && (kill(pid, 0) == 0 || errno == EPERM);
+}
+
+/// Move past the ticket being served if nobody is going to use it.
+static void port_lock_skip_dead(port_lock_slot_t *slot, uint32_t serving)
+{
+    atomic_int *owner = &slot->owners[serving % PORT_LOCK_MAX_WAITERS];
+    int pid = atomic_load(owner);
+    if (pid != PORT_LOCK_ABANDONED && port_lock_owner_alive(pid))
+        return;
+
+    if (atomic_compare_exchange_strong(&slot->now_serving, &serving, serving + 1))
+        atomic_compare_exchange_strong(owner, &pid, 0);
+}
+
+static uint64_t port_lock_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+IOReturn port_lock_acquire(port_lock_t *lock, char const *path, int rid, uint32_t timeout_ms, FILE *log)
+{
+    lock->fd = -1;
+    lock->map = NULL;
+    lock->rid = rid;
+    if (rid < 0 || rid >= PORT_LOCK_MAX_RIDS)
+        return kIOReturnSuccess;
+
+    int fd;
+    port_lock_file_t *map;
+    IOReturn ret = port_lock_map(path, &fd, &map);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    port_lock_slot_t *slot = &map->slots[rid];
+
+    // Taking a ticket and recording its owner have to happen together, or a
+    // crash in between would leave a ticket nobody can tell is dead.
+    flock(fd, LOCK_EX);
+    uint32_t serving = atomic_load(&slot->now_serving);
+    uint32_t ticket = atomic_load(&slot->next_ticket);
+    if (ticket - serving >= PORT_LOCK_MAX_WAITERS) {
+        flock(fd, LOCK_UN);
+        port_lock_unmap(fd, map);
+        return kIOReturnBusy;
+    }
+    atomic_store(&slot->owners[ticket % PORT_LOCK_MAX_WAITERS], (int)getpid());
+    atomic_store(&slot->next_ticket, ticket + 1);
+    flock(fd, LOCK_UN);
+
+    if (ticket != serving && log)
+        fprintf(log, "RID %d: Waiting for %u earlier invocation(s) to finish...\n", rid, ticket - serving);
+
+    uint64_t deadline = port_lock_now_ms() + timeout_ms;
+    useconds_t backoff_us = 500;
+    while ((serving = atomic_load(&slot->now_serving)) != ticket) {
+        port_lock_skip_dead(slot, serving);
+
+        if (port_lock_now_ms() >= deadline) {
+            // Leave the ticket for the others to skip; if it came up in the
+            // meantime, pass it straight on instead.
+            atomic_store(&slot->owners[ticket % PORT_LOCK_MAX_WAITERS], PORT_LOCK_ABANDONED);
+            port_lock_skip_dead(slot, ticket);
+            port_lock_unmap(fd, map);
+            return kIOReturnTimeout;
+        }
+
+        usleep(backoff_us);
+        if (backoff_us < 20000)
+            backoff_us *= 2;
+    }
+
+    lock->fd = fd;
+    lock->map = map;
+    lock->ticket = ticket;
+    return kIOReturnSuccess;
+}
+
+void port_lock_release(port_lock_t *lock)
+{
+    if (!lock->map)
+        return;
+
+    port_lock_file_t *map = lock->map;
+    port_lock_slot_t *slot = &map->slots[lock->rid];
+
+    atomic_store(&slot->owners[lock->ticket % PORT_LOCK_MAX_WAITERS], 0);
+    uint32_t ticket = lock->ticket;
+    atomic_compare_exchange_strong(&slot->now_serving, &ticket, lock->ticket + 1);
+
+    port_lock_unmap(lock->fd, map);
+    lock->fd = -1;
+    lock->map = NULL;
+}
+
+IOReturn port_lock_get_depth(char const *path, int rid, uint32_t *depth)
+{
+    *depth = 0;
+    if (rid < 0 || rid >= PORT_LOCK_MAX_RIDS)
+        return kIOReturnSuccess;
+
+    int fd;
+    port_lock_file_t *map;
+    IOReturn ret = port_lock_map(path, &fd, &map);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    port_lock_slot_t *slot = &map->slots[rid];
+    *depth = atomic_load(&slot->next_ticket) - atomic_load(&slot->now_serving);
+
+    port_lock_unmap(fd, map);
+    return kIOReturnSuccess;
+}
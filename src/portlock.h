@@ -0,0 +1,52 @@
+//
+//  portlock.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMFraud.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Cross-process, per-RID locks, so that concurrent vdmpoke invocations on the
+// same port take turns instead of interleaving their mode switches.
+//
+// Each port has a ticket lock in a small shared file: a waiter takes the next
+// ticket and waits for it to be served, so ports are handed out in arrival
+// order. Tickets held or queued by processes that have since died, and those
+// given up after a timeout, are skipped.
+
+/// Default location of the shared lock file. It must be owned by the user
+/// running vdmpoke (normally root) and writable by nobody else, so it belongs
+/// in a directory only root can write to.
+#define PORT_LOCK_DEFAULT_PATH "/var/run/vdmpoke-ports.lock"
+
+/// Maximum number of invocations that can queue for a single port.
+#define PORT_LOCK_MAX_WAITERS 64
+
+typedef struct {
+    int fd;
+    void *map;
+    int rid;
+    uint32_t ticket;
+} port_lock_t;
+
+/// Wait for exclusive use of a port.
+///
+/// If the port is busy, a line saying how many invocations are ahead is
+/// written to \p log (unless NULL). Returns kIOReturnTimeout if the port was
+/// not handed over within \p timeout_ms, and kIOReturnBusy if the queue is
+/// full. RIDs beyond those the lock file tracks are not locked.
+IOReturn port_lock_acquire(port_lock_t *lock, char const *path, int rid, uint32_t timeout_ms, FILE *log);
+
+/// Hand a port acquired with port_lock_acquire over to the next waiter.
+void port_lock_release(port_lock_t *lock);
+
+/// Get the number of invocations holding or waiting for a port.
+IOReturn port_lock_get_depth(char const *path, int rid, uint32_t *depth);
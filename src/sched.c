@@ -0,0 +1,356 @@
+//
+//  sched.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "sched.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Each queue is a doubly linked list behind a mutex rather than a lock-free
+// deque: jobs take milliseconds (a VDM round trip at the very least), so the
+// locks are never contended long enough to matter, and thieves need to look
+// past jobs they can't run, which lock-free deques don't allow.
+
+typedef struct {
+    sched_t *sched;
+    int rid;
+    pthread_t thread;
+
+    /// Guards the queue and wakeup state; the worker sleeps on \p wake.
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    sched_job_t *head;
+    sched_job_t *tail;
+    uint64_t wakeups;
+    int stopping;
+
+    // Read without the lock, to place and steal jobs.
+    atomic_size_t queued;    ///< Jobs in the queue.
+    atomic_size_t num_any;   ///< Affinity-free jobs in the queue.
+    atomic_int busy;         ///< Whether a job is running.
+    atomic_uint port_class;  ///< Class last reported for the port.
+} worker_t;
+
+struct sched {
+    sched_config_t config;
+    atomic_uint next_worker; ///< Where placement starts looking, to spread ties.
+    atomic_size_t num_any;   ///< Affinity-free jobs queued anywhere.
+    int num_started;
+    worker_t workers[];
+};
+
+static uint64_t sched_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int sched_class_matches(uint32_t port_class, uint32_t job_class)
+{
+    return port_class != SCHED_NO_CLASS && (job_class == SCHED_ANY_CLASS || job_class == port_class);
+}
+
+/// Append a job to a worker's queue; the worker's lock must be held.
+static void worker_push(worker_t *w, sched_job_t *job)
+{
+    job->prev = w->tail;
+    job->next = NULL;
+    if (w->tail)
+        w->tail->next = job;
+    else
+        w->head = job;
+    w->tail = job;
+
+    atomic_fetch_add_explicit(&w->queued, 1, memory_order_relaxed);
+    if (job->rid == SCHED_ANY_RID) {
+        atomic_fetch_add_explicit(&w->num_any, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&w->sched->num_any, 1, memory_order_relaxed);
+    }
+}
+
+/// Remove a job from a worker's queue; the worker's lock must be held.
+static void worker_unlink(worker_t *w, sched_job_t *job)
+{
+    if (job->prev)
+        job->prev->next = job->next;
+    else
+        w->head = job->next;
+    if (job->next)
+        job->next->prev = job->prev;
+    else
+        w->tail = job->prev;
+    job->prev = job->next = NULL;
+
+    atomic_fetch_sub_explicit(&w->queued, 1, memory_order_relaxed);
+    if (job->rid == SCHED_ANY_RID) {
+        atomic_fetch_sub_explicit(&w->num_any, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&w->sched->num_any, 1, memory_order_relaxed);
+    }
+}
+
+/// Make a worker look at its queue again; the worker's lock must be held.
+static void worker_wake_locked(worker_t *w)
+{
+    ++w->wakeups;
+    pthread_cond_signal(&w->wake);
+}
+
+static void worker_wake(worker_t *w)
+{
+    pthread_mutex_lock(&w->lock);
+    worker_wake_locked(w);
+    pthread_mutex_unlock(&w->lock);
+}
+
+static uint32_t worker_classify(worker_t *w)
+{
+    sched_t *s = w->sched;
+    uint32_t port_class = s->config.classify(w->rid, s->config.ctx);
+    atomic_store_explicit(&w->port_class, port_class, memory_order_relaxed);
+    return port_class;
+}
+
+/// Take the first job in a worker's own queue that it can run. Affinity-free
+/// jobs it can't run are left for other workers to steal, unless they have
+/// waited too long, in which case they are moved to \p expired.
+static sched_job_t *worker_take_own(worker_t *w, uint32_t port_class, sched_job_t **expired)
+{
+    sched_t *s = w->sched;
+    uint64_t timeout_ns = (uint64_t)s->config.timeout_ms * 1000000;
+    uint64_t now = sched_now_ns();
+
+    pthread_mutex_lock(&w->lock);
+    sched_job_t *job = w->head;
+    while (job) {
+        sched_job_t *next = job->next;
+        if (job->rid != SCHED_ANY_RID || sched_class_matches(port_class, job->job_class))
+            break;
+
+        if (now - job->queued_at >= timeout_ns) {
+            worker_unlink(w, job);
+            job->next = *expired;
+            *expired = job;
+        }
+
+        job = next;
+    }
+
+    if (job)
+        worker_unlink(w, job);
+    pthread_mutex_unlock(&w->lock);
+
+    return job;
+}
+
+/// Take an affinity-free job from another worker's queue. Each victim's
+/// oldest eligible job is taken, so these run roughly in submission order.
+static sched_job_t *worker_steal(worker_t *w, uint32_t port_class)
+{
+    sched_t *s = w->sched;
+    int n = s->config.num_workers;
+    for (int i = 1; i < n; ++i) {
+        worker_t *victim = &s->workers[(w->rid + i) % n];
+        if (!atomic_load_explicit(&victim->num_any, memory_order_relaxed))
+            continue;
+
+        pthread_mutex_lock(&victim->lock);
+        sched_job_t *job = victim->head;
+        while (job && !(job->rid == SCHED_ANY_RID && sched_class_matches(port_class, job->job_class)))
+            job = job->next;
+        if (job)
+            worker_unlink(victim, job);
+        pthread_mutex_unlock(&victim->lock);
+
+        if (job)
+            return job;
+    }
+
+    return NULL;
+}
+
+static void *worker_main(void *arg)
+{
+    worker_t *w = arg;
+    sched_t *s = w->sched;
+
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        int stopping = w->stopping;
+        uint64_t seen = w->wakeups;
+        pthread_mutex_unlock(&w->lock);
+        if (stopping)
+            break;
+
+        // Only look at the port if there are affinity-free jobs about, so
+        // workers with nothing but port-bound jobs never pay for it.
+        uint32_t port_class = SCHED_NO_CLASS;
+        int classified = 0;
+        if (atomic_load_explicit(&w->num_any, memory_order_relaxed)) {
+            port_class = worker_classify(w);
+            classified = 1;
+        }
+
+        sched_job_t *expired = NULL;
+        sched_job_t *job = worker_take_own(w, port_class, &expired);
+        while (expired) {
+            sched_job_t *next = expired->next;
+            s->config.cancel(expired, kIOReturnTimeout, s->config.ctx);
+            expired = next;
+        }
+
+        if (!job && atomic_load_explicit(&s->num_any, memory_order_relaxed)) {
+            if (!classified)
+                port_class = worker_classify(w);
+            if (port_class != SCHED_NO_CLASS)
+                job = worker_steal(w, port_class);
+        }
+
+        if (job) {
+            atomic_store_explicit(&w->busy, 1, memory_order_relaxed);
+            s->config.run(job, w->rid, s->config.ctx);
+            atomic_store_explicit(&w->busy, 0, memory_order_relaxed);
+            continue;
+        }
+
+        pthread_mutex_lock(&w->lock);
+        if (!w->stopping && w->wakeups == seen) {
+            // While affinity-free jobs are waiting, check back now and then:
+            // the port may have become eligible, or the jobs may have expired.
+            if (atomic_load_explicit(&s->num_any, memory_order_relaxed)) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += SCHED_IDLE_POLL_MS / 1000;
+                deadline.tv_nsec += (long)(SCHED_IDLE_POLL_MS % 1000) * 1000000;
+                if (deadline.tv_nsec >= 1000000000) {
+                    deadline.tv_sec += 1;
+                    deadline.tv_nsec -= 1000000000;
+                }
+
+                pthread_cond_timedwait(&w->wake, &w->lock, &deadline);
+            } else {
+                pthread_cond_wait(&w->wake, &w->lock);
+            }
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    return NULL;
+}
+
+/// Pick the worker to queue an affinity-free job with: the least loaded of
+/// those whose port last matched the job's class, or of all of them if none
+/// did. Stealing evens out any misjudgement later.
+static worker_t *sched_place(sched_t *s, sched_job_t const *job)
+{
+    int n = s->config.num_workers;
+    unsigned start = atomic_fetch_add_explicit(&s->next_worker, 1, memory_order_relaxed);
+
+    worker_t *best = NULL;
+    int best_match = 0;
+    size_t best_load = 0;
+    for (int i = 0; i < n; ++i) {
+        worker_t *w = &s->workers[(start + i) % n];
+        uint32_t port_class = atomic_load_explicit(&w->port_class, memory_order_relaxed);
+        int match = sched_class_matches(port_class, job->job_class);
+        size_t load = atomic_load_explicit(&w->queued, memory_order_relaxed)
+            + atomic_load_explicit(&w->busy, memory_order_relaxed);
+
+        if (!best || match > best_match || (match == best_match && load < best_load)) {
+            best = w;
+            best_match = match;
+            best_load = load;
+        }
+    }
+
+    return best;
+}
+
+IOReturn sched_submit(sched_t *sched, sched_job_t *job)
+{
+    int n = sched->config.num_workers;
+    if (job->rid != SCHED_ANY_RID && (job->rid < 0 || job->rid >= n))
+        return kIOReturnBadArgument;
+
+    job->queued_at = sched_now_ns();
+    worker_t *w = job->rid == SCHED_ANY_RID ? sched_place(sched, job) : &sched->workers[job->rid];
+
+    pthread_mutex_lock(&w->lock);
+    worker_push(w, job);
+    worker_wake_locked(w);
+    pthread_mutex_unlock(&w->lock);
+
+    // Any idle worker might be the one to run it.
+    if (job->rid == SCHED_ANY_RID)
+        for (int i = 0; i < n; ++i)
+            if (&sched->workers[i] != w && !atomic_load_explicit(&sched->workers[i].busy, memory_order_relaxed))
+                worker_wake(&sched->workers[i]);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn sched_create(sched_config_t const *config, sched_t **out)
+{
+    if (config->num_workers <= 0)
+        return kIOReturnBadArgument;
+
+    sched_t *s = calloc(1, sizeof(*s) + config->num_workers * sizeof(worker_t));
+    if (!s)
+        return kIOReturnNoMemory;
+
+    s->config = *config;
+    for (int i = 0; i < config->num_workers; ++i) {
+        worker_t *w = &s->workers[i];
+        w->sched = s;
+        w->rid = i;
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->wake, NULL);
+        atomic_init(&w->port_class, SCHED_NO_CLASS);
+    }
+
+    for (; s->num_started < config->num_workers; ++s->num_started) {
+        worker_t *w = &s->workers[s->num_started];
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            sched_destroy(s);
+            return kIOReturnNoResources;
+        }
+    }
+
+    *out = s;
+    return kIOReturnSuccess;
+}
+
+void sched_destroy(sched_t *sched)
+{
+    for (int i = 0; i < sched->num_started; ++i) {
+        worker_t *w = &sched->workers[i];
+        pthread_mutex_lock(&w->lock);
+        w->stopping = 1;
+        worker_wake_locked(w);
+        pthread_mutex_unlock(&w->lock);
+    }
+    for (int i = 0; i < sched->num_started; ++i)
+        pthread_join(sched->workers[i].thread, NULL);
+
+    for (int i = 0; i < sched->config.num_workers; ++i) {
+        worker_t *w = &sched->workers[i];
+        while (w->head) {
+            sched_job_t *job = w->head;
+            worker_unlink(w, job);
+            sched->config.cancel(job, kIOReturnAborted, sched->config.ctx);
+        }
+
+        pthread_cond_destroy(&w->wake);
+        pthread_mutex_destroy(&w->lock);
+    }
+
+    free(sched);
+}
@@ -0,0 +1,89 @@
+//
+//  sched.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMFraud.h"
+
+#include <stdint.h>
+
+// Work-stealing scheduler for jobs that run on ports. Every RID gets a worker
+// thread with a queue of its own, so a slow or backed-up port never holds up
+// the others.
+//
+// Jobs bound to a port always run on that port's worker, in the order they
+// were submitted. Affinity-free jobs may run on any port of the right class
+// (e.g. any port with a device of some model attached); they are queued with
+// a worker that looks likely to get to them first, and workers that run out
+// of jobs of their own take them from the queues of busy workers. A host is
+// thus kept busy as long as there is work any of its ports could do.
+
+/// RID of jobs that may run on any port of their class.
+#define SCHED_ANY_RID (-1)
+
+/// Job class matching every port that can take affinity-free jobs.
+#define SCHED_ANY_CLASS 0
+
+/// Port class of a port that can't take affinity-free jobs right now.
+#define SCHED_NO_CLASS UINT32_MAX
+
+/// How long idle workers go without checking for changes while affinity-free
+/// jobs are waiting, in milliseconds.
+#define SCHED_IDLE_POLL_MS 1000
+
+typedef struct sched_job sched_job_t;
+
+/// A unit of work, typically embedded at the start of a larger structure.
+struct sched_job {
+    int rid;            ///< Port to run on, or SCHED_ANY_RID.
+    uint32_t job_class; ///< Port class an affinity-free job needs, or SCHED_ANY_CLASS.
+
+    // Managed by the scheduler.
+    uint64_t queued_at;
+    sched_job_t *prev;
+    sched_job_t *next;
+};
+
+typedef struct {
+    /// Number of workers, for RIDs 0 through num_workers - 1.
+    int num_workers;
+
+    /// Run \p job on the worker for \p rid.
+    void (*run)(sched_job_t *job, int rid, void *ctx);
+
+    /// Get the class of the port for \p rid, or SCHED_NO_CLASS if it can't
+    /// take affinity-free jobs, e.g. because nothing is attached.
+    ///
+    /// Called on the port's own worker whenever it looks for affinity-free
+    /// jobs, so it may touch the port, but should cache its answer.
+    uint32_t (*classify)(int rid, void *ctx);
+
+    /// Give up on a job that never ran; \p reason is kIOReturnTimeout for an
+    /// affinity-free job no port took in time, or kIOReturnAborted for jobs
+    /// still queued when the scheduler is destroyed.
+    void (*cancel)(sched_job_t *job, IOReturn reason, void *ctx);
+
+    /// How long affinity-free jobs may wait for a port, in milliseconds.
+    uint32_t timeout_ms;
+
+    void *ctx;
+} sched_config_t;
+
+typedef struct sched sched_t;
+
+/// Start a worker for each port.
+IOReturn sched_create(sched_config_t const *config, sched_t **out);
+
+/// Queue a job; it is handed back through the config's run or cancel.
+///
+/// Returns kIOReturnBadArgument if the job is bound to a RID without a worker.
+IOReturn sched_submit(sched_t *sched, sched_job_t *job);
+
+/// Wait for running jobs to finish, cancel queued ones and stop the workers.
+void sched_destroy(sched_t *sched);
@@ -0,0 +1,180 @@
+//
+//  script.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "script.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SCRIPT_MAX_TOKENS (1 + FLOW_MAX_VDM_WORDS)
+
+static int script_parse_u64(char const *str, uint64_t max, uint64_t *out)
+{
+    char *end = NULL;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 0);
+    if (errno == ERANGE || end == str || *end != 0 || value > max)
+        return 0;
+
+    *out = value;
+    return 1;
+}
+
+static int script_parse_line(int num_tokens, char **tokens, script_op_t *op)
+{
+    char const *name = tokens[0];
+    uint64_t value = 0;
+
+    if (flow_parse_known_vdm(name, &op->known)) {
+        op->kind = SCRIPT_OP_KNOWN;
+        return num_tokens == 1;
+    }
+
+    if (strcmp(name, "custom") == 0) {
+        op->kind = SCRIPT_OP_CUSTOM;
+        op->num_words = flow_parse_vdm_words((char const *const *)tokens + 1, num_tokens - 1, op->words);
+        return op->num_words > 0;
+    }
+
+    if (strcmp(name, "read") == 0) {
+        op->kind = SCRIPT_OP_READ;
+        if (num_tokens < 3 || num_tokens > 4)
+            return 0;
+        if (!script_parse_u64(tokens[1], UINT64_MAX, &op->chip))
+            return 0;
+        if (!script_parse_u64(tokens[2], UINT8_MAX, &value))
+            return 0;
+        op->address = (uint8_t)value;
+
+        value = 0;
+        if (num_tokens == 4 && !script_parse_u64(tokens[3], UINT32_MAX, &value))
+            return 0;
+        op->flags = (uint32_t)value;
+        return 1;
+    }
+
+    if (strcmp(name, "delay") == 0) {
+        op->kind = SCRIPT_OP_DELAY;
+        if (num_tokens != 2 || !script_parse_u64(tokens[1], UINT32_MAX, &value))
+            return 0;
+
+        op->delay_ms = (uint32_t)value;
+        return 1;
+    }
+
+    return 0;
+}
+
+int script_compile(FILE *file, script_t *script, char *err, size_t err_size)
+{
+    memset(script, 0, sizeof(*script));
+
+    char line[512];
+    for (int line_num = 1; fgets(line, sizeof(line), file); ++line_num) {
+        if (!strchr(line, '\n') && !feof(file)) {
+            snprintf(err, err_size, "Line %d is too long", line_num);
+            goto fail;
+        }
+
+        line[strcspn(line, "#")] = 0;
+
+        char *tokens[SCRIPT_MAX_TOKENS + 1];
+        int num_tokens = 0;
+        for (char *tok = strtok(line, " \t\r\n"); tok && num_tokens <= SCRIPT_MAX_TOKENS; tok = strtok(NULL, " \t\r\n"))
+            tokens[num_tokens++] = tok;
+        if (!num_tokens)
+            continue;
+
+        script_op_t op = { .line = line_num };
+        if (num_tokens > SCRIPT_MAX_TOKENS || !script_parse_line(num_tokens, tokens, &op)) {
+            snprintf(err, err_size, "Invalid operation on line %d", line_num);
+            goto fail;
+        }
+
+        if (script->num_ops == script->cap_ops) {
+            size_t cap = script->cap_ops ? script->cap_ops * 2 : 32;
+            script_op_t *ops = realloc(script->ops, cap * sizeof(*ops));
+            if (!ops) {
+                snprintf(err, err_size, "Out of memory");
+                goto fail;
+            }
+
+            script->ops = ops;
+            script->cap_ops = cap;
+        }
+
+        script->ops[script->num_ops++] = op;
+    }
+
+    if (ferror(file)) {
+        snprintf(err, err_size, "Failed to read script");
+        goto fail;
+    }
+
+    return 1;
+
+fail:
+    script_free(script);
+    return 0;
+}
+
+void script_free(script_t *script)
+{
+    free(script->ops);
+    memset(script, 0, sizeof(*script));
+}
+
+static void script_sleep_ms(uint32_t ms)
+{
+    struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+IOReturn script_run(HPMClient const *hpm, script_t const *script, FILE *out, size_t *failed_op)
+{
+    for (size_t i = 0; i < script->num_ops; ++i) {
+        script_op_t const *op = &script->ops[i];
+
+        IOReturn ret = kIOReturnSuccess;
+        switch (op->kind) {
+        case SCRIPT_OP_KNOWN:
+            ret = HPMSendKnownVDM(hpm, 0, op->known);
+            break;
+        case SCRIPT_OP_CUSTOM:
+            ret = HPMSendVDM(hpm, 0, op->words, op->num_words * sizeof(uint32_t));
+            break;
+        case SCRIPT_OP_READ: {
+            HPMReply reply;
+            size_t length = 0;
+            ret = HPMRead(hpm, op->chip, op->address, op->flags, reply, &length);
+            if (ret != kIOReturnSuccess)
+                break;
+
+            fprintf(out, "%d: read %#llx %#04x:", op->line, (unsigned long long)op->chip, op->address);
+            for (size_t j = 0; j < length && j < sizeof(reply); ++j)
+                fprintf(out, " %02x", reply[j]);
+            fputc('\n', out);
+            break;
+        }
+        case SCRIPT_OP_DELAY:
+            script_sleep_ms(op->delay_ms);
+            break;
+        }
+
+        if (ret != kIOReturnSuccess) {
+            *failed_op = i;
+            return ret;
+        }
+    }
+
+    return kIOReturnSuccess;
+}
@@ -0,0 +1,66 @@
+//
+//  script.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMFraud.h"
+#include "flow.h"
+
+#include <stdio.h>
+
+// Scripts are plain text with one operation per line; blank lines and
+// everything after a '#' are ignored. Recognized operations are:
+//
+//     list | reboot | dfu | debug      Send a known VDM
+//     custom <word>...                 Send a custom VDM (hexadecimal words)
+//     read <chip> <address> [<flags>]  Read and print a register
+//     delay <ms>                       Sleep for a number of milliseconds
+
+typedef enum {
+    SCRIPT_OP_KNOWN,
+    SCRIPT_OP_CUSTOM,
+    SCRIPT_OP_READ,
+    SCRIPT_OP_DELAY,
+} script_op_kind_t;
+
+typedef struct {
+    script_op_kind_t kind;
+    int line;
+
+    HPMKnownVDM known;
+    int num_words;
+    uint32_t words[FLOW_MAX_VDM_WORDS];
+
+    uint64_t chip;
+    uint8_t address;
+    uint32_t flags;
+
+    uint32_t delay_ms;
+} script_op_t;
+
+typedef struct {
+    size_t num_ops;
+    size_t cap_ops;
+    script_op_t *ops;
+} script_t;
+
+/// Parse a whole script up front.
+///
+/// On failure, a description of the problem (including the line number) is
+/// written to \p err and zero is returned.
+int script_compile(FILE *file, script_t *script, char *err, size_t err_size);
+
+/// Release a compiled script.
+void script_free(script_t *script);
+
+/// Run a compiled script against a client that is already in DBMa mode.
+///
+/// Register reads are printed to \p out. Execution stops at the first failed
+/// operation, whose index is stored to \p failed_op.
+IOReturn script_run(HPMClient const *hpm, script_t const *script, FILE *out, size_t *failed_op);
@@ -0,0 +1,251 @@
+//
+//  trace.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "HPMStats.h"
+#include "HPMTrace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Reader for binary trace files, as written by HPMTraceEnableFile. The file
+// is mapped rather than read, and events are decoded one at a time in a
+// single pass, so memory use stays flat no matter how large the trace is.
+
+#define fatalf(...)                   \
+    do {                              \
+        fprintf(stderr, __VA_ARGS__); \
+        exit(1);                      \
+    } while (0)
+
+typedef struct {
+    int summary;
+    int errors_only;
+    int op;
+    int rid;
+    uint64_t min_ns;
+    uint64_t limit;
+    char const *path;
+} args_t;
+
+static void usage(char const *prog)
+{
+    printf("Usage: %s [-s] [-o <op>] [-r <rid>] [-e] [-m <us>] [-n <count>] <file>\n\n", prog);
+
+    puts("Options:");
+    puts("  -s                    Summarize durations per operation instead of listing events");
+    puts("  -o <op>               Only include this operation, e.g. 'send-vdm'");
+    puts("  -r <rid>              Only include events for this RID");
+    puts("  -e                    Only include failed operations");
+    puts("  -m <us>               Only include operations taking at least this long");
+    puts("  -n <count>            Stop after listing this many events");
+    puts("  -h                    Show this usage info\n");
+
+    puts("Reads binary traces written by 'vdmpoke --trace-format binary' or 'vdmpokd -t'.");
+}
+
+static uint64_t parse_uint(char const *str, char const *what)
+{
+    char *end = NULL;
+    errno = 0;
+    unsigned long long value = strtoull(str, &end, 0);
+    if (end == str || *end != 0 || errno != 0)
+        fatalf("Invalid %s '%s'.\n", what, str);
+
+    return value;
+}
+
+static int parse_op(char const *name)
+{
+    for (int op = 0; op < kHPMTraceOpCount; ++op)
+        if (strcmp(HPMTraceOpGetName(op), name) == 0)
+            return op;
+
+    fprintf(stderr, "Unknown operation '%s'; expected one of:", name);
+    for (int op = 0; op < kHPMTraceOpCount; ++op)
+        fprintf(stderr, " %s", HPMTraceOpGetName(op));
+    fatalf("\n");
+}
+
+static void args_parse(args_t *args, int argc, char **argv)
+{
+    args->summary = 0;
+    args->errors_only = 0;
+    args->op = -1;
+    args->rid = -1;
+    args->min_ns = 0;
+    args->limit = UINT64_MAX;
+    args->path = NULL;
+
+    int opt_char = 0;
+    while ((opt_char = getopt(argc, argv, "so:r:em:n:h")) != -1) {
+        switch (opt_char) {
+        case 's':
+            args->summary = 1;
+            break;
+        case 'o':
+            args->op = parse_op(optarg);
+            break;
+        case 'r':
+            args->rid = (int)parse_uint(optarg, "RID");
+            break;
+        case 'e':
+            args->errors_only = 1;
+            break;
+        case 'm':
+            args->min_ns = parse_uint(optarg, "duration") * 1000;
+            break;
+        case 'n':
+            args->limit = parse_uint(optarg, "count");
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    args->path = argv[optind];
+}
+
+static int matches(args_t const *args, HPMTraceEvent const *e)
+{
+    return (args->op < 0 || (int)e->op == args->op) && (args->rid < 0 || e->rid == args->rid)
+        && (!args->errors_only || e->result != kIOReturnSuccess) && e->duration >= args->min_ns;
+}
+
+static void print_summary(HPMHistogram const *summaries)
+{
+    printf("%-12s %10s %8s %10s %10s %10s %10s %10s\n", "Op", "Count", "Errors", "Min (us)", "Avg (us)",
+        "P50 (us)", "P99 (us)", "Max (us)");
+
+    for (int op = 0; op < kHPMTraceOpCount; ++op) {
+        HPMHistogram const *s = &summaries[op];
+        if (!s->count)
+            continue;
+
+        printf("%-12s %10" PRIu64 " %8" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f\n", HPMTraceOpGetName(op),
+            s->count, s->errors, s->min / 1000.0, (double)s->sum / (double)s->count / 1000.0,
+            HPMHistogramGetPercentile(s, 50) / 1000.0, HPMHistogramGetPercentile(s, 99) / 1000.0, s->max / 1000.0);
+    }
+}
+
+static void print_event(HPMTraceFileHeader const *header, HPMTraceEvent const *e)
+{
+    uint64_t ns = e->start + (uint64_t)header->realtimeOffset;
+    time_t sec = (time_t)(ns / 1000000000);
+    struct tm tm;
+    char time_str[32];
+    strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", localtime_r(&sec, &tm));
+
+    printf("%s.%06u  %-11s %3d %4" PRIu64 " %#10x %#6x %6u %#10x %13.1f\n", time_str,
+        (unsigned)(ns % 1000000000 / 1000), HPMTraceOpGetName(e->op), e->rid, e->chip, e->arg, e->flags, e->length,
+        e->result, e->duration / 1000.0);
+}
+
+int main(int argc, char **argv)
+{
+    args_t args;
+    args_parse(&args, argc, argv);
+
+    int fd = open(args.path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        fatalf("Failed to open %s. (%s)\n", args.path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(HPMTraceFileHeader))
+        fatalf("%s is not a trace file.\n", args.path);
+
+    size_t size = (size_t)st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        fatalf("Failed to map %s. (%s)\n", args.path, strerror(errno));
+    close(fd);
+
+    HPMTraceFileHeader const *header = map;
+    if (header->magic != kHPMTraceFileMagic)
+        fatalf("%s is not a trace file.\n", args.path);
+    if (header->version != kHPMTraceFileVersion || header->recordSize != sizeof(HPMTraceFileRecord))
+        fatalf("%s is from an incompatible version (%u).\n", args.path, header->version);
+
+    uint64_t capacity = header->capacity;
+    if (!capacity || (capacity & (capacity - 1)) || capacity > (size - sizeof(*header)) / sizeof(HPMTraceFileRecord))
+        fatalf("%s is truncated or corrupt.\n", args.path);
+
+    // Pages are only ever touched once, in order.
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    HPMTraceFileRecord const *records = (HPMTraceFileRecord const *)(header + 1);
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > capacity ? head - capacity : 0;
+
+    if (!args.summary)
+        printf("%-26s  %-11s %3s %4s %10s %6s %6s %10s %13s\n", "Time", "Op", "RID", "Chip", "Arg", "Flags", "Length",
+            "Result", "Duration (us)");
+
+    // Durations are summarized in the same histograms as the library's own
+    // statistics, so memory use stays fixed.
+    static HPMHistogram summaries[kHPMTraceOpCount];
+    uint64_t listed = 0;
+    uint64_t skipped = 0;
+    for (uint64_t i = first; i < head && listed < args.limit; ++i) {
+        HPMTraceFileRecord const *record = &records[i & (capacity - 1)];
+
+        // Other processes may still be appending; skip records that are being
+        // written or that get overwritten while being copied.
+        HPMTraceEvent event;
+        if (__atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) != i + 1) {
+            ++skipped;
+            continue;
+        }
+        memcpy(&event, &record->event, sizeof(event));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&record->seq, __ATOMIC_RELAXED) != i + 1) {
+            ++skipped;
+            continue;
+        }
+
+        if (event.op >= kHPMTraceOpCount || !matches(&args, &event))
+            continue;
+
+        if (args.summary) {
+            HPMHistogramRecord(&summaries[event.op], event.duration, event.result);
+        } else {
+            print_event(header, &event);
+            ++listed;
+        }
+    }
+
+    if (args.summary) {
+        printf("%" PRIu64 " events in trace, %" PRIu64 " recorded in total (capacity %" PRIu64 ")\n\n",
+            head - first - skipped, head, capacity);
+        print_summary(summaries);
+    }
+
+    if (skipped)
+        fprintf(stderr, "Skipped %" PRIu64 " events being written during the read.\n", skipped);
+
+    munmap(map, size);
+    return 0;
+}
@@ -0,0 +1,876 @@
+//
+//  vdmpokd.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "HPMDiscovery.h"
+#include "HPMFraud.h"
+#include "HPMMetrics.h"
+#include "HPMSession.h"
+#include "HPMStats.h"
+#include "HPMStatusTable.h"
+#include "HPMTrace.h"
+#include "flow.h"
+#include "sched.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Long-running companion to vdmpoke. Each port is opened, unlocked and moved
+// to DBMa mode the first time it is used, then left that way, so subsequent
+// requests for the same RID cost a single VDM round trip.
+//
+// Requests are newline-terminated lines of the form
+//
+//     <rid> <command> [<arg>...]
+//
+// where <command> is one of 'list', 'reboot', 'dfu', 'debug', 'custom' (with
+// hexadecimal words following), or 'release' to return the port to app mode
+// and close it. A bare 'ping' line checks that the daemon is alive. Every
+// request gets exactly one response line: either 'ok', or 'error <code>
+// <message>' where <code> is the IOReturn in hexadecimal.
+//
+// In place of a RID, 'any' runs the command on whichever port with a device
+// attached gets to it first, and 'any:<pid>' on whichever port with a device
+// of that USB product ID (in hexadecimal) does. The response to these names
+// the port used, as 'ok <rid>' or 'error <code> RID <rid>: <message>'; if no
+// suitable port takes one within -a milliseconds, it fails with
+// kIOReturnTimeout.
+//
+// Every port has a worker thread and job queue of its own (see sched.h), so
+// requests for different ports run in parallel, and requests for the same
+// port run in the order received. Clients may pipeline any number of
+// requests; responses always come back in the order the requests were sent.
+//
+// A bare 'stats' line is answered with the daemon's latency statistics in the
+// format written by HPMStatsWrite, followed by the response line; 'stats
+// reset' clears them. Likewise, 'metrics' is answered with the daemon's
+// counters and histograms in the OpenMetrics text format.
+//
+// With -p, the status of every port is also published to a shared memory
+// table (see HPMStatusTable.h) for monitoring tools to read without touching
+// the hardware themselves. A background thread refreshes it every -i
+// milliseconds, and straight away whenever the backend reports a change.
+
+#define fatalf(...)                   \
+    do {                              \
+        fprintf(stderr, __VA_ARGS__); \
+        exit(1);                      \
+    } while (0)
+
+#define DEFAULT_SOCKET_PATH "/var/run/vdmpokd.sock"
+
+#define DEFAULT_ANY_TIMEOUT_MS 60000
+#define PROBE_MAX_AGE_MS 5000
+#define TRACE_CAPACITY (1 << 20)
+#define MAX_CONNS 16
+#define MAX_LINE 512
+#define MAX_PENDING_OUTPUT (1 << 20)
+#define MAX_TOKENS (2 + FLOW_MAX_VDM_WORDS)
+
+/// Scheduler class of ports with a device of the given USB product ID.
+#define PORT_CLASS(pid) (0x10000u | (uint32_t)(pid))
+
+/// An open port; each is only ever used by the port's own worker.
+typedef struct {
+    int active;
+    HPMSession *session;
+} session_t;
+
+/// What a worker last found attached to its port.
+typedef struct {
+    int probed;
+    uint64_t generation;
+    uint64_t probed_at;
+    uint32_t port_class;
+} port_t;
+
+enum {
+    JOB_PENDING,
+    JOB_DONE,     ///< Has a response, to be sent by the main thread.
+    JOB_ORPHANED, ///< Its client went away; freed by whoever completes it.
+};
+
+typedef struct job {
+    sched_job_t base;
+    struct job *next; ///< Next job on the same connection, in request order.
+    atomic_int state;
+
+    // Request, parsed by the main thread before the job is queued.
+    int release;
+    HPMKnownVDM known;
+    int num_words;
+    uint32_t words[FLOW_MAX_VDM_WORDS];
+
+    // Outcome, filled in by whoever completes the job.
+    int ran_on;
+    IOReturn ret;
+    char const *what;
+    char *body;
+    size_t body_len;
+} job_t;
+
+typedef struct {
+    int fd;
+    int eof;
+    size_t len;
+    char buf[MAX_LINE];
+
+    /// Jobs awaiting a response, in request order.
+    job_t *head;
+    job_t *tail;
+
+    /// Responses the client hasn't read yet. Requests stop being read while
+    /// there are more than MAX_PENDING_OUTPUT bytes of them.
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+} conn_t;
+
+static HPMBackend const *s_backend = NULL;
+static HPMRetryPolicy *s_retry_policy = NULL;
+static session_t s_sessions[kHPMMaxRIDs];
+static port_t s_ports[kHPMMaxRIDs];
+static sched_t *s_sched = NULL;
+static int s_wake_fds[2] = { -1, -1 };
+static HPMStatusTable *s_status_table = NULL;
+static char const *s_metrics_path = NULL;
+static uint32_t s_status_interval_ms = 1000;
+static volatile sig_atomic_t s_should_exit = 0;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    s_should_exit = 1;
+
+    // Whichever thread takes the signal, get the main thread out of poll. If
+    // the pipe is full, it is due to wake up anyway.
+    int saved_errno = errno;
+    char byte = 0;
+    ssize_t written = write(s_wake_fds[1], &byte, 1);
+    (void)written;
+    errno = saved_errno;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/// Get the session for a RID, bringing the port up if this is its first use.
+static IOReturn session_acquire(int rid, session_t **out, char const **what)
+{
+    session_t *session = &s_sessions[rid];
+    if (session->active) {
+        *out = session;
+        return kIOReturnSuccess;
+    }
+
+    // Sessions stay in DBMa mode until explicitly released.
+    HPMSessionConfig config = {
+        .backend = s_backend,
+        .rid = rid,
+        .options = kHPMClientOptionStayInDBMA,
+        .retryPolicy = s_retry_policy,
+    };
+
+    IOReturn ret = HPMSessionCreate(&config, &session->session);
+    if (ret != kIOReturnSuccess) {
+        *what = HPMSessionStepGetDescription(kHPMSessionStepOpen);
+        return ret;
+    }
+
+    ret = HPMSessionCheckConnection(session->session);
+    if (ret == kIOReturnSuccess)
+        ret = HPMSessionEnterDBMA(session->session);
+    if (ret != kIOReturnSuccess) {
+        *what = HPMSessionStepGetDescription(HPMSessionGetFailedStep(session->session));
+        HPMSessionDestroy(session->session);
+        return ret;
+    }
+
+    session->active = 1;
+    *out = session;
+    return kIOReturnSuccess;
+}
+
+static IOReturn session_release(session_t *session, char const **what)
+{
+    HPMSessionSetOptions(session->session, 0);
+    IOReturn ret = HPMSessionExitDBMA(session->session);
+    if (ret != kIOReturnSuccess)
+        *what = HPMSessionStepGetDescription(HPMSessionGetFailedStep(session->session));
+
+    HPMSessionDestroy(session->session);
+    session->active = 0;
+    return ret;
+}
+
+static IOReturn session_send(int rid, job_t const *job, char const **what)
+{
+    session_t *session = NULL;
+    IOReturn ret = session_acquire(rid, &session, what);
+    if (ret != kIOReturnSuccess)
+        return ret;
+
+    if (job->num_words)
+        ret = HPMSessionSendVDM(session->session, job->words, job->num_words * sizeof(uint32_t));
+    else
+        ret = HPMSessionSendKnownVDM(session->session, job->known);
+    if (s_status_table)
+        HPMStatusTableRecordVDM(s_status_table, (int32_t)rid, ret);
+
+    if (ret != kIOReturnSuccess) {
+        *what = HPMSessionStepGetDescription(HPMSessionGetFailedStep(session->session));
+
+        // The port may have been reset underneath us; start from scratch on
+        // the next request rather than trusting the cached session, or what
+        // we thought was attached.
+        char const *ignored = NULL;
+        session_release(session, &ignored);
+        s_ports[rid].probed = 0;
+    }
+
+    return ret;
+}
+
+/// Get the scheduler class of a port: PORT_CLASS of the attached device's
+/// product ID, or SCHED_NO_CLASS if nothing answers. Runs on the port's
+/// worker; the answer is kept until the backend reports a change, or for
+/// PROBE_MAX_AGE_MS, whichever comes first.
+static uint32_t port_classify(int rid, void *ctx)
+{
+    (void)ctx;
+
+    port_t *port = &s_ports[rid];
+    uint64_t generation = HPMGetChangeGeneration(s_backend);
+    uint64_t now = now_ms();
+    if (port->probed && port->generation == generation && now - port->probed_at < PROBE_MAX_AGE_MS)
+        return port->port_class;
+
+    port->probed = 1;
+    port->generation = generation;
+    port->probed_at = now;
+    port->port_class = SCHED_NO_CLASS;
+
+    // Don't count opening ports that don't exist as backend errors.
+    HPMServiceInfo info;
+    if (HPMLookupService(s_backend, rid, &info) != kIOReturnSuccess)
+        return port->port_class;
+
+    // Identity can be read in any mode, so an open session is reused as is.
+    HPMClient client;
+    HPMClient *hpm = &client;
+    if (s_sessions[rid].active)
+        hpm = HPMSessionGetClient(s_sessions[rid].session);
+    else if (HPMClientOpenWithBackend(&client, s_backend, rid) != kIOReturnSuccess)
+        return port->port_class;
+
+    HPMDeviceIdentity identity;
+    if (HPMGetDeviceIdentity(hpm, &identity) == kIOReturnSuccess)
+        port->port_class = PORT_CLASS(identity.productID);
+    if (hpm == &client)
+        HPMClientClose(&client);
+
+    return port->port_class;
+}
+
+static void job_free(job_t *job)
+{
+    free(job->body);
+    free(job);
+}
+
+/// Hand a job's outcome to the main thread, from a worker.
+static void job_complete(job_t *job)
+{
+    if (atomic_exchange(&job->state, JOB_DONE) == JOB_ORPHANED) {
+        job_free(job);
+        return;
+    }
+
+    // The pipe is non-blocking; if it is full, the main thread is due to
+    // wake up anyway.
+    char byte = 0;
+    if (write(s_wake_fds[1], &byte, 1) != 1)
+        return;
+}
+
+static void job_run(sched_job_t *base, int rid, void *ctx)
+{
+    (void)ctx;
+
+    job_t *job = (job_t *)base;
+    job->ran_on = rid;
+    if (job->release)
+        job->ret = s_sessions[rid].active ? session_release(&s_sessions[rid], &job->what) : kIOReturnSuccess;
+    else
+        job->ret = session_send(rid, job, &job->what);
+
+    job_complete(job);
+}
+
+static void job_cancel(sched_job_t *base, IOReturn reason, void *ctx)
+{
+    (void)ctx;
+
+    job_t *job = (job_t *)base;
+    job->ret = reason;
+    job->what = reason == kIOReturnTimeout ? "No suitable port became available" : "Daemon is shutting down";
+    job_complete(job);
+}
+
+static IOReturn write_stats(FILE *file)
+{
+    // Only the main thread answers 'stats', so this can be reused.
+    static HPMStats s_stats;
+    memset(&s_stats, 0, sizeof(s_stats));
+    HPMStatsCollect(&s_stats);
+    return HPMStatsWrite(&s_stats, file);
+}
+
+/// Keep the output of \p writer to send ahead of the job's response line.
+static IOReturn job_capture(job_t *job, IOReturn (*writer)(FILE *file), char const **what)
+{
+    FILE *file = open_memstream(&job->body, &job->body_len);
+    if (!file) {
+        *what = "Out of memory";
+        return kIOReturnNoMemory;
+    }
+
+    IOReturn ret = writer(file);
+    fclose(file);
+    if (ret != kIOReturnSuccess) {
+        job->body_len = 0;
+        *what = "Failed to produce reply";
+    }
+
+    return ret;
+}
+
+/// Parse the RID field of a request, which may also be 'any' or
+/// 'any:<pid>'; returns zero if it is malformed.
+static int parse_target(char const *str, sched_job_t *job)
+{
+    char *end = NULL;
+    if (strcmp(str, "any") == 0) {
+        job->rid = SCHED_ANY_RID;
+        job->job_class = SCHED_ANY_CLASS;
+        return 1;
+    }
+    if (strncmp(str, "any:", 4) == 0) {
+        unsigned long pid = strtoul(str + 4, &end, 16);
+        if (end == str + 4 || *end != 0 || pid > UINT16_MAX)
+            return 0;
+
+        job->rid = SCHED_ANY_RID;
+        job->job_class = PORT_CLASS(pid);
+        return 1;
+    }
+
+    long rid = strtol(str, &end, 0);
+    if (end == str || *end != 0 || rid < 0 || rid >= kHPMMaxRIDs)
+        return 0;
+
+    job->rid = (int)rid;
+    return 1;
+}
+
+/// Handle a request, either straight away or by queueing \p job for a port's
+/// worker, in which case \p queued is set and the job must not be touched
+/// again.
+static IOReturn handle_request(job_t *job, int num_tokens, char **tokens, int *queued, char const **what)
+{
+    if (num_tokens == 1 && strcmp(tokens[0], "ping") == 0)
+        return kIOReturnSuccess;
+    if (num_tokens == 1 && strcmp(tokens[0], "stats") == 0)
+        return job_capture(job, write_stats, what);
+    if (num_tokens == 1 && strcmp(tokens[0], "metrics") == 0)
+        return job_capture(job, HPMMetricsWrite, what);
+    if (num_tokens == 2 && strcmp(tokens[0], "stats") == 0 && strcmp(tokens[1], "reset") == 0) {
+        HPMStatsReset();
+        return kIOReturnSuccess;
+    }
+
+    if (num_tokens < 2 || !parse_target(tokens[0], &job->base)) {
+        *what = "Malformed request";
+        return kIOReturnBadArgument;
+    }
+
+    char const *cmd = tokens[1];
+    if (strcmp(cmd, "release") == 0) {
+        if (job->base.rid == SCHED_ANY_RID) {
+            *what = "Only specific ports can be released";
+            return kIOReturnBadArgument;
+        }
+
+        job->release = 1;
+    } else if (strcmp(cmd, "custom") == 0) {
+        job->num_words = flow_parse_vdm_words((char const *const *)tokens + 2, num_tokens - 2, job->words);
+        if (job->num_words < 0) {
+            *what = "Invalid VDM words";
+            return kIOReturnBadArgument;
+        }
+    } else if (!flow_parse_known_vdm(cmd, &job->known)) {
+        *what = "Unknown command";
+        return kIOReturnUnsupported;
+    }
+
+    IOReturn ret = sched_submit(s_sched, &job->base);
+    if (ret != kIOReturnSuccess) {
+        *what = "Failed to queue request";
+        return ret;
+    }
+
+    *queued = 1;
+    return kIOReturnSuccess;
+}
+
+/// Queue up the response to a line; returns zero if out of memory.
+static int handle_line(conn_t *conn, char *line)
+{
+    job_t *job = calloc(1, sizeof(*job));
+    if (!job)
+        return 0;
+
+    job->ran_on = -1;
+    atomic_init(&job->state, JOB_PENDING);
+    if (conn->tail)
+        conn->tail->next = job;
+    else
+        conn->head = job;
+    conn->tail = job;
+
+    char *tokens[MAX_TOKENS];
+    int num_tokens = 0;
+    for (char *tok = strtok(line, " \t\r"); tok; tok = strtok(NULL, " \t\r")) {
+        if (num_tokens == MAX_TOKENS) {
+            num_tokens = 0;
+            break;
+        }
+
+        tokens[num_tokens++] = tok;
+    }
+
+    int queued = 0;
+    char const *what = "Malformed request";
+    IOReturn ret = num_tokens ? handle_request(job, num_tokens, tokens, &queued, &what) : kIOReturnBadArgument;
+    if (!queued) {
+        job->ret = ret;
+        job->what = what;
+        atomic_store(&job->state, JOB_DONE);
+    }
+
+    return 1;
+}
+
+/// Append to a connection's output; returns zero if out of memory.
+static int conn_queue(conn_t *conn, void const *data, size_t len)
+{
+    if (conn->out_len + len > conn->out_cap) {
+        size_t cap = conn->out_cap ? conn->out_cap : MAX_LINE;
+        while (cap < conn->out_len + len)
+            cap *= 2;
+
+        char *out = realloc(conn->out, cap);
+        if (!out)
+            return 0;
+
+        conn->out = out;
+        conn->out_cap = cap;
+    }
+
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+    return 1;
+}
+
+/// Write as much pending output as the client will take without blocking;
+/// returns zero if the connection is broken.
+static int conn_send(conn_t *conn)
+{
+    size_t sent = 0;
+    while (sent < conn->out_len) {
+        ssize_t n = write(conn->fd, conn->out + sent, conn->out_len - sent);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            return 0;
+        }
+
+        sent += n;
+    }
+
+    memmove(conn->out, conn->out + sent, conn->out_len - sent);
+    conn->out_len -= sent;
+    return 1;
+}
+
+/// Queue a job's response; returns zero if out of memory.
+static int job_respond(conn_t *conn, job_t const *job)
+{
+    if (job->body_len && !conn_queue(conn, job->body, job->body_len))
+        return 0;
+
+    char reply[MAX_LINE];
+    int any = job->base.rid == SCHED_ANY_RID && job->ran_on >= 0;
+    int len;
+    if (job->ret == kIOReturnSuccess)
+        len = any ? snprintf(reply, sizeof(reply), "ok %d\n", job->ran_on) : snprintf(reply, sizeof(reply), "ok\n");
+    else if (any)
+        len = snprintf(reply, sizeof(reply), "error %#x RID %d: %s\n", job->ret, job->ran_on, job->what);
+    else
+        len = snprintf(reply, sizeof(reply), "error %#x %s\n", job->ret, job->what);
+
+    return conn_queue(conn, reply, len);
+}
+
+/// Send the responses that are ready, stopping at the first request that
+/// is still running so they go out in order; returns zero if the connection
+/// should be closed.
+static int conn_flush(conn_t *conn)
+{
+    while (conn->head && atomic_load(&conn->head->state) == JOB_DONE) {
+        job_t *job = conn->head;
+        conn->head = job->next;
+        if (!conn->head)
+            conn->tail = NULL;
+
+        int queued = job_respond(conn, job);
+        job_free(job);
+        if (!queued)
+            return 0;
+    }
+
+    return conn_send(conn);
+}
+
+static void conn_close(conn_t *conn)
+{
+    // Jobs still running are left for their workers to free.
+    for (job_t *job = conn->head, *next; job; job = next) {
+        next = job->next;
+        if (atomic_exchange(&job->state, JOB_ORPHANED) == JOB_DONE)
+            job_free(job);
+    }
+
+    free(conn->out);
+    close(conn->fd);
+}
+
+/// Consume input from a connection; returns zero once it should be closed.
+static int conn_service(conn_t *conn)
+{
+    ssize_t n = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len);
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+    // Clients may hang up their end once they have sent everything; they
+    // still get responses to all of it.
+    if (n == 0) {
+        conn->eof = 1;
+        return 1;
+    }
+
+    conn->len += n;
+
+    char *newline;
+    while ((newline = memchr(conn->buf, '\n', conn->len))) {
+        *newline = 0;
+        if (!handle_line(conn, conn->buf))
+            return 0;
+
+        size_t consumed = newline - conn->buf + 1;
+        memmove(conn->buf, newline + 1, conn->len - consumed);
+        conn->len -= consumed;
+    }
+
+    // Drop clients that send lines longer than we are willing to buffer.
+    return conn->len < sizeof(conn->buf);
+}
+
+/// Refresh the status table and metrics file, whichever are enabled.
+static void *status_publisher(void *arg)
+{
+    (void)arg;
+
+    uint64_t generation = HPMGetChangeGeneration(s_backend);
+    while (!s_should_exit) {
+        IOReturn ret = s_status_table ? HPMStatusTableRefresh(s_status_table, s_backend) : kIOReturnSuccess;
+        if (ret != kIOReturnSuccess)
+            fprintf(stderr, "Failed to refresh port status. (%#x)\n", ret);
+
+        ret = s_metrics_path ? HPMMetricsWriteFile(s_metrics_path) : kIOReturnSuccess;
+        if (ret != kIOReturnSuccess)
+            fprintf(stderr, "Failed to write metrics to %s. (%#x)\n", s_metrics_path, ret);
+
+        HPMWaitForChange(s_backend, &generation, s_status_interval_ms);
+    }
+
+    return NULL;
+}
+
+static int listen_on(char const *path)
+{
+    struct sockaddr_un addr = { 0 };
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        fatalf("Socket path is too long.\n");
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        fatalf("Failed to create socket. (%s)\n", strerror(errno));
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, MAX_CONNS) != 0)
+        fatalf("Failed to listen on %s. (%s)\n", path, strerror(errno));
+
+    return fd;
+}
+
+static void usage(char const *prog)
+{
+    printf("Usage: %s [-s <socket>] [-B <backend>] [-R <retries>] [-a <ms>] [-p <name>] [-m <file>] [-i <ms>]\n"
+           "       [-t <file>]\n\n", prog);
+
+    puts("Options:");
+    puts("  -s <socket>           Path of the control socket (default: " DEFAULT_SOCKET_PATH ")");
+    puts("  -B <backend>          HPM backend to use; see vdmpoke -h");
+    puts("  -R <retries>          Retries for operations failing with transient errors (default: 0)");
+    puts("  -a <ms>               How long 'any' requests may wait for a suitable port (default:");
+    puts("                        60000)");
+    puts("  -p <name>             Publish port status to this shared memory table; 'default'");
+    puts("                        for " kHPMStatusTableDefaultName ", which vdmpoke status reads");
+    puts("  -m <file>             Keep counters and histograms in this file in the OpenMetrics");
+    puts("                        text format, e.g. for a textfile collector");
+    puts("  -i <ms>               How often to refresh published status and metrics (default:");
+    puts("                        1000)");
+    puts("  -t <file>             Keep a binary trace of the last million HPM operations in");
+    puts("                        this file; read it with vdmpoke-trace");
+    puts("  -h                    Show this usage info\n");
+
+    puts("Note:\n  Like vdmpoke, this daemon must run with root permissions.");
+}
+
+int main(int argc, char **argv)
+{
+    char const *socket_path = DEFAULT_SOCKET_PATH;
+    uint32_t retries = 0;
+    char const *status_name = NULL;
+    char const *trace_path = NULL;
+    uint32_t any_timeout_ms = DEFAULT_ANY_TIMEOUT_MS;
+    s_backend = HPMGetDefaultBackend();
+
+    int opt_char = 0;
+    while ((opt_char = getopt(argc, argv, "s:B:R:a:p:m:i:t:h")) != -1) {
+        switch (opt_char) {
+        case 'B':
+            if (flow_select_backend(optarg, &s_backend) != kIOReturnSuccess)
+                fatalf("Unknown or unavailable backend '%s'.\n", optarg);
+            break;
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'R': {
+            char *end = NULL;
+            unsigned long value = strtoul(optarg, &end, 0);
+            if (end == optarg || *end != 0 || value >= UINT32_MAX)
+                fatalf("Invalid retry count '%s'.\n", optarg);
+            retries = (uint32_t)value;
+            break;
+        }
+        case 'a': {
+            char *end = NULL;
+            unsigned long value = strtoul(optarg, &end, 0);
+            if (end == optarg || *end != 0 || value > UINT32_MAX)
+                fatalf("Invalid timeout '%s'.\n", optarg);
+            any_timeout_ms = (uint32_t)value;
+            break;
+        }
+        case 'p':
+            status_name = strcmp(optarg, "default") == 0 ? kHPMStatusTableDefaultName : optarg;
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'm':
+            s_metrics_path = optarg;
+            break;
+        case 'i': {
+            char *end = NULL;
+            unsigned long value = strtoul(optarg, &end, 0);
+            if (end == optarg || *end != 0 || value == 0 || value > UINT32_MAX)
+                fatalf("Invalid refresh interval '%s'.\n", optarg);
+            s_status_interval_ms = (uint32_t)value;
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (s_backend == HPMGetIOKitBackend() && geteuid() != 0)
+        fatalf("Error: Daemon must run with root permissions!\n");
+
+    if (flow_create_retry_policy(retries, &s_retry_policy) != kIOReturnSuccess)
+        fatalf("Failed to create retry policy.\n");
+
+    if (trace_path) {
+        IOReturn ret = HPMTraceEnableFile(trace_path, TRACE_CAPACITY);
+        if (ret != kIOReturnSuccess)
+            fatalf("Failed to trace to %s. (%#x)\n", trace_path, ret);
+    }
+
+    // Workers, and signal handlers on any thread, poke the main thread
+    // through this pipe.
+    if (pipe(s_wake_fds) != 0)
+        fatalf("Failed to create pipe. (%s)\n", strerror(errno));
+    for (int i = 0; i < 2; ++i) {
+        fcntl(s_wake_fds[i], F_SETFL, O_NONBLOCK);
+        fcntl(s_wake_fds[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    struct sigaction sa = { 0 };
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = listen_on(socket_path);
+
+    if (status_name) {
+        IOReturn ret = HPMStatusTableCreate(status_name, &s_status_table);
+        if (ret != kIOReturnSuccess)
+            fatalf("Failed to create status table %s. (%#x)\n", status_name, ret);
+    }
+
+    pthread_t publisher;
+    int publishing = s_status_table || s_metrics_path;
+    if (publishing && pthread_create(&publisher, NULL, status_publisher, NULL) != 0)
+        fatalf("Failed to start status publisher.\n");
+
+    sched_config_t sched_config = {
+        .num_workers = kHPMMaxRIDs,
+        .run = job_run,
+        .classify = port_classify,
+        .cancel = job_cancel,
+        .timeout_ms = any_timeout_ms,
+    };
+    if (sched_create(&sched_config, &s_sched) != kIOReturnSuccess)
+        fatalf("Failed to start port workers.\n");
+
+    conn_t conns[MAX_CONNS];
+    int num_conns = 0;
+
+    while (!s_should_exit) {
+        struct pollfd fds[2 + MAX_CONNS];
+        fds[0].fd = listen_fd;
+        fds[0].events = num_conns < MAX_CONNS ? POLLIN : 0;
+        fds[1].fd = s_wake_fds[0];
+        fds[1].events = POLLIN;
+        for (int i = 0; i < num_conns; ++i) {
+            conn_t const *conn = &conns[i];
+            fds[2 + i].fd = conn->fd;
+            fds[2 + i].events = (conn->eof || conn->out_len > MAX_PENDING_OUTPUT ? 0 : POLLIN)
+                | (conn->out_len ? POLLOUT : 0);
+        }
+
+        if (poll(fds, 2 + num_conns, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            fatalf("Failed to poll. (%s)\n", strerror(errno));
+        }
+
+        char drain[64];
+        if (fds[1].revents & POLLIN)
+            while (read(s_wake_fds[0], drain, sizeof(drain)) > 0)
+                continue;
+
+        // Walk backwards so closed connections can be swapped out in place.
+        for (int i = num_conns - 1; i >= 0; --i) {
+            conn_t *conn = &conns[i];
+            int keep = !(fds[2 + i].revents & ~POLLOUT) || (!conn->eof && conn_service(conn));
+            if (keep)
+                keep = conn_flush(conn);
+            if (keep && (!conn->eof || conn->head || conn->out_len))
+                continue;
+
+            conn_close(conn);
+            conns[i] = conns[--num_conns];
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd >= 0) {
+                // One client not reading its responses mustn't stall the rest.
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+                conns[num_conns] = (conn_t) { .fd = fd };
+                ++num_conns;
+            }
+        }
+    }
+
+    // Lets running jobs finish; queued ones are answered with an error.
+    sched_destroy(s_sched);
+
+    for (int rid = 0; rid < kHPMMaxRIDs; ++rid) {
+        if (!s_sessions[rid].active)
+            continue;
+
+        char const *what = NULL;
+        IOReturn ret = session_release(&s_sessions[rid], &what);
+        if (ret != kIOReturnSuccess)
+            fprintf(stderr, "RID %d: %s. (%#x)\n", rid, what, ret);
+    }
+
+    if (publishing) {
+        // Counts as a change, so the publisher wakes up and sees it should exit.
+        HPMInvalidateServices(s_backend);
+        pthread_join(publisher, NULL);
+    }
+    if (s_status_table)
+        HPMStatusTableDestroy(s_status_table);
+
+    // Include the ports just released.
+    if (s_metrics_path)
+        HPMMetricsWriteFile(s_metrics_path);
+
+    for (int i = 0; i < num_conns; ++i) {
+        conn_flush(&conns[i]);
+        conn_close(&conns[i]);
+    }
+    close(s_wake_fds[0]);
+    close(s_wake_fds[1]);
+    close(listen_fd);
+    unlink(socket_path);
+
+    if (s_retry_policy)
+        HPMRetryPolicyDestroy(s_retry_policy);
+
+    return 0;
+}
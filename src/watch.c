@@ -0,0 +1,187 @@
+//
+//  watch.c
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#include "watch.h"
+
+#include <time.h>
+
+typedef struct {
+    int present;
+    int open;
+    HPMClient hpm;
+
+    /// Whether the status below has been read and reported.
+    int known;
+    HPMConnectionType connection;
+    HPMMode mode;
+} watch_port_t;
+
+typedef struct {
+    watch_config_t const *config;
+    FILE *out;
+    int started;
+    watch_port_t ports[kHPMMaxRIDs];
+} watch_t;
+
+static int watch_is_selected(watch_config_t const *config, int32_t rid)
+{
+    if (!config->num_rids)
+        return 1;
+
+    for (int i = 0; i < config->num_rids; ++i)
+        if (config->rids[i] == rid)
+            return 1;
+
+    return 0;
+}
+
+/// Start an event line; finish it with watch_end_event.
+static void watch_begin_event(watch_t *w, int32_t rid, char const *event)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    fprintf(w->out, "{\"time\":%lld.%03ld,\"rid\":%d,\"event\":\"%s\"", (long long)ts.tv_sec,
+        ts.tv_nsec / 1000000, rid, event);
+}
+
+static void watch_end_event(watch_t *w)
+{
+    // Consumers are usually reading from a pipe and want events straight away.
+    fputs("}\n", w->out);
+    fflush(w->out);
+}
+
+static void watch_forget(watch_port_t *port)
+{
+    if (port->open)
+        HPMClientClose(&port->hpm);
+
+    port->open = 0;
+    port->known = 0;
+}
+
+/// Read a port's status and report what changed; returns whether anything did.
+static int watch_check_port(watch_t *w, int32_t rid)
+{
+    watch_port_t *port = &w->ports[rid];
+    if (!port->open) {
+        if (HPMClientOpenWithBackend(&port->hpm, w->config->backend, rid) != kIOReturnSuccess)
+            return 0;
+
+        port->open = 1;
+    }
+
+    HPMStatus status;
+    if (HPMGetStatus(&port->hpm, 0, &status) != kIOReturnSuccess) {
+        // Most likely the service is going away; if not, the next poll will
+        // reopen it. Nothing was seen to change, so a port whose reads keep
+        // failing is polled no more often than an idle one.
+        HPMClientClose(&port->hpm);
+        port->open = 0;
+        return 0;
+    }
+
+    if (!port->known) {
+        watch_begin_event(w, rid, w->started ? "added" : "state");
+        fprintf(w->out, ",\"connection\":\"%s\",\"mode\":\"%s\"", HPMConnectionTypeGetName(status.connection),
+            HPMModeGetName(status.mode));
+        watch_end_event(w);
+
+        port->known = 1;
+        port->connection = status.connection;
+        port->mode = status.mode;
+        return 1;
+    }
+
+    int changed = 0;
+    if (status.connection != port->connection) {
+        char const *event = port->connection == kHPMConnectionTypeNone ? "plug"
+            : status.connection == kHPMConnectionTypeNone             ? "unplug"
+                                                                      : "connection";
+        watch_begin_event(w, rid, event);
+        fprintf(w->out, ",\"connection\":\"%s\",\"previous\":\"%s\"", HPMConnectionTypeGetName(status.connection),
+            HPMConnectionTypeGetName(port->connection));
+        watch_end_event(w);
+
+        port->connection = status.connection;
+        changed = 1;
+    }
+
+    if (status.mode != port->mode) {
+        watch_begin_event(w, rid, "mode");
+        fprintf(w->out, ",\"mode\":\"%s\",\"previous\":\"%s\"", HPMModeGetName(status.mode),
+            HPMModeGetName(port->mode));
+        watch_end_event(w);
+
+        port->mode = status.mode;
+        changed = 1;
+    }
+
+    return changed;
+}
+
+/// Check every port once; returns whether anything changed.
+static int watch_scan(watch_t *w)
+{
+    int32_t rids[kHPMMaxRIDs];
+    size_t num_rids = 0;
+    if (HPMEnumerateRIDs(w->config->backend, rids, kHPMMaxRIDs, &num_rids) != kIOReturnSuccess)
+        return 0;
+
+    int changed = 0;
+    int seen[kHPMMaxRIDs] = { 0 };
+    for (size_t i = 0; i < num_rids; ++i) {
+        int32_t rid = rids[i];
+        if (rid < 0 || rid >= kHPMMaxRIDs || !watch_is_selected(w->config, rid))
+            continue;
+
+        seen[rid] = 1;
+        w->ports[rid].present = 1;
+        changed |= watch_check_port(w, rid);
+    }
+
+    for (int32_t rid = 0; rid < kHPMMaxRIDs; ++rid) {
+        watch_port_t *port = &w->ports[rid];
+        if (seen[rid] || !port->present)
+            continue;
+
+        if (port->known) {
+            watch_begin_event(w, rid, "removed");
+            watch_end_event(w);
+        }
+
+        watch_forget(port);
+        port->present = 0;
+        changed = 1;
+    }
+
+    w->started = 1;
+    return changed;
+}
+
+void watch_run(watch_config_t const *config, FILE *out)
+{
+    watch_t w = { .config = config, .out = out };
+    uint32_t max_poll_ms = config->max_poll_ms < WATCH_MIN_POLL_MS ? WATCH_MIN_POLL_MS : config->max_poll_ms;
+    uint32_t interval_ms = WATCH_MIN_POLL_MS;
+    uint64_t generation = HPMGetChangeGeneration(config->backend);
+
+    for (;;) {
+        // Changes tend to come in bursts (e.g. a mode switch following a
+        // plug), so check quickly for a while after each one.
+        if (watch_scan(&w))
+            interval_ms = WATCH_MIN_POLL_MS;
+        else if ((interval_ms *= 2) > max_poll_ms)
+            interval_ms = max_poll_ms;
+
+        if (HPMWaitForChange(config->backend, &generation, interval_ms) == kIOReturnSuccess)
+            interval_ms = WATCH_MIN_POLL_MS;
+    }
+}
@@ -0,0 +1,52 @@
+//
+//  watch.h
+//
+//  Copyright (c) 2024-2025 Jon Palmisciano
+//
+//  Use of this source code is governed by the Apache 2.0 license; a full copy
+//  of the license can be found in the LICENSE.txt file.
+//
+
+#pragma once
+
+#include "HPMFraud.h"
+
+#include <stdio.h>
+
+// Watching prints one JSON object per line for every change seen on a port:
+//
+//     {"time":1718000000.123,"rid":0,"event":"plug","connection":"source","previous":"none"}
+//
+// where "time" is the wall clock time in seconds and "event" is one of
+//
+//     state      Initial status of a port, when watching starts
+//     added      A port appeared; with its "connection" and "mode"
+//     removed    A port disappeared
+//     plug       Something was connected; with "connection" and "previous"
+//     unplug     The connection went away; likewise
+//     connection The connection type changed otherwise; likewise
+//     mode       The mode changed; with "mode" and "previous"
+
+/// Interval between polls right after a change, in milliseconds.
+#define WATCH_MIN_POLL_MS 10
+
+/// Default cap on the interval between polls, in milliseconds.
+#define WATCH_DEFAULT_MAX_POLL_MS 500
+
+typedef struct {
+    HPMBackend const *backend;
+
+    /// RIDs to watch, or none for all.
+    int num_rids;
+    int const *rids;
+
+    /// Longest time to go without polling while nothing is happening.
+    uint32_t max_poll_ms;
+} watch_config_t;
+
+/// Watch ports for changes forever, printing events to \p out.
+///
+/// Ports are re-read as soon as the backend reports a change, and otherwise
+/// polled at an interval that starts at WATCH_MIN_POLL_MS after anything has
+/// changed and doubles up to \p max_poll_ms while nothing does.
+void watch_run(watch_config_t const *config, FILE *out);